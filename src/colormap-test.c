@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark for color replacement in the map plugin, run with a list of
+ * images or with no arguments to use a generated map like image */
+
+#include <config.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "data/grits-colormap.h"
+
+#define WIDTH  1024
+#define HEIGHT 512
+#define REPEAT 10
+
+/* The same colors as the map plugin */
+static const guchar colormap[][2][4] = {
+	{{0x73, 0x91, 0xad}, {0x73, 0x91, 0xad, 0x00}}, // Oceans
+	{{0xf6, 0xee, 0xee}, {0xf6, 0xee, 0xee, 0x00}}, // Ground
+	{{0xff, 0xff, 0xff}, {0xff, 0xff, 0xff, 0xff}}, // Borders
+	{{0x73, 0x93, 0xad}, {0x73, 0x93, 0xad, 0x40}}, // Lakes
+	{{0xff, 0xe1, 0x80}, {0xff, 0xe1, 0x80, 0x60}}, // Cities
+};
+
+/* The original loop, comparing each pixel with each color */
+static guchar *apply_simple(const guchar *pixels,
+		gint width, gint height, gint rowstride, gint channels)
+{
+	guchar *out = g_malloc(width * height * 4);
+	for (gint y = 0; y < height; y++)
+	for (gint x = 0; x < width;  x++) {
+		const guchar *src = &pixels[y*rowstride + x*channels];
+		guchar       *dst = &out[(y*width + x)*4];
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst[3] = channels == 4 ? src[3] : 0xff;
+		for (gint j = 0; j < G_N_ELEMENTS(colormap); j++) {
+			if (src[0] == colormap[j][0][0] &&
+			    src[1] == colormap[j][0][1] &&
+			    src[2] == colormap[j][0][2]) {
+				memcpy(dst, colormap[j][1], 4);
+				break;
+			}
+		}
+	}
+	return out;
+}
+
+/* Mostly ocean and ground with borders, lakes, cities and labels */
+static GdkPixbuf *generate(gboolean alpha)
+{
+	GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, 8,
+			WIDTH, HEIGHT);
+	guchar *pixels    = gdk_pixbuf_get_pixels(pixbuf);
+	gint    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	gint    channels  = gdk_pixbuf_get_n_channels(pixbuf);
+	srand(0);
+	for (gint y = 0; y < HEIGHT; y++)
+	for (gint x = 0; x < WIDTH;  x++) {
+		guchar *dst = &pixels[y*rowstride + x*channels];
+		gint    c   = (x + y/2) % 300 < 150 ? 0 : 1;
+		if (x % 97 == 0 || y % 61 == 0)
+			c = 2;
+		if ((x/40 + y/40) % 17 == 0)
+			c = 3 + (x/40) % 2;
+		memcpy(dst, colormap[c][0], 3);
+		if (rand() % 50 == 0)
+			dst[0] = dst[1] = dst[2] = rand() % 256;
+		if (alpha)
+			dst[3] = 0xff;
+	}
+	return pixbuf;
+}
+
+static gboolean bench(const gchar *name, GdkPixbuf *pixbuf, GritsColormap *cmap)
+{
+	const guchar *pixels    = gdk_pixbuf_get_pixels(pixbuf);
+	gint          width     = gdk_pixbuf_get_width(pixbuf);
+	gint          height    = gdk_pixbuf_get_height(pixbuf);
+	gint          rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	gint          channels  = gdk_pixbuf_get_n_channels(pixbuf);
+	GTimer       *timer     = g_timer_new();
+	guchar       *simple = NULL, *lut = NULL;
+
+	g_timer_start(timer);
+	for (gint i = 0; i < REPEAT; i++) {
+		g_free(simple);
+		simple = apply_simple(pixels, width, height, rowstride, channels);
+	}
+	gdouble simple_time = g_timer_elapsed(timer, NULL) / REPEAT;
+
+	g_timer_start(timer);
+	for (gint i = 0; i < REPEAT; i++) {
+		g_free(lut);
+		lut = grits_colormap_apply(cmap, pixels,
+				width, height, rowstride, channels);
+	}
+	gdouble lut_time = g_timer_elapsed(timer, NULL) / REPEAT;
+
+	gboolean same = !memcmp(simple, lut, width * height * 4);
+	g_print("%s: %dx%d, %d channels, simple %.2f ms, lookup %.2f ms (%.1fx)%s\n",
+			name, width, height, channels,
+			simple_time * 1000, lut_time * 1000, simple_time / lut_time,
+			same ? "" : ", OUTPUT DIFFERS");
+	g_free(simple);
+	g_free(lut);
+	g_timer_destroy(timer);
+	return same;
+}
+
+int main(int argc, char **argv)
+{
+	g_type_init();
+
+	GritsColormap *cmap = grits_colormap_new(colormap, G_N_ELEMENTS(colormap));
+	int status = 0;
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(argv[i], NULL);
+			if (!pixbuf) {
+				g_printerr("%s: cannot load image\n", argv[i]);
+				status = 1;
+				continue;
+			}
+			status |= !bench(argv[i], pixbuf, cmap);
+			g_object_unref(pixbuf);
+		}
+	} else {
+		for (int alpha = 0; alpha < 2; alpha++) {
+			GdkPixbuf *pixbuf = generate(alpha);
+			status |= !bench("generated", pixbuf, cmap);
+			g_object_unref(pixbuf);
+		}
+	}
+	grits_colormap_free(cmap);
+	return status;
+}
@@ -0,0 +1,612 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-cache-manager
+ * @short_description: Disk cache quotas
+ *
+ * The cache manager keeps track of the files downloaded by #GritsHttp and
+ * removes the least recently used ones when the cache grows beyond its
+ * quota. Quotas can be set for each cache prefix and for the cache as a
+ * whole, by default the cache is unlimited.
+ *
+ * Access times are recorded in an index file in each prefix directory
+ * instead of relying on the filesystem, which is often mounted noatime.
+ * Eviction runs in a background thread, fetches only wait for it while a
+ * single file is being removed.
+ *
+ * Files stored in a #GritsPack are tracked as well, see
+ * grits_cache_manager_add_packed(). They are evicted by removing them from
+ * the pack, the disk space is only reclaimed when the pack is compacted.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "grits-data.h"
+#include "grits-cache-manager.h"
+#include "grits-pack.h"
+
+#define INDEX_NAME ".cache-index"
+
+/* Evict down to this fraction of the quota so eviction does not run on every
+ * download once the cache is full */
+#define LOW_WATER 0.9
+
+struct _CacheEntry {
+	guint64 size;
+	time_t  atime;
+	guint64 serial; // order of the last access, larger is newer
+	gboolean packed; // stored in the pack instead of its own file
+};
+
+struct _CachePrefix {
+	gchar          *prefix;
+	gchar          *dir;
+	GHashTable     *entries; // local -> struct _CacheEntry
+	GritsCacheStats stats;
+	gboolean        dirty;
+	guint64         evict_bytes; // snapshot of the size used by the evictor
+	guint64         evict_quota;
+	GritsCacheEvictFunc evict_func; // removes packed entries
+	gpointer        evict_data;
+};
+
+/* Copy of an entry for sorting during eviction */
+struct _CacheVictim {
+	struct _CachePrefix *prefix;
+	gchar               *local;
+	guint64              size;
+	time_t               atime;
+	guint64              serial;
+};
+
+static GHashTable     *grits_cache_prefixes; // prefix -> struct _CachePrefix
+static GritsCacheStats grits_cache_global;
+static GThreadPool    *grits_cache_evictor;
+static gboolean        grits_cache_evicting;
+static guint64         grits_cache_serial;
+G_LOCK_DEFINE_STATIC(grits_cache);
+G_LOCK_DEFINE_STATIC(grits_cache_index);
+
+static void _grits_cache_scan(struct _CachePrefix *prefix, const gchar *rel);
+static void _grits_cache_evict(gpointer data, gpointer user_data);
+
+/* Add or replace an entry, must be called with the lock held */
+static void _grits_cache_set(struct _CachePrefix *prefix, const gchar *local,
+		guint64 size, time_t atime)
+{
+	struct _CacheEntry *entry = g_hash_table_lookup(prefix->entries, local);
+	if (entry) {
+		prefix->stats.bytes      -= entry->size;
+		grits_cache_global.bytes -= entry->size;
+	} else {
+		entry = g_new0(struct _CacheEntry, 1);
+		g_hash_table_insert(prefix->entries, g_strdup(local), entry);
+		prefix->stats.entries++;
+		grits_cache_global.entries++;
+	}
+	entry->size   = size;
+	entry->atime  = atime;
+	entry->serial = ++grits_cache_serial;
+	entry->packed = FALSE;
+	prefix->stats.bytes      += size;
+	grits_cache_global.bytes += size;
+	prefix->dirty = TRUE;
+}
+
+/* Remove an entry, must be called with the lock held */
+static gboolean _grits_cache_unset(struct _CachePrefix *prefix, const gchar *local)
+{
+	struct _CacheEntry *entry = g_hash_table_lookup(prefix->entries, local);
+	if (!entry)
+		return FALSE;
+	prefix->stats.bytes      -= entry->size;
+	grits_cache_global.bytes -= entry->size;
+	prefix->stats.entries--;
+	grits_cache_global.entries--;
+	g_hash_table_remove(prefix->entries, local);
+	prefix->dirty = TRUE;
+	return TRUE;
+}
+
+/* Record a hit on an entry, must be called with the lock held */
+static void _grits_cache_hit(struct _CachePrefix *prefix, const gchar *local)
+{
+	struct _CacheEntry *entry = g_hash_table_lookup(prefix->entries, local);
+	if (entry) {
+		entry->atime  = time(NULL);
+		entry->serial = ++grits_cache_serial;
+		prefix->dirty = TRUE;
+	}
+	prefix->stats.hits++;
+	grits_cache_global.hits++;
+}
+
+/* Parse the index, each line is "atime size local". The file is read by the
+ * caller without the lock, this must be called with the lock held */
+static void _grits_cache_load(struct _CachePrefix *prefix, const gchar *text)
+{
+	gchar **lines = g_strsplit(text, "\n", -1);
+	for (gchar **line = lines; *line; line++) {
+		gchar *end, *local;
+		time_t  atime = strtol(*line, &end, 10);
+		guint64 size  = g_ascii_strtoull(end, &local, 10);
+		if (local == end || *local != ' ' || !local[1])
+			continue;
+		_grits_cache_set(prefix, local+1, size, atime);
+	}
+	g_strfreev(lines);
+	prefix->dirty = FALSE;
+}
+
+/* Write the index, the entries are copied with the lock held and written
+ * without it so fetches are not blocked by the disk. Must be called without
+ * the lock held */
+static void _grits_cache_save(struct _CachePrefix *prefix)
+{
+	G_LOCK(grits_cache_index);
+	G_LOCK(grits_cache);
+	if (!prefix->dirty) {
+		G_UNLOCK(grits_cache);
+		G_UNLOCK(grits_cache_index);
+		return;
+	}
+	GString *text = g_string_new("");
+	GHashTableIter iter;
+	gpointer local, _entry;
+	g_hash_table_iter_init(&iter, prefix->entries);
+	while (g_hash_table_iter_next(&iter, &local, &_entry)) {
+		struct _CacheEntry *entry = _entry;
+		g_string_append_printf(text, "%ld %" G_GUINT64_FORMAT " %s\n",
+				(long)entry->atime, entry->size, (gchar*)local);
+	}
+	prefix->dirty = FALSE;
+	G_UNLOCK(grits_cache);
+
+	gchar *path = g_build_filename(prefix->dir, INDEX_NAME, NULL);
+	gchar *tmp  = g_strconcat(path, ".tmp", NULL);
+	FILE  *fp   = fopen_p(tmp, "wb");
+	if (fp && fwrite(text->str, text->len, 1, fp) && !fclose(fp))
+		g_rename(tmp, path);
+	else if (fp)
+		g_remove(tmp);
+	g_free(path);
+	g_free(tmp);
+	g_string_free(text, TRUE);
+	G_UNLOCK(grits_cache_index);
+}
+
+/* Build the index from the files on disk, used the first time a prefix is
+ * seen so files cached by older versions are counted. Runs without the lock
+ * held except when adding entries */
+static void _grits_cache_scan(struct _CachePrefix *prefix, const gchar *rel)
+{
+	gchar *path = g_build_filename(prefix->dir, rel, NULL);
+	GDir  *dir  = g_dir_open(path, 0, NULL);
+	const gchar *name;
+	while (dir && (name = g_dir_read_name(dir))) {
+		if (name[0] == '.' || g_str_has_suffix(name, ".part") ||
+		                      g_str_has_suffix(name, ".meta"))
+			continue;
+		/* Packs are not tiles, evicting one would empty the cache */
+		if (!*rel && (g_str_has_prefix(name, GRITS_PACK_DATA) ||
+		              g_str_has_prefix(name, GRITS_PACK_INDEX)))
+			continue;
+		gchar *child_rel  = *rel ? g_build_filename(rel, name, NULL)
+		                         : g_strdup(name);
+		gchar *child_path = g_build_filename(path, name, NULL);
+		struct stat st;
+		if (g_file_test(child_path, G_FILE_TEST_IS_DIR)) {
+			_grits_cache_scan(prefix, child_rel);
+		} else if (g_stat(child_path, &st) == 0) {
+			G_LOCK(grits_cache);
+			if (!g_hash_table_lookup(prefix->entries, child_rel))
+				_grits_cache_set(prefix, child_rel, st.st_size, st.st_mtime);
+			G_UNLOCK(grits_cache);
+		}
+		g_free(child_rel);
+		g_free(child_path);
+	}
+	if (dir)
+		g_dir_close(dir);
+	g_free(path);
+}
+
+/* Background jobs, either a prefix to scan or 1 to evict */
+static void _grits_cache_job(gpointer data, gpointer user_data)
+{
+	if (data != GINT_TO_POINTER(1)) {
+		_grits_cache_scan(data, "");
+		_grits_cache_save(data);
+	}
+	_grits_cache_evict(NULL, NULL);
+}
+
+/* Find the state for a prefix, loading the index if needed. Must be called
+ * without the lock held so other prefixes are not blocked while the index is
+ * read, prefixes are never freed */
+static struct _CachePrefix *_grits_cache_prefix(const gchar *name)
+{
+	G_LOCK(grits_cache);
+	if (!grits_cache_prefixes) {
+		grits_cache_prefixes = g_hash_table_new(g_str_hash, g_str_equal);
+		grits_cache_evictor  = g_thread_pool_new(_grits_cache_job,
+				NULL, 1, FALSE, NULL);
+	}
+	struct _CachePrefix *prefix = g_hash_table_lookup(grits_cache_prefixes, name);
+	G_UNLOCK(grits_cache);
+	if (prefix)
+		return prefix;
+
+	/* Another thread may add the prefix while the index is read */
+	gchar *dir  = g_build_filename(g_get_user_cache_dir(), PACKAGE, name, NULL);
+	gchar *path = g_build_filename(dir, INDEX_NAME, NULL);
+	gchar *text = NULL;
+	g_file_get_contents(path, &text, NULL, NULL);
+	g_free(path);
+
+	G_LOCK(grits_cache);
+	prefix = g_hash_table_lookup(grits_cache_prefixes, name);
+	if (!prefix) {
+		prefix = g_new0(struct _CachePrefix, 1);
+		prefix->prefix  = g_strdup(name);
+		prefix->dir     = dir;
+		prefix->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, g_free);
+		g_hash_table_insert(grits_cache_prefixes, prefix->prefix, prefix);
+		if (text)
+			_grits_cache_load(prefix, text);
+		else
+			g_thread_pool_push(grits_cache_evictor, prefix, NULL);
+		dir = NULL;
+	}
+	G_UNLOCK(grits_cache);
+	g_free(dir);
+	g_free(text);
+	return prefix;
+}
+
+static gboolean _grits_cache_over(guint64 bytes, guint64 quota, gdouble fraction)
+{
+	return quota && bytes > quota * fraction;
+}
+
+/* Queue an eviction if any quota is exceeded, must be called with the lock
+ * held */
+static void _grits_cache_check(struct _CachePrefix *prefix)
+{
+	if (grits_cache_evicting)
+		return;
+	if (_grits_cache_over(prefix->stats.bytes, prefix->stats.quota, 1) ||
+	    _grits_cache_over(grits_cache_global.bytes, grits_cache_global.quota, 1)) {
+		grits_cache_evicting = TRUE;
+		g_thread_pool_push(grits_cache_evictor, GINT_TO_POINTER(1), NULL);
+	}
+}
+
+static gint _grits_cache_victim_cmp(gconstpointer _a, gconstpointer _b)
+{
+	const struct _CacheVictim *a = _a, *b = _b;
+	return a->atime  < b->atime  ? -1 :
+	       a->atime  > b->atime  ?  1 :
+	       a->serial < b->serial ? -1 :
+	       a->serial > b->serial ?  1 : 0;
+}
+
+/* Remove the least recently used files until each prefix and the whole
+ * cache are below the low water mark. Runs in the background thread, the
+ * lock is only held while copying the entries and removing each victim */
+static void _grits_cache_evict(gpointer data, gpointer user_data)
+{
+	/* Copy every entry */
+	GArray *victims = g_array_new(FALSE, FALSE, sizeof(struct _CacheVictim));
+	GHashTableIter piter, eiter;
+	gpointer key, value;
+	G_LOCK(grits_cache);
+	grits_cache_evicting = FALSE;
+	guint64 global_bytes = grits_cache_global.bytes;
+	guint64 global_quota = grits_cache_global.quota;
+	g_hash_table_iter_init(&piter, grits_cache_prefixes);
+	while (g_hash_table_iter_next(&piter, &key, &value)) {
+		struct _CachePrefix *prefix = value;
+		prefix->evict_bytes = prefix->stats.bytes;
+		prefix->evict_quota = prefix->stats.quota;
+		g_hash_table_iter_init(&eiter, prefix->entries);
+		while (g_hash_table_iter_next(&eiter, &key, &value)) {
+			struct _CacheEntry *entry = value;
+			/* Packed files can only be removed while the pack is open */
+			if (entry->packed && !prefix->evict_func)
+				continue;
+			struct _CacheVictim victim = {prefix, g_strdup(key),
+				entry->size, entry->atime, entry->serial};
+			g_array_append_val(victims, victim);
+		}
+	}
+	G_UNLOCK(grits_cache);
+
+	/* Sort by access time and pick the files to remove */
+	g_array_sort(victims, _grits_cache_victim_cmp);
+	GSList *picked = NULL;
+	for (guint i = 0; i < victims->len; i++) {
+		struct _CacheVictim *victim =
+			&g_array_index(victims, struct _CacheVictim, i);
+		struct _CachePrefix *prefix = victim->prefix;
+		gboolean global = _grits_cache_over(global_bytes,
+				global_quota, LOW_WATER);
+		gboolean local  = _grits_cache_over(prefix->evict_bytes,
+				prefix->evict_quota, LOW_WATER);
+		if (!global && !local)
+			continue;
+		global_bytes        -= victim->size;
+		prefix->evict_bytes -= victim->size;
+		picked = g_slist_prepend(picked, victim);
+	}
+
+	/* Remove the files, unless they were used since they were copied. Each
+	 * entry is checked again just before its file is removed, and the lock
+	 * is held while removing it so grits_cache_manager_claim never returns
+	 * a file which is about to be removed */
+	for (GSList *cur = picked; cur; cur = cur->next) {
+		struct _CacheVictim *victim = cur->data;
+		struct _CachePrefix *prefix = victim->prefix;
+		G_LOCK(grits_cache);
+		struct _CacheEntry  *entry  =
+			g_hash_table_lookup(prefix->entries, victim->local);
+		if (entry && entry->serial == victim->serial && entry->packed) {
+			if (!prefix->evict_func) {
+				G_UNLOCK(grits_cache);
+				continue;
+			}
+			g_debug("GritsCacheManager: evict - %s%s (packed)",
+					prefix->prefix, victim->local);
+			prefix->evict_func(victim->local, prefix->evict_data);
+			_grits_cache_unset(prefix, victim->local);
+			prefix->stats.evicted++;
+			grits_cache_global.evicted++;
+		} else if (entry && entry->serial == victim->serial) {
+			gchar *path = g_build_filename(prefix->dir,
+					victim->local, NULL);
+			gchar *meta = g_strconcat(path, ".meta", NULL);
+			g_debug("GritsCacheManager: evict - %s", path);
+			g_remove(path);
+			g_remove(meta);
+			g_free(path);
+			g_free(meta);
+			_grits_cache_unset(prefix, victim->local);
+			prefix->stats.evicted++;
+			grits_cache_global.evicted++;
+		}
+		G_UNLOCK(grits_cache);
+	}
+	g_slist_free(picked);
+	for (guint i = 0; i < victims->len; i++)
+		g_free(g_array_index(victims, struct _CacheVictim, i).local);
+	g_array_free(victims, TRUE);
+
+	/* Save the indexes after the files are removed, entries left for
+	 * removed files are harmless while untracked files are never evicted */
+	G_LOCK(grits_cache);
+	GList *prefixes = g_hash_table_get_values(grits_cache_prefixes);
+	G_UNLOCK(grits_cache);
+	for (GList *cur = prefixes; cur; cur = cur->next)
+		_grits_cache_save(cur->data);
+	g_list_free(prefixes);
+}
+
+/**
+ * grits_cache_manager_set_quota:
+ * @prefix: the cache prefix, or %NULL for the whole cache
+ * @bytes:  the maximum size of the cache in bytes, or 0 for unlimited
+ *
+ * Limit the disk space used by cached files. When the limit is exceeded the
+ * least recently used files are removed in the background.
+ */
+void grits_cache_manager_set_quota(const gchar *prefix, guint64 bytes)
+{
+	g_debug("GritsCacheManager: set_quota - %s=%" G_GUINT64_FORMAT,
+			prefix ?: "(global)", bytes);
+	struct _CachePrefix *state = prefix ? _grits_cache_prefix(prefix) : NULL;
+	G_LOCK(grits_cache);
+	if (state) {
+		state->stats.quota = bytes;
+		_grits_cache_check(state);
+	} else {
+		grits_cache_global.quota = bytes;
+	}
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_get_stats:
+ * @prefix: the cache prefix, or %NULL for the whole cache
+ * @stats:  location to store the statistics
+ *
+ * Get the size of the cache and how often it has been used. The hit rate is
+ * @hits / (@hits + @misses). The totals for the whole cache only include the
+ * prefixes which have been used by this process.
+ */
+void grits_cache_manager_get_stats(const gchar *prefix, GritsCacheStats *stats)
+{
+	struct _CachePrefix *state = prefix ? _grits_cache_prefix(prefix) : NULL;
+	G_LOCK(grits_cache);
+	if (state)
+		*stats = state->stats;
+	else
+		*stats = grits_cache_global;
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_access:
+ * @prefix: the cache prefix
+ * @local:  the name of the file within the prefix
+ * @hit:    %TRUE if the cached file was used, %FALSE if it will be downloaded
+ *
+ * Record an access to a cached file, this is called by #GritsHttp.
+ */
+void grits_cache_manager_access(const gchar *prefix, const gchar *local,
+		gboolean hit)
+{
+	struct _CachePrefix *state = _grits_cache_prefix(prefix);
+	G_LOCK(grits_cache);
+	if (hit) {
+		_grits_cache_hit(state, local);
+	} else {
+		state->stats.misses++;
+		grits_cache_global.misses++;
+	}
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_claim:
+ * @prefix: the cache prefix
+ * @local:  the name of the file within the prefix
+ * @path:   the path to the cached file
+ *
+ * Check that a cached file exists and record a hit on it. Unlike testing the
+ * file before calling grits_cache_manager_access, the file can not be evicted
+ * in between, and an eviction which is already running will keep it.
+ *
+ * Returns: %TRUE if the file exists
+ */
+gboolean grits_cache_manager_claim(const gchar *prefix, const gchar *local,
+		const gchar *path)
+{
+	struct _CachePrefix *state = _grits_cache_prefix(prefix);
+	G_LOCK(grits_cache);
+	gboolean exists = g_file_test(path, G_FILE_TEST_EXISTS);
+	if (exists)
+		_grits_cache_hit(state, local);
+	G_UNLOCK(grits_cache);
+	return exists;
+}
+
+/**
+ * grits_cache_manager_add:
+ * @prefix: the cache prefix
+ * @local:  the name of the file within the prefix
+ * @path:   the path to the cached file
+ *
+ * Record a file which has been downloaded, this is called by #GritsHttp.
+ */
+void grits_cache_manager_add(const gchar *prefix, const gchar *local,
+		const gchar *path)
+{
+	struct stat st;
+	if (g_stat(path, &st) != 0)
+		return;
+	struct _CachePrefix *state = _grits_cache_prefix(prefix);
+	G_LOCK(grits_cache);
+	_grits_cache_set(state, local, st.st_size, time(NULL));
+	_grits_cache_check(state);
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_add_packed:
+ * @prefix: the cache prefix
+ * @local:  the name of the file within the pack
+ * @size:   the length of the file
+ *
+ * Record a file which is stored in a #GritsPack, this is called by #GritsHttp
+ * when a file is added to the pack and when the pack is opened. The access
+ * time of a file which is already known is kept.
+ */
+void grits_cache_manager_add_packed(const gchar *prefix, const gchar *local,
+		guint64 size)
+{
+	struct _CachePrefix *state = _grits_cache_prefix(prefix);
+	G_LOCK(grits_cache);
+	struct _CacheEntry *entry = g_hash_table_lookup(state->entries, local);
+	if (!entry) {
+		_grits_cache_set(state, local, size, time(NULL));
+		entry = g_hash_table_lookup(state->entries, local);
+	} else if (entry->size != size) {
+		state->stats.bytes      += size - entry->size;
+		grits_cache_global.bytes += size - entry->size;
+		entry->size  = size;
+		state->dirty = TRUE;
+	}
+	entry->packed = TRUE;
+	_grits_cache_check(state);
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_set_evict_func:
+ * @prefix:    the cache prefix
+ * @func:      function which removes a packed file, or %NULL
+ * @user_data: user data to pass to @func
+ *
+ * Set the function used to evict files recorded with
+ * grits_cache_manager_add_packed(). It is called from the eviction thread
+ * with the cache locked, so it must not call back into the cache manager.
+ * Packed files are kept while no function is set.
+ */
+void grits_cache_manager_set_evict_func(const gchar *prefix,
+		GritsCacheEvictFunc func, gpointer user_data)
+{
+	struct _CachePrefix *state = _grits_cache_prefix(prefix);
+	G_LOCK(grits_cache);
+	state->evict_func = func;
+	state->evict_data = user_data;
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_remove:
+ * @prefix: the cache prefix
+ * @local:  the name of the file within the prefix
+ *
+ * Record that a cached file has been deleted, this is called by #GritsHttp.
+ */
+void grits_cache_manager_remove(const gchar *prefix, const gchar *local)
+{
+	struct _CachePrefix *state = _grits_cache_prefix(prefix);
+	G_LOCK(grits_cache);
+	_grits_cache_unset(state, local);
+	G_UNLOCK(grits_cache);
+}
+
+/**
+ * grits_cache_manager_sync:
+ * @prefix: the cache prefix, or %NULL for every prefix
+ *
+ * Write the access times for cached files to disk.
+ */
+void grits_cache_manager_sync(const gchar *prefix)
+{
+	GList *prefixes = NULL;
+	if (prefix) {
+		prefixes = g_list_prepend(NULL, _grits_cache_prefix(prefix));
+	} else {
+		G_LOCK(grits_cache);
+		if (grits_cache_prefixes)
+			prefixes = g_hash_table_get_values(grits_cache_prefixes);
+		G_UNLOCK(grits_cache);
+	}
+	for (GList *cur = prefixes; cur; cur = cur->next)
+		_grits_cache_save(cur->data);
+	g_list_free(prefixes);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_CACHE_MANAGER_H__
+#define __GRITS_CACHE_MANAGER_H__
+
+#include <glib.h>
+
+typedef struct _GritsCacheStats {
+	guint64 quota;   // maximum size in bytes, 0 for unlimited
+	guint64 bytes;   // current size in bytes
+	guint   entries; // number of cached files
+	guint   hits;    // fetches served from the cache
+	guint   misses;  // fetches which required a download
+	guint   evicted; // files removed to stay within the quota
+} GritsCacheStats;
+
+/**
+ * GritsCacheEvictFunc:
+ * @local:     the name of the file within the prefix
+ * @user_data: user data passed to grits_cache_manager_set_evict_func()
+ *
+ * Removes a packed file which is being evicted.
+ *
+ * Returns: %TRUE if the file was removed
+ */
+typedef gboolean (*GritsCacheEvictFunc)(const gchar *local, gpointer user_data);
+
+void grits_cache_manager_set_quota(const gchar *prefix, guint64 bytes);
+
+void grits_cache_manager_get_stats(const gchar *prefix, GritsCacheStats *stats);
+
+void grits_cache_manager_access(const gchar *prefix, const gchar *local,
+		gboolean hit);
+
+gboolean grits_cache_manager_claim(const gchar *prefix, const gchar *local,
+		const gchar *path);
+
+void grits_cache_manager_add(const gchar *prefix, const gchar *local,
+		const gchar *path);
+
+void grits_cache_manager_add_packed(const gchar *prefix, const gchar *local,
+		guint64 size);
+
+void grits_cache_manager_set_evict_func(const gchar *prefix,
+		GritsCacheEvictFunc func, gpointer user_data);
+
+void grits_cache_manager_remove(const gchar *prefix, const gchar *local);
+
+void grits_cache_manager_sync(const gchar *prefix);
+
+#endif
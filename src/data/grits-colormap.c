@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-colormap
+ * @short_description: Replacing colors in images
+ *
+ * A #GritsColormap replaces specific RGB colors in an image with new RGBA
+ * colors, for example to make the background of a map transparent.
+ *
+ * Colors are looked up in a small hash table keyed by the packed RGB value.
+ * Images such as maps are mostly made of long runs of the same color, so the
+ * result for the previous pixel is reused until the color changes and most
+ * pixels cost a single compare.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+
+#include "grits-colormap.h"
+
+/* Number of hash slots, a power of two larger than the number of colors */
+#define COLORMAP_BITS  6
+#define COLORMAP_SLOTS (1 << COLORMAP_BITS)
+
+/* Keys are 24 bit colors, this marks a slot as used */
+#define COLORMAP_USED  0x01000000
+
+struct _GritsColormap {
+	guint32 keys[COLORMAP_SLOTS];
+	guchar  values[COLORMAP_SLOTS][4];
+};
+
+static inline guint32 _grits_colormap_key(const guchar *rgb)
+{
+	return rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+}
+
+static inline guint _grits_colormap_hash(guint32 key)
+{
+	return (key * 2654435761u) >> (32 - COLORMAP_BITS);
+}
+
+/* Find the replacement for a color, or NULL if it is not mapped */
+static inline const guchar *_grits_colormap_lookup(GritsColormap *colormap,
+		guint32 key)
+{
+	guint slot = _grits_colormap_hash(key);
+	while (colormap->keys[slot]) {
+		if (colormap->keys[slot] == (key | COLORMAP_USED))
+			return colormap->values[slot];
+		slot = (slot + 1) % COLORMAP_SLOTS;
+	}
+	return NULL;
+}
+
+/**
+ * grits_colormap_new:
+ * @colors: pairs of RGB colors to replace and the RGBA colors to replace
+ *          them with, the fourth byte of the first color is ignored
+ * @count:  the number of pairs in @colors
+ *
+ * Create a colormap for use with grits_colormap_apply(). When a color is
+ * listed more than once the first entry is used.
+ *
+ * Returns: the new #GritsColormap, or %NULL if there are too many colors
+ */
+GritsColormap *grits_colormap_new(const guchar (*colors)[2][4], gint count)
+{
+	if (count >= COLORMAP_SLOTS / 2) {
+		g_warning("GritsColormap: new - too many colors %d", count);
+		return NULL;
+	}
+	GritsColormap *colormap = g_new0(GritsColormap, 1);
+	for (gint i = 0; i < count; i++) {
+		guint32 key = _grits_colormap_key(colors[i][0]);
+		if (_grits_colormap_lookup(colormap, key))
+			continue;
+		guint slot = _grits_colormap_hash(key);
+		while (colormap->keys[slot])
+			slot = (slot + 1) % COLORMAP_SLOTS;
+		colormap->keys[slot] = key | COLORMAP_USED;
+		memcpy(colormap->values[slot], colors[i][1], 4);
+	}
+	return colormap;
+}
+
+/* Pixels are handled as whole words so a run of the same color costs one
+ * compare and one store per pixel. Inlined separately for each number of
+ * channels so the inner loop has no branches on the pixel format. */
+static inline void _grits_colormap_apply(GritsColormap *colormap,
+		const guchar *pixels, guchar *out,
+		gint width, gint height, gint rowstride, const gint channels)
+{
+	for (gint y = 0; y < height; y++) {
+		const guchar *src = pixels + y*rowstride;
+		guint32      *dst = (guint32*)(out + y*width*4);
+		guint32 last = 0, value = 0;
+		for (gint x = 0; x < width; x++, src += channels) {
+			guchar pixel[4] = {src[0], src[1], src[2],
+				channels == 4 ? src[3] : 0xff};
+			guint32 word;
+			memcpy(&word, pixel, 4);
+			if (word != last || x == 0) {
+				const guchar *repl = _grits_colormap_lookup(colormap,
+						_grits_colormap_key(pixel));
+				memcpy(&value, repl ?: pixel, 4);
+				last = word;
+			}
+			dst[x] = value;
+		}
+	}
+}
+
+/**
+ * grits_colormap_apply:
+ * @colormap:  the #GritsColormap to use
+ * @pixels:    the image, with 3 or 4 bytes per pixel
+ * @width:     width of the image in pixels
+ * @height:    height of the image in pixels
+ * @rowstride: bytes between the start of each row
+ * @channels:  bytes per pixel, 3 for RGB or 4 for RGBA
+ *
+ * Replace the colors in an image. The result always has an alpha channel,
+ * pixels which are not replaced keep their color and alpha, or are opaque
+ * if the image has no alpha channel.
+ *
+ * Returns: the new tightly packed RGBA image, free with g_free()
+ */
+guchar *grits_colormap_apply(GritsColormap *colormap, const guchar *pixels,
+		gint width, gint height, gint rowstride, gint channels)
+{
+	guchar *out = g_malloc(width * height * 4);
+	if (channels == 4)
+		_grits_colormap_apply(colormap, pixels, out,
+				width, height, rowstride, 4);
+	else
+		_grits_colormap_apply(colormap, pixels, out,
+				width, height, rowstride, 3);
+	return out;
+}
+
+/**
+ * grits_colormap_free:
+ * @colormap: the #GritsColormap to free
+ *
+ * Free a colormap created with grits_colormap_new().
+ */
+void grits_colormap_free(GritsColormap *colormap)
+{
+	g_free(colormap);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_COLORMAP_H__
+#define __GRITS_COLORMAP_H__
+
+#include <glib.h>
+
+typedef struct _GritsColormap GritsColormap;
+
+GritsColormap *grits_colormap_new(const guchar (*colors)[2][4], gint count);
+
+guchar *grits_colormap_apply(GritsColormap *colormap, const guchar *pixels,
+		gint width, gint height, gint rowstride, gint channels);
+
+void grits_colormap_free(GritsColormap *colormap);
+
+#endif
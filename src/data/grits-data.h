@@ -28,6 +28,11 @@
  * @GRITS_REFRESH: Delete the existing file and fetch a new copy
  *
  * Various methods for caching data
+ *
+ * When the server provides an ETag or Last-Modified header, %GRITS_UPDATE and
+ * %GRITS_REFRESH keep the existing file and revalidate it with a conditional
+ * request, so an unmodified file is not downloaded again. %GRITS_UPDATE also
+ * skips the request while the file has not expired.
  */
 typedef enum {
 	GRITS_LOCAL,
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-delta
+ * @short_description: Compact storage for elevation tiles
+ *
+ * Elevation samples change slowly from one row to the next, so each sample
+ * is stored as the difference from the sample above it. The differences are
+ * split into blocks of up to 16 samples which are stored using the fewest
+ * bits that fit every difference in the block: none for flat areas, 4, 8 or
+ * the full 16 bits.
+ *
+ * Decoding only adds each block to the previous row, so the inner loops
+ * have no dependencies between samples and can be vectorized by the
+ * compiler.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+
+#include "grits-delta.h"
+
+#define DELTA_MAGIC  "GDT1"
+#define DELTA_HEADER 8
+#define DELTA_BLOCK  16
+
+enum {
+	DELTA_ZERO,
+	DELTA_NIBBLE,
+	DELTA_BYTE,
+	DELTA_WORD,
+};
+
+/* Bytes used by each type of block, excluding the type byte */
+static const gint delta_size[] = {
+	[DELTA_ZERO]   = 0,
+	[DELTA_NIBBLE] = DELTA_BLOCK/2,
+	[DELTA_BYTE]   = DELTA_BLOCK,
+	[DELTA_WORD]   = DELTA_BLOCK*2,
+};
+
+static gint _grits_delta_type(const gint16 *diff, gint n)
+{
+	gint16 min = 0, max = 0;
+	for (gint i = 0; i < n; i++) {
+		min = MIN(min, diff[i]);
+		max = MAX(max, diff[i]);
+	}
+	if (min == 0 && max == 0)       return DELTA_ZERO;
+	if (min >= -8 && max <= 7)      return DELTA_NIBBLE;
+	if (min >= -128 && max <= 127)  return DELTA_BYTE;
+	return DELTA_WORD;
+}
+
+/**
+ * grits_delta_encode:
+ * @data:   the samples, @height rows of @width samples
+ * @width:  number of samples in each row
+ * @height: number of rows
+ * @length: location to store the length of the encoded data
+ *
+ * Encode an elevation tile, the samples are restored exactly by
+ * grits_delta_decode().
+ *
+ * Returns: the encoded data, free with g_free()
+ */
+guint8 *grits_delta_encode(const gint16 *data, gint width, gint height,
+		gsize *length)
+{
+	gint    blocks = (width + DELTA_BLOCK - 1) / DELTA_BLOCK;
+	guint8 *buf    = g_malloc(DELTA_HEADER +
+			(gsize)height * blocks * (1 + DELTA_BLOCK*2));
+	guint8 *out    = buf + DELTA_HEADER;
+	gint16 *zero   = g_new0(gint16, width);
+
+	memcpy(buf, DELTA_MAGIC, 4);
+	buf[4] = width  & 0xff; buf[5] = width  >> 8;
+	buf[6] = height & 0xff; buf[7] = height >> 8;
+
+	for (gint y = 0; y < height; y++) {
+		const gint16 *row  = data + y*width;
+		const gint16 *prev = y > 0 ? row - width : zero;
+		for (gint x = 0; x < width; x += DELTA_BLOCK) {
+			gint16 diff[DELTA_BLOCK] = {};
+			gint   n = MIN(DELTA_BLOCK, width - x);
+			for (gint i = 0; i < n; i++)
+				diff[i] = (gint16)(row[x+i] - prev[x+i]);
+			gint type = _grits_delta_type(diff, n);
+			*out++ = type;
+			for (gint i = 0; i < DELTA_BLOCK; i++) {
+				switch (type) {
+				case DELTA_NIBBLE:
+					if (i % 2 == 0)
+						out[i/2] = diff[i] & 0x0f;
+					else
+						out[i/2] |= (guint8)diff[i] << 4;
+					break;
+				case DELTA_BYTE:
+					out[i] = diff[i];
+					break;
+				case DELTA_WORD:
+					out[i*2+0] = (guint16)diff[i] & 0xff;
+					out[i*2+1] = (guint16)diff[i] >> 8;
+					break;
+				}
+			}
+			out += delta_size[type];
+		}
+	}
+
+	g_free(zero);
+	*length = out - buf;
+	return g_realloc(buf, *length);
+}
+
+/**
+ * grits_delta_decode:
+ * @buf:    data from grits_delta_encode()
+ * @length: length of @buf
+ * @data:   location to store the samples, @width * @height samples
+ * @width:  the expected number of samples in each row
+ * @height: the expected number of rows
+ *
+ * Decode an elevation tile encoded by grits_delta_encode().
+ *
+ * Returns: %FALSE if @buf is not a valid tile of the expected size
+ */
+gboolean grits_delta_decode(const guint8 *buf, gsize length,
+		gint16 *data, gint width, gint height)
+{
+	if (length < DELTA_HEADER || memcmp(buf, DELTA_MAGIC, 4) ||
+	    (buf[4] | buf[5] << 8) != width ||
+	    (buf[6] | buf[7] << 8) != height)
+		return FALSE;
+
+	const guint8 *in  = buf + DELTA_HEADER;
+	const guint8 *end = buf + length;
+	gint16 *zero = g_new0(gint16, width);
+	gboolean valid = TRUE;
+
+	for (gint y = 0; valid && y < height; y++) {
+		gint16       *row  = data + y*width;
+		const gint16 *prev = y > 0 ? row - width : zero;
+		for (gint x = 0; valid && x < width; x += DELTA_BLOCK) {
+			gint n = MIN(DELTA_BLOCK, width - x);
+			if (in >= end || *in > DELTA_WORD ||
+			    end - in < 1 + delta_size[*in]) {
+				valid = FALSE;
+				break;
+			}
+			gint16       *dst = row  + x;
+			const gint16 *src = prev + x;
+			switch (*in++) {
+			case DELTA_ZERO:
+				for (gint i = 0; i < n; i++)
+					dst[i] = src[i];
+				break;
+			case DELTA_NIBBLE:
+				for (gint i = 0; i < n; i++)
+					dst[i] = src[i] + (gint8)
+						((in[i/2] >> (i%2*4)) << 4) / 16;
+				in += DELTA_BLOCK/2;
+				break;
+			case DELTA_BYTE:
+				for (gint i = 0; i < n; i++)
+					dst[i] = src[i] + (gint8)in[i];
+				in += DELTA_BLOCK;
+				break;
+			case DELTA_WORD:
+				for (gint i = 0; i < n; i++)
+					dst[i] = src[i] + (gint16)(in[i*2] | in[i*2+1] << 8);
+				in += DELTA_BLOCK*2;
+				break;
+			}
+		}
+	}
+
+	g_free(zero);
+	return valid && in == end;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_DELTA_H__
+#define __GRITS_DELTA_H__
+
+#include <glib.h>
+
+guint8 *grits_delta_encode(const gint16 *data, gint width, gint height,
+		gsize *length);
+
+gboolean grits_delta_decode(const guint8 *buf, gsize length,
+		gint16 *data, gint width, gint height);
+
+#endif
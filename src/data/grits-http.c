@@ -23,14 +23,110 @@
  * the Hyper Text Transfer Protocol. Each #GritsHttp should be associated with
  * a particular server or dataset, all the files downloaded for this dataset
  * will be cached together in $HOME/.cache/grits/
+ *
+ * All #GritsHttp instances share a single asynchronous session which runs in
+ * a dedicated thread. Connections are kept alive and reused between requests,
+ * the number of connections to each host is limited, as is the total number
+ * of connections. Requests beyond these limits are queued by the session.
  */
 
 #include <config.h>
+#include <stdlib.h>
+#include <time.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <libsoup/soup.h>
 
 #include "grits-http.h"
+#include "grits-cache-manager.h"
+
+/* Connection limits for the shared session */
+#define MAX_CONNS          16
+#define MAX_CONNS_PER_HOST 4
+
+/* Failed downloads are not retried for BACKOFF_MIN seconds, doubling for
+ * each further failure up to BACKOFF_MAX */
+#define BACKOFF_MIN        2
+#define BACKOFF_MAX        600
+
+/* After BREAKER_FAILURES failures in a row no requests are sent to a host
+ * for BREAKER_TIME seconds, then a single request is let through to test it */
+#define BREAKER_FAILURES   5
+#define BREAKER_TIME       30
+
+/* Most progress updates to send to the main thread each second */
+#define PROGRESS_RATE      10
+
+/* Size of the buffer used when writing downloads to disk */
+#define WRITE_BUFFER       (64*1024)
+
+/* The shared session and the thread it runs in */
+struct _GritsHttpIO {
+	GMainContext *context;
+	GMainLoop    *loop;
+	GThread      *thread;
+	SoupSession  *soup;
+	GHashTable   *flights; // cache path -> active request
+	gint          refs;
+};
+static struct _GritsHttpIO *grits_http_io;
+G_LOCK_DEFINE_STATIC(grits_http_io);
+G_LOCK_DEFINE_STATIC(grits_http_flights);
+
+/* Recent failures for a URI or a host */
+struct _GritsHttpFailure {
+	guint   count;
+	gdouble retry;   // time before which requests fail immediately
+};
+static GHashTable    *grits_http_failed_uris;  // uri  -> struct _GritsHttpFailure
+static GHashTable    *grits_http_failed_hosts; // host -> struct _GritsHttpFailure
+static GritsHttpStats grits_http_stats;
+G_LOCK_DEFINE_STATIC(grits_http_failures);
+
+/* Validators stored next to each cached file, used to revalidate the file
+ * with a conditional request instead of downloading it again */
+struct _GritsHttpMeta {
+	gchar  *etag;
+	gchar  *modified;
+	time_t  expires;
+};
+
+/* A caller waiting for a request to finish */
+struct _GritsHttpWaiter {
+	GritsHttp         *http;
+	GritsChunkCallback callback;
+	GritsHttpCallback  done;
+	gpointer           user_data;
+};
+
+/* Progress of a download, shared with the main thread. At most one update is
+ * pending in the main loop at a time and it reports the latest counters */
+struct _GritsHttpProgress {
+	gint     refs;
+	gchar   *path;
+	GSList  *callbacks; // struct _GritsHttpWaiter copies, callback and user_data
+	goffset  cur;
+	goffset  total;
+	gdouble  last;
+	gboolean pending;
+};
+
+/* A single file being fetched, shared by all callers fetching the same file
+ * at the same time */
+struct _GritsHttpRequest {
+	GritsHttp         *http;
+	SoupMessage       *message;
+	gchar             *uri;
+	gchar             *local;
+	gchar             *path;
+	gchar             *part;
+	FILE              *fp;
+	GritsCacheType     mode;
+	struct _GritsHttpMeta *meta;
+	struct _GritsHttpProgress *progress;
+	gint               aborts;
+	GSList            *waiters;
+};
 
 gchar *_get_cache_path(GritsHttp *http, const gchar *local)
 {
@@ -38,6 +134,283 @@ gchar *_get_cache_path(GritsHttp *http, const gchar *local)
 			http->prefix, local, NULL);
 }
 
+static gchar *_get_meta_path(const gchar *path)
+{
+	return g_strconcat(path, ".meta", NULL);
+}
+
+static void _grits_http_meta_free(struct _GritsHttpMeta *meta)
+{
+	if (!meta)
+		return;
+	g_free(meta->etag);
+	g_free(meta->modified);
+	g_free(meta);
+}
+
+/* Load the validators for a cached file, returns NULL if there are none */
+static struct _GritsHttpMeta *_grits_http_meta_load(const gchar *path)
+{
+	gchar    *meta_path = _get_meta_path(path);
+	GKeyFile *keys      = g_key_file_new();
+	struct _GritsHttpMeta *meta = NULL;
+	if (g_key_file_load_from_file(keys, meta_path, 0, NULL)) {
+		meta = g_new0(struct _GritsHttpMeta, 1);
+		meta->etag     = g_key_file_get_string(keys, "meta", "etag", NULL);
+		meta->modified = g_key_file_get_string(keys, "meta", "modified", NULL);
+		meta->expires  = g_key_file_get_integer(keys, "meta", "expires", NULL);
+		if (!meta->etag && !meta->modified) {
+			_grits_http_meta_free(meta);
+			meta = NULL;
+		}
+	}
+	g_key_file_free(keys);
+	g_free(meta_path);
+	return meta;
+}
+
+/* Save the validators and expiry time from a response, validators missing
+ * from a 304 response are kept from the previous response */
+static void _grits_http_meta_save(const gchar *path, SoupMessage *message,
+		struct _GritsHttpMeta *old)
+{
+	SoupMessageHeaders *headers = message->response_headers;
+	const gchar *etag     = soup_message_headers_get(headers, "ETag");
+	const gchar *modified = soup_message_headers_get(headers, "Last-Modified");
+	const gchar *expires  = soup_message_headers_get(headers, "Expires");
+	const gchar *control  = soup_message_headers_get(headers, "Cache-Control");
+	if (old && message->status_code == SOUP_STATUS_NOT_MODIFIED) {
+		etag     = etag     ?: old->etag;
+		modified = modified ?: old->modified;
+	}
+	gchar *meta_path = _get_meta_path(path);
+	if (!etag && !modified) {
+		g_remove(meta_path);
+		g_free(meta_path);
+		return;
+	}
+
+	/* Work out how long the file is fresh for, max-age wins over Expires */
+	time_t expiry = 0;
+	if (expires) {
+		SoupDate *date = soup_date_new_from_string(expires);
+		if (date) {
+			expiry = soup_date_to_time_t(date);
+			soup_date_free(date);
+		}
+	}
+	if (control) {
+		GHashTable *params = soup_header_parse_param_list(control);
+		const gchar *age = g_hash_table_lookup(params, "max-age");
+		if (age)
+			expiry = time(NULL) + atol(age);
+		if (g_hash_table_lookup_extended(params, "no-cache", NULL, NULL) ||
+		    g_hash_table_lookup_extended(params, "no-store", NULL, NULL))
+			expiry = 0;
+		soup_header_free_param_list(params);
+	}
+
+	GKeyFile *keys = g_key_file_new();
+	if (etag)
+		g_key_file_set_string(keys, "meta", "etag", etag);
+	if (modified)
+		g_key_file_set_string(keys, "meta", "modified", modified);
+	g_key_file_set_integer(keys, "meta", "expires", expiry);
+	gchar *data = g_key_file_to_data(keys, NULL, NULL);
+	if (!g_file_set_contents(meta_path, data, -1, NULL))
+		g_warning("GritsHttp: meta_save - error writing %s", meta_path);
+	g_free(data);
+	g_key_file_free(keys);
+	g_free(meta_path);
+}
+
+static gdouble _grits_http_now(void)
+{
+	GTimeVal now;
+	g_get_current_time(&now);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+static gchar *_grits_http_get_host(const gchar *uri)
+{
+	SoupURI *parsed = soup_uri_new(uri);
+	gchar   *host   = g_strdup(parsed && parsed->host ? parsed->host : "");
+	if (parsed)
+		soup_uri_free(parsed);
+	return host;
+}
+
+static struct _GritsHttpFailure *_grits_http_get_failure(GHashTable **table,
+		const gchar *key, gboolean create)
+{
+	if (!*table)
+		*table = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, g_free);
+	struct _GritsHttpFailure *failure = g_hash_table_lookup(*table, key);
+	if (!failure && create) {
+		failure = g_new0(struct _GritsHttpFailure, 1);
+		g_hash_table_insert(*table, g_strdup(key), failure);
+	}
+	return failure;
+}
+
+/* Check whether a download should be attempted, counts the request */
+static gboolean _grits_http_allowed(const gchar *uri)
+{
+	gchar   *host    = _grits_http_get_host(uri);
+	gdouble  now     = _grits_http_now();
+	gboolean allowed = TRUE;
+	G_LOCK(grits_http_failures);
+	struct _GritsHttpFailure *bad_uri  =
+		_grits_http_get_failure(&grits_http_failed_uris,  uri,  FALSE);
+	struct _GritsHttpFailure *bad_host =
+		_grits_http_get_failure(&grits_http_failed_hosts, host, FALSE);
+	if (bad_uri && now < bad_uri->retry) {
+		g_debug("GritsHttp: allowed - backing off %s", uri);
+		allowed = FALSE;
+	} else if (bad_host && now < bad_host->retry) {
+		g_debug("GritsHttp: allowed - circuit open for %s", host);
+		allowed = FALSE;
+	} else if (bad_host && bad_host->count >= BREAKER_FAILURES) {
+		/* Half open, let this request test the host */
+		bad_host->retry = now + BREAKER_TIME;
+	}
+	if (allowed)
+		grits_http_stats.requests++;
+	else
+		grits_http_stats.skipped++;
+	G_UNLOCK(grits_http_failures);
+	g_free(host);
+	return allowed;
+}
+
+/* Failures which say the server itself is unwell, rather than the file */
+static gboolean _grits_http_host_failed(guint status)
+{
+	return SOUP_STATUS_IS_TRANSPORT_ERROR(status) ||
+	       SOUP_STATUS_IS_SERVER_ERROR(status) ||
+	       status == SOUP_STATUS_REQUEST_TIMEOUT;
+}
+
+static gboolean _grits_http_expired(gpointer key, gpointer _failure,
+		gpointer _now)
+{
+	struct _GritsHttpFailure *failure = _failure;
+	return failure->retry + BACKOFF_MAX < *(gdouble*)_now;
+}
+
+/* Record the result of a download. Only server and transport errors count
+ * towards pausing the host, other errors such as a missing file only back
+ * off that file */
+static void _grits_http_record(const gchar *uri, guint status)
+{
+	gchar  *host = _grits_http_get_host(uri);
+	gdouble now  = _grits_http_now();
+	G_LOCK(grits_http_failures);
+	if (SOUP_STATUS_IS_SUCCESSFUL(status) ||
+	    status == SOUP_STATUS_NOT_MODIFIED ||
+	    status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+		if (grits_http_failed_uris)
+			g_hash_table_remove(grits_http_failed_uris, uri);
+		if (grits_http_failed_hosts)
+			g_hash_table_remove(grits_http_failed_hosts, host);
+	} else {
+		/* Forget files which have not failed for a while, so the table
+		 * does not grow with every file that ever failed */
+		if (grits_http_failed_uris)
+			g_hash_table_foreach_remove(grits_http_failed_uris,
+					_grits_http_expired, &now);
+		struct _GritsHttpFailure *bad_uri =
+			_grits_http_get_failure(&grits_http_failed_uris, uri, TRUE);
+		bad_uri->count++;
+		bad_uri->retry = now + MIN(BACKOFF_MIN << MIN(bad_uri->count-1, 16),
+				BACKOFF_MAX);
+		if (_grits_http_host_failed(status)) {
+			struct _GritsHttpFailure *bad_host =
+				_grits_http_get_failure(&grits_http_failed_hosts,
+						host, TRUE);
+			if (++bad_host->count == BREAKER_FAILURES) {
+				g_warning("GritsHttp: record - too many failures, "
+						"pausing requests to %s", host);
+				grits_http_stats.trips++;
+			}
+			if (bad_host->count >= BREAKER_FAILURES)
+				bad_host->retry = now + BREAKER_TIME;
+		} else if (grits_http_failed_hosts) {
+			/* The host answered, so it is working */
+			g_hash_table_remove(grits_http_failed_hosts, host);
+		}
+		grits_http_stats.failures++;
+	}
+	G_UNLOCK(grits_http_failures);
+	g_free(host);
+}
+
+/* Run a function in the IO thread */
+static void _grits_http_io_call(GSourceFunc func, gpointer data)
+{
+	GSource *source = g_idle_source_new();
+	g_source_set_callback(source, func, data, NULL);
+	g_source_attach(source, grits_http_io->context);
+	g_source_unref(source);
+}
+
+static gpointer _grits_http_io_run(gpointer _io)
+{
+	struct _GritsHttpIO *io = _io;
+	g_main_loop_run(io->loop);
+	return NULL;
+}
+
+static gboolean _grits_http_io_quit(gpointer _io)
+{
+	struct _GritsHttpIO *io = _io;
+	soup_session_abort(io->soup);
+	g_main_loop_quit(io->loop);
+	return FALSE;
+}
+
+static void _grits_http_io_ref(void)
+{
+	G_LOCK(grits_http_io);
+	if (!grits_http_io) {
+		struct _GritsHttpIO *io = g_new0(struct _GritsHttpIO, 1);
+		io->context = g_main_context_new();
+		io->loop    = g_main_loop_new(io->context, FALSE);
+		io->soup    = soup_session_async_new_with_options(
+				SOUP_SESSION_ASYNC_CONTEXT,      io->context,
+				SOUP_SESSION_MAX_CONNS,          MAX_CONNS,
+				SOUP_SESSION_MAX_CONNS_PER_HOST, MAX_CONNS_PER_HOST,
+				SOUP_SESSION_USER_AGENT,         PACKAGE_STRING,
+				SOUP_SESSION_TIMEOUT,            10,
+				NULL);
+		io->flights = g_hash_table_new(g_str_hash, g_str_equal);
+		io->thread  = g_thread_create(_grits_http_io_run, io, TRUE, NULL);
+		grits_http_io = io;
+	}
+	grits_http_io->refs++;
+	G_UNLOCK(grits_http_io);
+}
+
+static void _grits_http_io_unref(void)
+{
+	G_LOCK(grits_http_io);
+	struct _GritsHttpIO *io = grits_http_io;
+	if (--io->refs > 0) {
+		G_UNLOCK(grits_http_io);
+		return;
+	}
+	_grits_http_io_call(_grits_http_io_quit, io);
+	g_thread_join(io->thread);
+	g_object_unref(io->soup);
+	g_hash_table_destroy(io->flights);
+	g_main_loop_unref(io->loop);
+	g_main_context_unref(io->context);
+	g_free(io);
+	grits_http_io = NULL;
+	G_UNLOCK(grits_http_io);
+}
+
 /**
  * grits_http_new:
  * @prefix: The prefix in the cache to store the downloaded files.
@@ -50,11 +423,11 @@ gchar *_get_cache_path(GritsHttp *http, const gchar *local)
 GritsHttp *grits_http_new(const gchar *prefix)
 {
 	g_debug("GritsHttp: new - %s", prefix);
+	_grits_http_io_ref();
 	GritsHttp *http = g_new0(GritsHttp, 1);
-	http->soup = soup_session_sync_new();
 	http->prefix = g_strdup(prefix);
-	g_object_set(http->soup, "user-agent", PACKAGE_STRING, NULL);
-	g_object_set(http->soup, "timeout",    10,             NULL);
+	http->lock   = g_mutex_new();
+	http->idle   = g_cond_new();
 	return http;
 }
 
@@ -67,44 +440,231 @@ GritsHttp *grits_http_new(const gchar *prefix)
 void grits_http_free(GritsHttp *http)
 {
 	g_debug("GritsHttp: free - %s", http->prefix);
-	soup_session_abort(http->soup);
-	g_object_unref(http->soup);
+	grits_http_abort(http);
+	g_mutex_lock(http->lock);
+	while (http->pending > 0)
+		g_cond_wait(http->idle, http->lock);
+	g_mutex_unlock(http->lock);
+	if (http->pack) {
+		grits_cache_manager_set_evict_func(http->prefix, NULL, NULL);
+		grits_pack_close(http->pack);
+	}
+	grits_cache_manager_sync(http->prefix);
+	g_mutex_free(http->lock);
+	g_cond_free(http->idle);
 	g_free(http->prefix);
 	g_free(http);
+	_grits_http_io_unref();
 }
 
-/* For passing data to the chunck callback */
-struct _CacheInfo {
-	FILE  *fp;
-	gchar *path;
-	GritsChunkCallback callback;
-	gpointer user_data;
-};
-struct _CacheInfoMain {
-	gchar *path;
-	GritsChunkCallback callback;
-	gpointer user_data;
-	goffset cur, total;
-};
+/**
+ * grits_http_get_stats:
+ * @stats: location to store the statistics
+ *
+ * Get the number of downloads attempted by all #GritsHttp<!-- -->s and how
+ * many of them failed. Files which have failed recently are not requested
+ * again until their backoff time expires, and hosts which fail repeatedly
+ * are not sent any requests for a short time. These requests are counted as
+ * skipped.
+ */
+void grits_http_get_stats(GritsHttpStats *stats)
+{
+	G_LOCK(grits_http_failures);
+	*stats = grits_http_stats;
+	G_UNLOCK(grits_http_failures);
+}
+
+/**
+ * grits_http_get_cache_path:
+ * @http:  the #GritsHttp the file is cached for
+ * @local: the local name of the file
+ *
+ * Get the path a file fetched by @http is cached at. The file is not
+ * guaranteed to exist.
+ *
+ * Returns: the path to the cached file
+ */
+gchar *grits_http_get_cache_path(GritsHttp *http, const gchar *local)
+{
+	return _get_cache_path(http, local);
+}
+
+/* Called by the cache manager with the cache locked */
+static gboolean _grits_http_evict_packed(const gchar *local, gpointer _http)
+{
+	GritsHttp *http = _http;
+	return grits_pack_remove(http->pack, local);
+}
+
+/**
+ * grits_http_use_pack:
+ * @http: the #GritsHttp to store files for
+ *
+ * Store files fetched with grits_http_fetch_data() in a #GritsPack in the
+ * cache directory instead of as separate files. Existing files in the cache
+ * can be moved into the pack using grits_pack_import(). Packed files count
+ * towards the cache quota, evicting them leaves their data in the pack until
+ * it is compacted, see grits_pack_compact().
+ *
+ * Returns: %TRUE if the pack was opened
+ */
+gboolean grits_http_use_pack(GritsHttp *http)
+{
+	if (http->pack)
+		return TRUE;
+	gchar *dir = _get_cache_path(http, "");
+	http->pack = grits_pack_open(dir);
+	g_free(dir);
+	if (!http->pack)
+		return FALSE;
+
+	/* Register the packed files with the cache manager, they are copied
+	 * first so the pack and cache are never locked at the same time */
+	grits_cache_manager_set_evict_func(http->prefix,
+			_grits_http_evict_packed, http);
+	GPtrArray *keys  = g_ptr_array_new();
+	GArray    *sizes = g_array_new(FALSE, FALSE, sizeof(guint64));
+	GHashTableIter iter;
+	gpointer key, value;
+	g_mutex_lock(http->pack->lock);
+	g_hash_table_iter_init(&iter, http->pack->entries);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		guint64 size = ((GritsPackEntry*)value)->length;
+		g_ptr_array_add(keys, g_strdup(key));
+		g_array_append_val(sizes, size);
+	}
+	g_mutex_unlock(http->pack->lock);
+	for (guint i = 0; i < keys->len; i++) {
+		grits_cache_manager_add_packed(http->prefix,
+				g_ptr_array_index(keys, i),
+				g_array_index(sizes, guint64, i));
+		g_free(g_ptr_array_index(keys, i));
+	}
+	g_ptr_array_free(keys, TRUE);
+	g_array_free(sizes, TRUE);
+	return TRUE;
+}
+
+/**
+ * grits_http_find_pack:
+ * @http: the #GritsHttp to store files for
+ *
+ * Use the packed cache if one has already been created, for example by
+ * `grits-cache import`, see grits_http_use_pack().
+ *
+ * Returns: %TRUE if the pack was opened
+ */
+gboolean grits_http_find_pack(GritsHttp *http)
+{
+	gchar   *index = _get_cache_path(http, GRITS_PACK_INDEX);
+	gboolean found = g_file_test(index, G_FILE_TEST_EXISTS);
+	g_free(index);
+	return found && grits_http_use_pack(http);
+}
+
+/* Runs in the IO thread */
+static gboolean _grits_http_abort_cb(gpointer _http)
+{
+	GritsHttp *http = _http;
+	g_mutex_lock(http->lock);
+	GList *active = g_list_copy(http->active);
+	g_mutex_unlock(http->lock);
+	for (GList *cur = active; cur; cur = cur->next) {
+		struct _GritsHttpRequest *req = cur->data;
+		soup_session_cancel_message(grits_http_io->soup,
+				req->message, SOUP_STATUS_CANCELLED);
+	}
+	g_list_free(active);
+
+	g_mutex_lock(http->lock);
+	if (--http->pending == 0)
+		g_cond_broadcast(http->idle);
+	g_mutex_unlock(http->lock);
+	return FALSE;
+}
+
+/**
+ * grits_http_abort:
+ * @http: the #GritsHttp to abort
+ *
+ * Cancel all requests made using @http which have not yet finished. The
+ * requests finish with an error, the #GritsHttp can still be used to make new
+ * requests afterwards.
+ */
+void grits_http_abort(GritsHttp *http)
+{
+	g_debug("GritsHttp: abort - %s", http->prefix);
+	g_atomic_int_inc(&http->aborts);
+	g_mutex_lock(http->lock);
+	gboolean active = http->active != NULL;
+	if (active)
+		http->pending++; // Keep http alive until the abort runs
+	g_mutex_unlock(http->lock);
+	if (active)
+		_grits_http_io_call(_grits_http_abort_cb, http);
+}
+
+static struct _GritsHttpProgress *_grits_http_progress_new(const gchar *path,
+		goffset cur)
+{
+	struct _GritsHttpProgress *progress = g_new0(struct _GritsHttpProgress, 1);
+	progress->refs = 1;
+	progress->path = g_strdup(path);
+	progress->cur  = cur;
+	return progress;
+}
+
+/* Must be called with the flights lock held */
+static void _grits_http_progress_add(struct _GritsHttpProgress *progress,
+		struct _GritsHttpWaiter *waiter)
+{
+	if (!waiter->callback)
+		return;
+	struct _GritsHttpWaiter *copy = g_memdup(waiter, sizeof(*waiter));
+	progress->callbacks = g_slist_append(progress->callbacks, copy);
+}
+
+/* Must be called with the flights lock held */
+static void _grits_http_progress_unref(struct _GritsHttpProgress *progress)
+{
+	if (--progress->refs > 0)
+		return;
+	g_slist_foreach(progress->callbacks, (GFunc)g_free, NULL);
+	g_slist_free(progress->callbacks);
+	g_free(progress->path);
+	g_free(progress);
+}
 
 /* call the user callback from the main thread,
  * since it's usually UI updates */
-static gboolean _chunk_main_cb(gpointer _infomain)
+static gboolean _chunk_main_cb(gpointer _progress)
 {
-	struct _CacheInfoMain *infomain = _infomain;
-	infomain->callback(infomain->path,
-			infomain->cur, infomain->total,
-			infomain->user_data);
-	g_free(infomain);
+	struct _GritsHttpProgress *progress = _progress;
+	G_LOCK(grits_http_flights);
+	progress->pending = FALSE;
+	goffset cur   = progress->cur;
+	goffset total = progress->total;
+	GSList *callbacks = g_slist_copy(progress->callbacks);
+	G_UNLOCK(grits_http_flights);
+
+	for (GSList *l = callbacks; l; l = l->next) {
+		struct _GritsHttpWaiter *waiter = l->data;
+		waiter->callback(progress->path, cur, total, waiter->user_data);
+	}
+	g_slist_free(callbacks);
+
+	G_LOCK(grits_http_flights);
+	_grits_http_progress_unref(progress);
+	G_UNLOCK(grits_http_flights);
 	return FALSE;
 }
 
 /**
  * Append data to the file and call the users callback if they supplied one.
  */
-static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _info)
+static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _req)
 {
-	struct _CacheInfo *info = _info;
+	struct _GritsHttpRequest *req = _req;
 
 	if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
 		g_warning("GritsHttp: _chunk_cb - soup failed with %d",
@@ -112,21 +672,318 @@ static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _info)
 		return;
 	}
 
-	if (!fwrite(chunk->data, chunk->length, 1, info->fp))
+	/* Writes are buffered by stdio, see WRITE_BUFFER */
+	if (!fwrite(chunk->data, chunk->length, 1, req->fp))
 		g_error("GritsHttp: _chunk_cb - Unable to write data");
 
-	if (info->callback) {
-		struct _CacheInfoMain *infomain = g_new0(struct _CacheInfoMain, 1);
-		infomain->path      = info->path;
-		infomain->callback  = info->callback;
-		infomain->user_data = info->user_data;
-		infomain->cur       = ftell(info->fp);
-		goffset st=0, end=0;
-		soup_message_headers_get_content_range(message->response_headers,
-				&st, &end, &infomain->total);
-		g_idle_add(_chunk_main_cb, infomain);
+	G_LOCK(grits_http_flights);
+	struct _GritsHttpProgress *progress = req->progress;
+	if (progress->total == 0) {
+		SoupMessageHeaders *headers = message->response_headers;
+		goffset start = 0, end = 0;
+		if (!soup_message_headers_get_content_range(headers,
+					&start, &end, &progress->total))
+			progress->total = progress->cur +
+				soup_message_headers_get_content_length(headers);
+	}
+	progress->cur += chunk->length;
+
+	/* Send an update unless one is waiting or was just sent */
+	gdouble now = _grits_http_now();
+	if (progress->callbacks && !progress->pending &&
+	    now - progress->last >= 1.0 / PROGRESS_RATE) {
+		progress->pending = TRUE;
+		progress->last    = now;
+		progress->refs++;
+		g_idle_add(_chunk_main_cb, progress);
+	}
+	G_UNLOCK(grits_http_flights);
+}
+
+/* Report the result to every waiter and release the request */
+static void _grits_http_finish(struct _GritsHttpRequest *req, gboolean ok)
+{
+	/* Later callers start a new request */
+	G_LOCK(grits_http_flights);
+	if (g_hash_table_lookup(grits_http_io->flights, req->path) == req)
+		g_hash_table_remove(grits_http_io->flights, req->path);
+	GSList *waiters = req->waiters;
+	struct _GritsHttpProgress *progress = req->progress;
+	if (progress) {
+		/* Updates may have been skipped by the rate limit, so make sure
+		 * the final counters are reported */
+		if (ok && progress->callbacks && progress->cur > 0 &&
+		    !progress->pending) {
+			progress->pending = TRUE;
+			progress->refs++;
+			g_idle_add(_chunk_main_cb, progress);
+		}
+		_grits_http_progress_unref(progress);
+	}
+	G_UNLOCK(grits_http_flights);
+
+	for (GSList *cur = waiters; cur; cur = cur->next) {
+		struct _GritsHttpWaiter *waiter = cur->data;
+		GritsHttp *http = waiter->http;
+		waiter->done(ok ? g_strdup(req->path) : NULL, waiter->user_data);
+		g_free(waiter);
+
+		g_mutex_lock(http->lock);
+		if (--http->pending == 0)
+			g_cond_broadcast(http->idle);
+		g_mutex_unlock(http->lock);
+	}
+	g_slist_free(waiters);
+	g_free(req->path);
+	g_free(req->part);
+	g_free(req->uri);
+	g_free(req->local);
+	_grits_http_meta_free(req->meta);
+	g_free(req);
+}
+
+/* Runs in the IO thread once the message has completed */
+static void _grits_http_done_cb(SoupSession *soup, SoupMessage *message,
+		gpointer _req)
+{
+	struct _GritsHttpRequest *req = _req;
+	GritsHttp *http = req->http;
+
+	g_mutex_lock(http->lock);
+	http->active = g_list_remove(http->active, req);
+	g_mutex_unlock(http->lock);
+
+	/* Close file */
+	fclose(req->fp);
+	if (req->part && SOUP_STATUS_IS_SUCCESSFUL(message->status_code))
+		g_rename(req->part, req->path);
+
+	/* Remember the validators so the file can be revalidated later */
+	guint status = message->status_code;
+	if ((req->mode == GRITS_UPDATE || req->mode == GRITS_REFRESH) &&
+	    (SOUP_STATUS_IS_SUCCESSFUL(status) || status == SOUP_STATUS_NOT_MODIFIED))
+		_grits_http_meta_save(req->path, message, req->meta);
+
+	/* Finished */
+	if (status == SOUP_STATUS_CANCELLED) {
+		_grits_http_finish(req, FALSE);
+	} else if (status == SOUP_STATUS_NOT_MODIFIED && req->meta) {
+		/* Revalidated, keep the cached file */
+		g_debug("GritsHttp: done_cb - not modified %s", req->local);
+		g_remove(req->part);
+		_grits_http_record(req->uri, status);
+		grits_cache_manager_add(http->prefix, req->local, req->path);
+		_grits_http_finish(req, TRUE);
+	} else if (status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+		/* Range unsatisfiable, file already complete */
+		_grits_http_record(req->uri, status);
+		grits_cache_manager_add(http->prefix, req->local, req->path);
+		_grits_http_finish(req, TRUE);
+	} else if (!SOUP_STATUS_IS_SUCCESSFUL(status)) {
+		g_warning("GritsHttp: done_cb - error copying file, status=%d\n"
+				"\tsrc=%s\n"
+				"\tdst=%s",
+				status, req->uri, req->path);
+		_grits_http_record(req->uri, status);
+		_grits_http_finish(req, FALSE);
+	} else {
+		_grits_http_record(req->uri, status);
+		grits_cache_manager_add(http->prefix, req->local, req->path);
+		_grits_http_finish(req, TRUE);
+	}
+}
+
+/* Runs in the IO thread to start the download */
+static gboolean _grits_http_start_cb(gpointer _req)
+{
+	struct _GritsHttpRequest *req = _req;
+	GritsHttp *http = req->http;
+
+	if (req->aborts != g_atomic_int_get(&http->aborts)) {
+		fclose(req->fp);
+		_grits_http_finish(req, FALSE);
+		return FALSE;
+	}
+
+	/* Download the file */
+	SoupMessage *message = soup_message_new("GET", req->uri);
+	if (message == NULL)
+		g_error("message is null, cannot parse uri");
+	g_signal_connect(message, "got-chunk", G_CALLBACK(_chunk_cb), req);
+	if (req->meta) {
+		/* Download the whole file again only if it has changed */
+		if (req->meta->etag)
+			soup_message_headers_replace(message->request_headers,
+					"If-None-Match", req->meta->etag);
+		if (req->meta->modified)
+			soup_message_headers_replace(message->request_headers,
+					"If-Modified-Since", req->meta->modified);
+	} else {
+		soup_message_headers_set_range(message->request_headers,
+				ftell(req->fp), -1);
+	}
+	if (req->mode == GRITS_REFRESH)
+		soup_message_headers_replace(message->request_headers,
+				"Cache-Control", "max-age=0");
+	req->message = message;
+
+	g_mutex_lock(http->lock);
+	http->active = g_list_prepend(http->active, req);
+	g_mutex_unlock(http->lock);
+
+	soup_session_queue_message(grits_http_io->soup, message,
+			_grits_http_done_cb, req);
+	return FALSE;
+}
+
+/**
+ * grits_http_fetch_async:
+ * @http:      the #GritsHttp connection to use
+ * @uri:       the URI to fetch
+ * @local:     the local name to give to the file
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @done:      callback to call when the file has been fetched
+ * @user_data: user data to pass to the callbacks
+ *
+ * Fetch a file from the cache without blocking. Whether the file is actually
+ * loaded from the remote server depends on the value of @mode.
+ *
+ * @done is called from the HTTP thread once the download completes, or from
+ * the calling thread before this function returns if no download is needed.
+ * It should not block, work such as decoding the file should be handed off to
+ * another thread. @callback is called from the main thread.
+ *
+ * If the same file is already being downloaded the caller is attached to the
+ * existing download instead of starting a new one, and receives the same
+ * result. Aborting the #GritsHttp which started the download aborts it for
+ * all attached callers.
+ */
+void grits_http_fetch_async(GritsHttp *http, const gchar *uri, const char *local,
+		GritsCacheType mode, GritsChunkCallback callback,
+		GritsHttpCallback done, gpointer user_data)
+{
+	g_debug("GritsHttp: fetch_async - %s mode=%d", local, mode);
+	gchar *path = _get_cache_path(http, local);
+
+	struct _GritsHttpWaiter *waiter = g_new0(struct _GritsHttpWaiter, 1);
+	waiter->http      = http;
+	waiter->callback  = callback;
+	waiter->done      = done;
+	waiter->user_data = user_data;
+
+	g_mutex_lock(http->lock);
+	http->pending++;
+	g_mutex_unlock(http->lock);
+
+	/* Attach to an active download of the same file, or add a placeholder
+	 * which later callers attach to while the cached file is checked. The
+	 * lock is only held for the lookup so fetches of other files are not
+	 * blocked by the disk */
+	G_LOCK(grits_http_flights);
+	struct _GritsHttpRequest *req =
+		g_hash_table_lookup(grits_http_io->flights, path);
+	if (req && mode != GRITS_LOCAL) {
+		g_debug("GritsHttp: fetch_async - Joining download of %s", local);
+		req->waiters = g_slist_append(req->waiters, waiter);
+		_grits_http_progress_add(req->progress, waiter);
+		G_UNLOCK(grits_http_flights);
+		g_free(path);
+		return;
+	}
+	req = g_new0(struct _GritsHttpRequest, 1);
+	req->http      = http;
+	req->path      = path;
+	req->mode      = mode;
+	req->aborts    = g_atomic_int_get(&http->aborts);
+	req->waiters   = g_slist_append(NULL, waiter);
+	req->progress  = _grits_http_progress_new(path, 0);
+	_grits_http_progress_add(req->progress, waiter);
+	if (mode != GRITS_LOCAL)
+		g_hash_table_insert(grits_http_io->flights, req->path, req);
+	G_UNLOCK(grits_http_flights);
+
+	/* Revalidate the cached file if the server gave us validators for it */
+	struct _GritsHttpMeta *meta = NULL;
+	if ((mode == GRITS_UPDATE || mode == GRITS_REFRESH) &&
+			g_file_test(path, G_FILE_TEST_EXISTS))
+		meta = _grits_http_meta_load(path);
+
+	/* Unlink the file if we're refreshing it and can't revalidate it */
+	if (mode == GRITS_REFRESH && !meta) {
+		g_remove(path);
+		grits_cache_manager_remove(http->prefix, local);
+	}
+
+	/* Use the cached file if possible, updates can skip the request entirely
+	 * while the file is still fresh */
+	gboolean cached = mode == GRITS_ONCE &&
+		grits_cache_manager_claim(http->prefix, local, path);
+	if (cached ||
+	    (mode == GRITS_UPDATE && meta && meta->expires > time(NULL)) ||
+			mode == GRITS_LOCAL) {
+		_grits_http_meta_free(meta);
+		if (!cached)
+			grits_cache_manager_access(http->prefix, local, TRUE);
+		_grits_http_finish(req, TRUE);
+		return;
+	}
+	g_debug("GritsHttp: fetch_async - Caching file %s", local);
+	grits_cache_manager_access(http->prefix, local, FALSE);
+
+	/* Fail immediately if the file or server has been failing */
+	if (!_grits_http_allowed(uri)) {
+		_grits_http_meta_free(meta);
+		_grits_http_finish(req, FALSE);
+		return;
+	}
+
+	/* Open the file for writting, revalidated files are downloaded in full to
+	 * a new file so the cached copy is kept if it has not been modified */
+	gchar *part = NULL;
+	if (meta || !g_file_test(path, G_FILE_TEST_EXISTS))
+		part = g_strdup_printf("%s.part", path);
+	FILE *fp = fopen_p(part ?: path, meta ? "wb" : "ab");
+	if (!fp) {
+		g_warning("GritsHttp: fetch_async - error opening %s", path);
+		_grits_http_meta_free(meta);
+		req->part = part;
+		_grits_http_finish(req, FALSE);
+		return;
 	}
+	setvbuf(fp, NULL, _IOFBF, WRITE_BUFFER);
+	fseek(fp, 0, SEEK_END); // "a" is broken on Windows, twice
+
+	/* Fill in the request, callers which attached in the mean time only use
+	 * the waiters and progress */
+	req->uri       = g_strdup(uri);
+	req->local     = g_strdup(local);
+	req->part      = part;
+	req->fp        = fp;
+	req->meta      = meta;
+	G_LOCK(grits_http_flights);
+	req->progress->cur = ftell(fp);
+	G_UNLOCK(grits_http_flights);
+
+	_grits_http_io_call(_grits_http_start_cb, req);
+}
+
+/* For waiting on an asynchronous fetch */
+struct _FetchWait {
+	GMutex   *lock;
+	GCond    *cond;
+	gboolean  done;
+	gchar    *path;
+};
 
+static void _grits_http_wait_cb(gchar *path, gpointer _wait)
+{
+	struct _FetchWait *wait = _wait;
+	g_mutex_lock(wait->lock);
+	wait->path = path;
+	wait->done = TRUE;
+	g_cond_signal(wait->cond);
+	g_mutex_unlock(wait->lock);
 }
 
 /**
@@ -139,83 +996,128 @@ static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _info)
  * @user_data: user data to pass to the callback
  *
  * Fetch a file from the cache. Whether the file is actually loaded from the
- * remote server depends on the value of @mode.
+ * remote server depends on the value of @mode. This blocks until the
+ * download has finished, see grits_http_fetch_async().
  *
  * Returns: The local path to the complete file
  */
-/* TODO: use .part extentions and continue even when using GRITS_ONCE */
 gchar *grits_http_fetch(GritsHttp *http, const gchar *uri, const char *local,
 		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data)
 {
-	g_debug("GritsHttp: fetch - %s mode=%d", local, mode);
-	gchar *path = _get_cache_path(http, local);
-
-	/* Unlink the file if we're refreshing it */
-	if (mode == GRITS_REFRESH)
-		g_remove(path);
+	struct _FetchWait wait = {
+		.lock = g_mutex_new(),
+		.cond = g_cond_new(),
+	};
+	grits_http_fetch_async(http, uri, local, mode,
+			callback, _grits_http_wait_cb, &wait);
+	g_mutex_lock(wait.lock);
+	while (!wait.done)
+		g_cond_wait(wait.cond, wait.lock);
+	g_mutex_unlock(wait.lock);
+	g_mutex_free(wait.lock);
+	g_cond_free(wait.cond);
+	return wait.path;
+}
 
-	/* Do the cache if necessasairy */
-	if (!(mode == GRITS_ONCE && g_file_test(path, G_FILE_TEST_EXISTS)) &&
-			mode != GRITS_LOCAL) {
-		g_debug("GritsHttp: fetch - Caching file %s", local);
-
-		/* Open the file for writting */
-		gchar *part = path;
-		if (!g_file_test(path, G_FILE_TEST_EXISTS))
-			part = g_strdup_printf("%s.part", path);
-		FILE *fp = fopen_p(part, "ab");
-		if (!fp) {
-			g_warning("GritsHttp: fetch - error opening %s", path);
-			return NULL;
-		}
-		fseek(fp, 0, SEEK_END); // "a" is broken on Windows, twice
-
-		/* Make temp data */
-		struct _CacheInfo info = {
-			.fp        = fp,
-			.path      = path,
-			.callback  = callback,
-			.user_data = user_data,
-		};
-
-		/* Download the file */
-		SoupMessage *message = soup_message_new("GET", uri);
-		if (message == NULL)
-			g_error("message is null, cannot parse uri");
-		g_signal_connect(message, "got-chunk", G_CALLBACK(_chunk_cb), &info);
-		//if (ftell(fp) > 0)
-			soup_message_headers_set_range(message->request_headers, ftell(fp), -1);
-		if (mode == GRITS_REFRESH)
-			soup_message_headers_replace(message->request_headers,
-					"Cache-Control", "max-age=0");
-		soup_session_send_message(http->soup, message);
-
-		/* Close file */
-		fclose(fp);
-		if (path != part) {
-			if (SOUP_STATUS_IS_SUCCESSFUL(message->status_code))
-				g_rename(part, path);
-			g_free(part);
-		}
+/**
+ * grits_http_fetch_data:
+ * @http:      the #GritsHttp connection to use, see grits_http_use_pack()
+ * @uri:       the URI to fetch
+ * @local:     the name of the file in the pack
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @user_data: user data to pass to the callback
+ * @length:    location to store the length of the file
+ *
+ * Fetch a file from the packed cache. Files which are downloaded are added
+ * to the pack and the separate file is removed. The returned data points into
+ * the memory mapped pack, see grits_pack_get(). Release it with
+ * grits_http_release_data() once it is no longer needed.
+ *
+ * Returns: the contents of the file, or %NULL on error
+ */
+const guint8 *grits_http_fetch_data(GritsHttp *http, const gchar *uri,
+		const gchar *local, GritsCacheType mode,
+		GritsChunkCallback callback,
+		gpointer user_data, gsize *length)
+{
+	g_return_val_if_fail(http->pack, NULL);
 
-		/* Finished */
-		guint status = message->status_code;
-		g_object_unref(message);
-		if (status == SOUP_STATUS_CANCELLED) {
-			return NULL;
-		} else if (status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
-			/* Range unsatisfiable, file already complete */
-		} else if (!SOUP_STATUS_IS_SUCCESSFUL(status)) {
-			g_warning("GritsHttp: done_cb - error copying file, status=%d\n"
-					"\tsrc=%s\n"
-					"\tdst=%s",
-					status, uri, path);
-			return NULL;
-		}
+	/* Use the packed file if possible */
+	if (mode == GRITS_ONCE || mode == GRITS_LOCAL) {
+		const guint8 *data = grits_http_get_data(http, local, length);
+		if (data || mode == GRITS_LOCAL)
+			return data;
 	}
 
-	/* TODO: free everything.. */
-	return path;
+	/* Download it and move it into the pack */
+	gchar *path = grits_http_fetch(http, uri, local, mode,
+			callback, user_data);
+	if (!path)
+		return NULL;
+	const guint8 *data = grits_http_add_data(http, local, path, length);
+	g_free(path);
+	return data;
+}
+
+/**
+ * grits_http_get_data:
+ * @http:   the #GritsHttp connection to use, see grits_http_use_pack()
+ * @local:  the name of the file in the pack
+ * @length: location to store the length of the file
+ *
+ * Find a file in the packed cache without downloading it. Release it with
+ * grits_http_release_data().
+ *
+ * Returns: the contents of the file, or %NULL if it is not in the pack
+ */
+const guint8 *grits_http_get_data(GritsHttp *http, const gchar *local,
+		gsize *length)
+{
+	g_return_val_if_fail(http->pack, NULL);
+	const guint8 *data = grits_pack_get(http->pack, local, length);
+	if (data)
+		grits_cache_manager_access(http->prefix, local, TRUE);
+	return data;
+}
+
+/**
+ * grits_http_add_data:
+ * @http:   the #GritsHttp connection to use, see grits_http_use_pack()
+ * @local:  the name of the file in the pack
+ * @path:   the cached file, as returned by grits_http_fetch()
+ * @length: location to store the length of the file
+ *
+ * Move a file from the download cache into the packed cache. Release the
+ * returned data with grits_http_release_data().
+ *
+ * Returns: the contents of the file, or %NULL on error
+ */
+const guint8 *grits_http_add_data(GritsHttp *http, const gchar *local,
+		const gchar *path, gsize *length)
+{
+	g_return_val_if_fail(http->pack, NULL);
+	/* Another thread may have packed the file already */
+	if (grits_pack_put_file(http->pack, local, path))
+		g_remove(path);
+	const guint8 *data = grits_pack_get(http->pack, local, length);
+	if (data)
+		grits_cache_manager_add_packed(http->prefix, local, *length);
+	return data;
+}
+
+/**
+ * grits_http_release_data:
+ * @http: the #GritsHttp connection the data was fetched with
+ * @data: data returned by grits_http_fetch_data()
+ *
+ * Release a file returned by grits_http_fetch_data(), grits_http_get_data()
+ * or grits_http_add_data(), see grits_pack_release().
+ */
+void grits_http_release_data(GritsHttp *http, const guint8 *data)
+{
+	if (data)
+		grits_pack_release(http->pack, data);
 }
 
 /**
@@ -287,7 +1189,11 @@ GList *grits_http_available(GritsHttp *http,
 
 		g_regex_unref(extract_re);
 		g_match_info_free(info);
+		gchar *meta_path = _get_meta_path(path);
 		g_unlink(path);
+		g_unlink(meta_path);
+		grits_cache_manager_remove(http->prefix, tmp);
+		g_free(meta_path);
 		g_free(path);
 		g_free(html);
 	}
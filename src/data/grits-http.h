@@ -22,21 +22,82 @@
 #include <libsoup/soup.h>
 
 #include "grits-data.h"
+#include "grits-pack.h"
+
+/**
+ * GritsHttpCallback:
+ * @path:      the local path to the complete file, or %NULL on error
+ * @user_data: the user_data argument passed to grits_http_fetch_async()
+ *
+ * Function called when an asynchronous fetch has finished. The callback takes
+ * ownership of @path.
+ */
+typedef void (*GritsHttpCallback)(gchar *path, gpointer user_data);
+
+/**
+ * GritsHttpStats:
+ * @requests: downloads sent to a server
+ * @failures: downloads which failed
+ * @skipped:  downloads not sent because the file or server had been failing
+ * @trips:    times a server was paused after failing repeatedly
+ *
+ * Download statistics, see grits_http_get_stats().
+ */
+typedef struct _GritsHttpStats {
+	guint requests;
+	guint failures;
+	guint skipped;
+	guint trips;
+} GritsHttpStats;
 
 typedef struct _GritsHttp {
-	SoupSession *soup;
-	gchar *prefix;
+	gchar  *prefix;
+	GritsPack *pack;
+	GMutex *lock;
+	GCond  *idle;
+	GList  *active;
+	gint    pending;
+	gint    aborts;
 } GritsHttp;
 
 GritsHttp *grits_http_new(const gchar *prefix);
 
 void grits_http_free(GritsHttp *http);
 
+void grits_http_abort(GritsHttp *http);
+
+void grits_http_get_stats(GritsHttpStats *stats);
+
+gchar *grits_http_get_cache_path(GritsHttp *http, const gchar *local);
+
+gboolean grits_http_use_pack(GritsHttp *http);
+
+gboolean grits_http_find_pack(GritsHttp *http);
+
+void grits_http_fetch_async(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode,
+		GritsChunkCallback callback,
+		GritsHttpCallback done,
+		gpointer user_data);
+
 gchar *grits_http_fetch(GritsHttp *http, const gchar *uri, const gchar *local,
 		GritsCacheType mode,
 		GritsChunkCallback callback,
 		gpointer user_data);
 
+const guint8 *grits_http_fetch_data(GritsHttp *http, const gchar *uri,
+		const gchar *local, GritsCacheType mode,
+		GritsChunkCallback callback,
+		gpointer user_data, gsize *length);
+
+const guint8 *grits_http_get_data(GritsHttp *http, const gchar *local,
+		gsize *length);
+
+const guint8 *grits_http_add_data(GritsHttp *http, const gchar *local,
+		const gchar *path, gsize *length);
+
+void grits_http_release_data(GritsHttp *http, const guint8 *data);
+
 GList *grits_http_available(GritsHttp *http,
 		gchar *filter, gchar *cache,
 		gchar *extract, gchar *index);
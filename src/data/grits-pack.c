@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-pack
+ * @short_description: Packed file cache
+ *
+ * #GritsPack stores many small files, such as map tiles, in a single
+ * append-only data file. A separate index file records the key, offset and
+ * length of each file that has been added. The index is read into a hash
+ * table when the pack is opened so lookups do not touch the filesystem, and
+ * the data file is memory mapped so files can be read without copying.
+ *
+ * Replacing or removing a file leaves the old data in place,
+ * grits_pack_compact() rewrites the pack without it.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "grits-data.h"
+#include "grits-pack.h"
+
+/* Index records are written as the header followed by the key, a record
+ * with a length of G_MAXUINT32 marks a removed key */
+struct _PackRecord {
+	guint64 offset;
+	guint32 length;
+	guint32 keylen;
+};
+
+static gchar *_grits_pack_path(GritsPack *pack, const gchar *name)
+{
+	return g_build_filename(pack->dir, name, NULL);
+}
+
+static gboolean _grits_pack_write_record(GritsPack *pack, const gchar *key,
+		guint64 offset, guint32 length)
+{
+	struct _PackRecord record = {
+		.offset = offset,
+		.length = length,
+		.keylen = strlen(key),
+	};
+	if (!fwrite(&record, sizeof(record), 1, pack->index) ||
+	    !fwrite(key, record.keylen, 1, pack->index))
+		return FALSE;
+	return fflush(pack->index) == 0;
+}
+
+/* Replay the index log, later records replace earlier ones */
+static void _grits_pack_read_index(GritsPack *pack)
+{
+	struct _PackRecord record;
+	while (fread(&record, sizeof(record), 1, pack->index)) {
+		gchar *key = g_malloc(record.keylen+1);
+		if (!fread(key, record.keylen, 1, pack->index)) {
+			g_free(key); // Truncated by a crash
+			break;
+		}
+		key[record.keylen] = '\0';
+		if (record.length == G_MAXUINT32) {
+			g_hash_table_remove(pack->entries, key);
+			g_free(key);
+		} else if (record.offset + record.length > pack->size) {
+			g_free(key); // Data was not written
+		} else {
+			GritsPackEntry *entry = g_new0(GritsPackEntry, 1);
+			entry->offset = record.offset;
+			entry->length = record.length;
+			g_hash_table_replace(pack->entries, key, entry);
+		}
+	}
+}
+
+static gboolean _grits_pack_open_files(GritsPack *pack)
+{
+	gchar *data  = _grits_pack_path(pack, GRITS_PACK_DATA);
+	gchar *index = _grits_pack_path(pack, GRITS_PACK_INDEX);
+	pack->data   = fopen_p(data,  "a+b");
+	pack->index  = fopen_p(index, "a+b");
+	g_free(data);
+	g_free(index);
+	if (!pack->data || !pack->index)
+		return FALSE;
+	fseek(pack->data, 0, SEEK_END);
+	pack->size = ftell(pack->data);
+	fseek(pack->index, 0, SEEK_SET);
+	return TRUE;
+}
+
+static void _grits_pack_close_files(GritsPack *pack)
+{
+	if (pack->data)  fclose(pack->data);
+	if (pack->index) fclose(pack->index);
+	pack->data  = NULL;
+	pack->index = NULL;
+}
+
+/* A mapping of the data file, and the number of pointers returned by
+ * grits_pack_get() which point into it and have not been released */
+struct _GritsPackMap {
+	GMappedFile  *file;
+	const guint8 *data;
+	gsize         length;
+	gint          readers;
+};
+
+static void _grits_pack_map_free(struct _GritsPackMap *map)
+{
+	g_mapped_file_free(map->file);
+	g_free(map);
+}
+
+/* Make sure the mapping covers the first size bytes of the data file. A
+ * mapping which is replaced is kept until every pointer into it has been
+ * released, see grits_pack_release(). Must be called with the lock held */
+static gboolean _grits_pack_map(GritsPack *pack, guint64 size)
+{
+	if (pack->map && pack->map->length >= size)
+		return TRUE;
+	gchar *path = _grits_pack_path(pack, GRITS_PACK_DATA);
+	GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+	g_free(path);
+	if (!file)
+		return FALSE;
+	struct _GritsPackMap *map = g_new0(struct _GritsPackMap, 1);
+	map->file   = file;
+	map->data   = (guint8*)g_mapped_file_get_contents(file);
+	map->length = g_mapped_file_get_length(file);
+	if (pack->map && pack->map->readers > 0)
+		pack->retired = g_slist_prepend(pack->retired, pack->map);
+	else if (pack->map)
+		_grits_pack_map_free(pack->map);
+	pack->map = map;
+	return map->length >= size;
+}
+
+static void _grits_pack_unmap(GritsPack *pack)
+{
+	if (pack->map)
+		_grits_pack_map_free(pack->map);
+	g_slist_foreach(pack->retired, (GFunc)_grits_pack_map_free, NULL);
+	g_slist_free(pack->retired);
+	pack->map     = NULL;
+	pack->retired = NULL;
+}
+
+/**
+ * grits_pack_open:
+ * @dir: directory containing the pack
+ *
+ * Open the pack stored in @dir, it is created if it does not exist.
+ *
+ * Returns: the #GritsPack, or %NULL if the files could not be opened
+ */
+GritsPack *grits_pack_open(const gchar *dir)
+{
+	g_debug("GritsPack: open - %s", dir);
+	GritsPack *pack = g_new0(GritsPack, 1);
+	pack->dir     = g_strdup(dir);
+	pack->lock    = g_mutex_new();
+	pack->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, g_free);
+	if (!_grits_pack_open_files(pack)) {
+		g_warning("GritsPack: open - unable to open pack in %s", dir);
+		grits_pack_close(pack);
+		return NULL;
+	}
+	_grits_pack_read_index(pack);
+	fseek(pack->index, 0, SEEK_END);
+	return pack;
+}
+
+/**
+ * grits_pack_close:
+ * @pack: the #GritsPack to close
+ *
+ * Close the pack files, pointers returned by grits_pack_get() are no longer
+ * valid afterwards.
+ */
+void grits_pack_close(GritsPack *pack)
+{
+	g_debug("GritsPack: close - %s", pack->dir);
+	_grits_pack_unmap(pack);
+	_grits_pack_close_files(pack);
+	g_hash_table_destroy(pack->entries);
+	g_mutex_free(pack->lock);
+	g_free(pack->dir);
+	g_free(pack);
+}
+
+/**
+ * grits_pack_contains:
+ * @pack: the #GritsPack to search
+ * @key:  the name of the file
+ *
+ * Returns: %TRUE if the pack contains a file named @key
+ */
+gboolean grits_pack_contains(GritsPack *pack, const gchar *key)
+{
+	g_mutex_lock(pack->lock);
+	gboolean found = g_hash_table_lookup(pack->entries, key) != NULL;
+	g_mutex_unlock(pack->lock);
+	return found;
+}
+
+/**
+ * grits_pack_put:
+ * @pack:   the #GritsPack to add to
+ * @key:    the name of the file
+ * @data:   contents of the file
+ * @length: length of @data
+ *
+ * Append a file to the pack, replacing any existing file with the same key.
+ *
+ * Returns: %TRUE if the file was written
+ */
+gboolean grits_pack_put(GritsPack *pack, const gchar *key,
+		const guint8 *data, gsize length)
+{
+	g_return_val_if_fail(length < G_MAXUINT32, FALSE);
+	g_mutex_lock(pack->lock);
+	guint64 offset = pack->size;
+	gboolean ok = (!length || fwrite(data, length, 1, pack->data)) &&
+	              fflush(pack->data) == 0 &&
+	              _grits_pack_write_record(pack, key, offset, length);
+	if (ok) {
+		GritsPackEntry *entry = g_new0(GritsPackEntry, 1);
+		entry->offset = offset;
+		entry->length = length;
+		g_hash_table_replace(pack->entries, g_strdup(key), entry);
+		pack->size += length;
+	} else {
+		g_warning("GritsPack: put - error writing %s", key);
+		fseek(pack->data, 0, SEEK_END);
+		pack->size = ftell(pack->data);
+	}
+	g_mutex_unlock(pack->lock);
+	return ok;
+}
+
+/**
+ * grits_pack_put_file:
+ * @pack: the #GritsPack to add to
+ * @key:  the name of the file in the pack
+ * @path: path to the file to add
+ *
+ * Copy a file into the pack, replacing any existing file with the same key.
+ *
+ * Returns: %TRUE if the file was added
+ */
+gboolean grits_pack_put_file(GritsPack *pack, const gchar *key,
+		const gchar *path)
+{
+	gchar *data;
+	gsize  length;
+	if (!g_file_get_contents(path, &data, &length, NULL))
+		return FALSE;
+	gboolean ok = grits_pack_put(pack, key, (guint8*)data, length);
+	g_free(data);
+	return ok;
+}
+
+/**
+ * grits_pack_get:
+ * @pack:   the #GritsPack to read from
+ * @key:    the name of the file
+ * @length: location to store the length of the file
+ *
+ * Find a file in the pack. The returned data points directly into the
+ * memory mapped pack and must not be modified. It remains valid until it is
+ * released with grits_pack_release(), or the pack is compacted or closed.
+ *
+ * Returns: the contents of the file, or %NULL if it is not in the pack
+ */
+const guint8 *grits_pack_get(GritsPack *pack, const gchar *key, gsize *length)
+{
+	static const guint8 empty[1];
+	const guint8 *data = NULL;
+	g_mutex_lock(pack->lock);
+	GritsPackEntry *entry = g_hash_table_lookup(pack->entries, key);
+	if (entry && entry->length == 0) {
+		data = empty;
+		*length = 0;
+	} else if (entry && _grits_pack_map(pack, entry->offset + entry->length)) {
+		data = pack->map->data + entry->offset;
+		*length = entry->length;
+		pack->map->readers++;
+	}
+	g_mutex_unlock(pack->lock);
+	return data;
+}
+
+static gboolean _grits_pack_map_contains(struct _GritsPackMap *map,
+		const guint8 *data)
+{
+	return data >= map->data && data < map->data + map->length;
+}
+
+/**
+ * grits_pack_release:
+ * @pack: the #GritsPack the data was read from
+ * @data: data returned by grits_pack_get()
+ *
+ * Release a file returned by grits_pack_get(). Mappings of the pack which
+ * have been replaced as the pack grew are freed once nothing points into
+ * them.
+ */
+void grits_pack_release(GritsPack *pack, const guint8 *data)
+{
+	g_mutex_lock(pack->lock);
+	if (pack->map && _grits_pack_map_contains(pack->map, data)) {
+		pack->map->readers--;
+	} else {
+		for (GSList *cur = pack->retired; cur; cur = cur->next) {
+			struct _GritsPackMap *map = cur->data;
+			if (!_grits_pack_map_contains(map, data))
+				continue;
+			if (--map->readers == 0) {
+				pack->retired = g_slist_delete_link(pack->retired, cur);
+				_grits_pack_map_free(map);
+			}
+			break;
+		}
+	}
+	g_mutex_unlock(pack->lock);
+}
+
+/**
+ * grits_pack_remove:
+ * @pack: the #GritsPack to remove from
+ * @key:  the name of the file
+ *
+ * Remove a file from the pack, the space it used is reclaimed by
+ * grits_pack_compact().
+ *
+ * Returns: %TRUE if the file was in the pack
+ */
+gboolean grits_pack_remove(GritsPack *pack, const gchar *key)
+{
+	g_mutex_lock(pack->lock);
+	gboolean found = g_hash_table_remove(pack->entries, key);
+	if (found)
+		_grits_pack_write_record(pack, key, 0, G_MAXUINT32);
+	g_mutex_unlock(pack->lock);
+	return found;
+}
+
+/* Compaction helpers */
+struct _PackCompact {
+	GritsPack *pack;
+	FILE      *data;
+	FILE      *index;
+	guint64    size;
+	gboolean   ok;
+};
+
+static void _grits_pack_compact_entry(gpointer key, gpointer _entry, gpointer _compact)
+{
+	GritsPackEntry      *entry   = _entry;
+	struct _PackCompact *compact = _compact;
+	if (!compact->ok)
+		return;
+	const guint8 *src = compact->pack->map->data;
+	struct _PackRecord record = {
+		.offset = compact->size,
+		.length = entry->length,
+		.keylen = strlen(key),
+	};
+	compact->ok = (!entry->length ||
+	               fwrite(src + entry->offset, entry->length, 1, compact->data)) &&
+	              fwrite(&record, sizeof(record), 1, compact->index) &&
+	              fwrite(key, record.keylen, 1, compact->index);
+	entry->offset  = compact->size;
+	compact->size += entry->length;
+}
+
+/**
+ * grits_pack_compact:
+ * @pack: the #GritsPack to compact
+ *
+ * Rewrite the pack so it only contains the current version of each file.
+ * Pointers returned by grits_pack_get() are no longer valid afterwards, so
+ * this should not be called while the pack is being read from.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean grits_pack_compact(GritsPack *pack)
+{
+	g_debug("GritsPack: compact - %s", pack->dir);
+	g_mutex_lock(pack->lock);
+	gchar *data      = _grits_pack_path(pack, GRITS_PACK_DATA);
+	gchar *index     = _grits_pack_path(pack, GRITS_PACK_INDEX);
+	gchar *data_tmp  = g_strconcat(data,  ".tmp", NULL);
+	gchar *index_tmp = g_strconcat(index, ".tmp", NULL);
+
+	struct _PackCompact compact = {
+		.pack  = pack,
+		.data  = fopen(data_tmp,  "wb"),
+		.index = fopen(index_tmp, "wb"),
+		.ok    = TRUE,
+	};
+	if (!compact.data || !compact.index || !_grits_pack_map(pack, pack->size))
+		compact.ok = pack->size == 0 && compact.data && compact.index;
+	else
+		g_hash_table_foreach(pack->entries, _grits_pack_compact_entry, &compact);
+	if (compact.data  && fclose(compact.data))  compact.ok = FALSE;
+	if (compact.index && fclose(compact.index)) compact.ok = FALSE;
+
+	_grits_pack_unmap(pack);
+	_grits_pack_close_files(pack);
+	if (compact.ok) {
+		g_rename(data_tmp,  data);
+		g_rename(index_tmp, index);
+	} else {
+		g_warning("GritsPack: compact - error writing %s", pack->dir);
+		g_remove(data_tmp);
+		g_remove(index_tmp);
+	}
+
+	/* Reload the index, offsets changed if the compaction succeeded */
+	g_hash_table_remove_all(pack->entries);
+	if (_grits_pack_open_files(pack)) {
+		_grits_pack_read_index(pack);
+		fseek(pack->index, 0, SEEK_END);
+	}
+
+	g_free(data);
+	g_free(index);
+	g_free(data_tmp);
+	g_free(index_tmp);
+	g_mutex_unlock(pack->lock);
+	return compact.ok;
+}
+
+/* Recursively add the files in a directory */
+static gint _grits_pack_import_dir(GritsPack *pack, const gchar *rel,
+		gboolean remove)
+{
+	gint count = 0;
+	gchar *path = g_build_filename(pack->dir, rel, NULL);
+	GDir  *dir  = g_dir_open(path, 0, NULL);
+	const gchar *name;
+	while (dir && (name = g_dir_read_name(dir))) {
+		gchar *child_rel  = *rel ? g_build_filename(rel, name, NULL)
+		                         : g_strdup(name);
+		gchar *child_path = g_build_filename(path, name, NULL);
+		if (g_file_test(child_path, G_FILE_TEST_IS_DIR)) {
+			count += _grits_pack_import_dir(pack, child_rel, remove);
+			if (remove)
+				g_rmdir(child_path);
+		} else if (!*rel && (g_str_has_prefix(name, GRITS_PACK_DATA) ||
+		                     g_str_has_prefix(name, GRITS_PACK_INDEX))) {
+			/* Skip the pack itself */
+		} else if (g_str_has_suffix(name, ".part") ||
+		           g_str_has_suffix(name, ".meta")) {
+			/* Skip incomplete downloads and revalidation data */
+		} else if (name[0] == '.') {
+			/* Skip hidden files such as the cache index */
+		} else if (grits_pack_put_file(pack, child_rel, child_path)) {
+			count++;
+			if (remove)
+				g_remove(child_path);
+		}
+		g_free(child_rel);
+		g_free(child_path);
+	}
+	if (dir)
+		g_dir_close(dir);
+	g_free(path);
+	return count;
+}
+
+/**
+ * grits_pack_import:
+ * @pack:   the #GritsPack to add to
+ * @remove: %TRUE to delete each file after it has been added
+ *
+ * Add the files stored as separate files in the packs directory, this is the
+ * layout used by #GritsHttp when no pack is used. The key for each file is
+ * it's path relative to the directory. Partial downloads are skipped.
+ *
+ * Returns: the number of files added
+ */
+gint grits_pack_import(GritsPack *pack, gboolean remove)
+{
+	g_debug("GritsPack: import - %s", pack->dir);
+	return _grits_pack_import_dir(pack, "", remove);
+}
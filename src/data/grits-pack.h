@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_PACK_H__
+#define __GRITS_PACK_H__
+
+#include <glib.h>
+
+/* Names of the pack files within the cache directory */
+#define GRITS_PACK_DATA  "tiles.pack"
+#define GRITS_PACK_INDEX "tiles.idx"
+
+typedef struct _GritsPackEntry {
+	guint64 offset;
+	guint32 length;
+} GritsPackEntry;
+
+struct _GritsPackMap;
+
+typedef struct _GritsPack {
+	gchar       *dir;
+	GMutex      *lock;
+	FILE        *data;
+	FILE        *index;
+	guint64      size;
+	GHashTable  *entries;
+	struct _GritsPackMap *map;
+	GSList      *retired;
+} GritsPack;
+
+GritsPack *grits_pack_open(const gchar *dir);
+
+void grits_pack_close(GritsPack *pack);
+
+gboolean grits_pack_contains(GritsPack *pack, const gchar *key);
+
+gboolean grits_pack_put(GritsPack *pack, const gchar *key,
+		const guint8 *data, gsize length);
+
+gboolean grits_pack_put_file(GritsPack *pack, const gchar *key,
+		const gchar *path);
+
+const guint8 *grits_pack_get(GritsPack *pack, const gchar *key, gsize *length);
+
+void grits_pack_release(GritsPack *pack, const guint8 *data);
+
+gboolean grits_pack_remove(GritsPack *pack, const gchar *key);
+
+gboolean grits_pack_compact(GritsPack *pack);
+
+gint grits_pack_import(GritsPack *pack, gboolean remove);
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-prefetch
+ * @short_description: Predictive tile downloads
+ *
+ * #GritsPrefetch downloads tiles before they are needed. The caller
+ * supplies the current camera location and the location the camera is
+ * expected to be at shortly, see grits_viewer_predict_location(). The tiles
+ * grits_tile_update() would want at the predicted location are queued for
+ * download in a low priority background thread so that they are already in
+ * the cache when the camera arrives.
+ *
+ * Queued downloads are dropped when the direction of motion changes.
+ */
+
+#include <config.h>
+#include <math.h>
+#include <time.h>
+#include <glib.h>
+
+#include "grits-prefetch.h"
+
+/* Prefetched tiles which have not been loaded are forgotten after this */
+#define MAX_DONE 4096
+
+struct _PrefetchJob {
+	GritsTile *tile;
+	gint       generation;
+};
+
+static guint _grits_prefetch_key_hash(gconstpointer key)
+{
+	guint64 value = *(const guint64*)key;
+	return (guint)(value ^ (value >> 32));
+}
+
+static gboolean _grits_prefetch_key_equal(gconstpointer a, gconstpointer b)
+{
+	return *(const guint64*)a == *(const guint64*)b;
+}
+
+static gboolean _grits_prefetch_is_loaded(GritsPrefetch *prefetch, GritsTile *tile)
+{
+	return grits_tile_lookup(prefetch->tiles,
+			tile->level, tile->x, tile->y) != NULL;
+}
+
+/* Decide if the camera has stopped, started, or turned enough that the
+ * queued tiles are no longer likely to be needed */
+static gboolean _grits_prefetch_changed(gdouble *a, gdouble *b)
+{
+	gdouble pan_a = hypot(a[0], a[1]);
+	gdouble pan_b = hypot(b[0], b[1]);
+	if ((pan_a > 0) != (pan_b > 0))
+		return TRUE;
+	if (pan_a > 0 && (a[0]*b[0] + a[1]*b[1]) / (pan_a*pan_b) < M_SQRT1_2)
+		return TRUE;
+	if ((a[2] > 0) != (b[2] > 0) || (a[2] < 0) != (b[2] < 0))
+		return TRUE;
+	return FALSE;
+}
+
+/* Runs in the prefetch thread */
+static void _grits_prefetch_run(gpointer _job, gpointer _prefetch)
+{
+	struct _PrefetchJob *job = _job;
+	GritsPrefetch *prefetch = _prefetch;
+	GritsTile     *tile     = job->tile;
+
+	gboolean current = job->generation ==
+		g_atomic_int_get(&prefetch->generation);
+	gboolean fetched = FALSE;
+	if (current && !_grits_prefetch_is_loaded(prefetch, tile))
+		fetched = prefetch->fetch(tile, prefetch->user_data);
+
+	g_mutex_lock(prefetch->lock);
+	g_hash_table_remove(prefetch->pending, &tile->key);
+	if (!current) {
+		prefetch->stats.cancelled++;
+	} else if (fetched) {
+		prefetch->stats.fetched++;
+		if (g_hash_table_size(prefetch->done) >= MAX_DONE) {
+			prefetch->stats.expired += g_hash_table_size(prefetch->done);
+			g_hash_table_remove_all(prefetch->done);
+		}
+		g_hash_table_insert(prefetch->done,
+			g_memdup(&tile->key, sizeof(tile->key)), tile);
+	}
+	g_mutex_unlock(prefetch->lock);
+
+	g_object_unref(tile);
+	g_free(job);
+}
+
+/* Called by grits_tile_update for each tile wanted at the future location */
+static void _grits_prefetch_queue(GritsTile *tile, gpointer _prefetch)
+{
+	GritsPrefetch *prefetch = _prefetch;
+
+	/* Mark the tile so it can be collected by grits_tile_gc */
+	tile->data = prefetch;
+	if (_grits_prefetch_is_loaded(prefetch, tile))
+		return;
+
+	g_mutex_lock(prefetch->lock);
+	if (g_hash_table_lookup(prefetch->pending, &tile->key) ||
+	    g_hash_table_lookup(prefetch->done,    &tile->key)) {
+		g_mutex_unlock(prefetch->lock);
+		return;
+	}
+	g_hash_table_insert(prefetch->pending,
+		g_memdup(&tile->key, sizeof(tile->key)), tile);
+	prefetch->stats.queued++;
+	g_mutex_unlock(prefetch->lock);
+
+	struct _PrefetchJob *job = g_new0(struct _PrefetchJob, 1);
+	job->tile       = g_object_ref(tile);
+	job->generation = g_atomic_int_get(&prefetch->generation);
+	g_thread_pool_push(prefetch->threads, job, NULL);
+}
+
+static void _grits_prefetch_unmark(GritsTile *tile, gpointer _prefetch)
+{
+	tile->data = NULL;
+}
+
+static GritsTile *_grits_prefetch_new_wanted(GritsPrefetch *prefetch)
+{
+	GritsBounds *edge = &prefetch->tiles->edge;
+	return grits_tile_new_with_layout(grits_tile_get_layout(prefetch->tiles),
+			edge->n, edge->s, edge->e, edge->w);
+}
+
+/**
+ * grits_prefetch_new:
+ * @tiles:     the root of the tile tree to prefetch for
+ * @ahead:     how many seconds ahead of the camera to prefetch
+ * @res:       resolution passed to grits_tile_update() for @tiles
+ * @width:     width passed to grits_tile_update() for @tiles
+ * @height:    height passed to grits_tile_update() for @tiles
+ * @fetch:     function used to download a tile
+ * @user_data: user data to pass to @fetch
+ *
+ * Create a prefetcher for a tree of tiles. The @res, @width and @height
+ * should match the values used to update @tiles so that the same tiles are
+ * selected.
+ *
+ * Returns: the new #GritsPrefetch
+ */
+GritsPrefetch *grits_prefetch_new(GritsTile *tiles, gdouble ahead,
+		gdouble res, gint width, gint height,
+		GritsPrefetchFunc fetch, gpointer user_data)
+{
+	g_debug("GritsPrefetch: new - ahead=%f", ahead);
+	GritsPrefetch *prefetch = g_new0(GritsPrefetch, 1);
+	prefetch->tiles     = tiles;
+	prefetch->ahead     = ahead;
+	prefetch->res       = res;
+	prefetch->width     = width;
+	prefetch->height    = height;
+	prefetch->fetch     = fetch;
+	prefetch->user_data = user_data;
+	prefetch->wanted    = _grits_prefetch_new_wanted(prefetch);
+	prefetch->threads   = g_thread_pool_new(_grits_prefetch_run,
+			prefetch, 1, FALSE, NULL);
+	prefetch->lock      = g_mutex_new();
+	prefetch->pending   = g_hash_table_new_full(_grits_prefetch_key_hash,
+			_grits_prefetch_key_equal, g_free, NULL);
+	prefetch->done      = g_hash_table_new_full(_grits_prefetch_key_hash,
+			_grits_prefetch_key_equal, g_free, NULL);
+	return prefetch;
+}
+
+/**
+ * grits_prefetch_update:
+ * @prefetch: the #GritsPrefetch to update
+ * @eye:      the current location of the camera
+ * @future:   the predicted location of the camera, or %NULL if it is not
+ *            moving
+ *
+ * Queue downloads for the tiles wanted at the @future location. If the
+ * motion has changed since the last update the queued downloads are
+ * cancelled first.
+ *
+ * This should be called from the same thread which updates the tiles.
+ */
+void grits_prefetch_update(GritsPrefetch *prefetch,
+		GritsPoint *eye, GritsPoint *future)
+{
+	gdouble motion[3] = {0, 0, 0};
+	if (future) {
+		motion[0] = future->lat - eye->lat;
+		motion[1] = future->lon - eye->lon;
+		if (motion[1] >  180) motion[1] -= 360;
+		if (motion[1] < -180) motion[1] += 360;
+		if (future->elev > 0 && eye->elev > 0)
+			motion[2] = log(future->elev / eye->elev);
+	}
+	if (_grits_prefetch_changed(prefetch->motion, motion))
+		grits_prefetch_cancel(prefetch);
+	for (int i = 0; i < 3; i++)
+		prefetch->motion[i] = motion[i];
+	if (!future)
+		return;
+
+	grits_tile_update(prefetch->wanted, future,
+			prefetch->res, prefetch->width, prefetch->height,
+			_grits_prefetch_queue, prefetch);
+	grits_tile_gc(prefetch->wanted, time(NULL)-10,
+			_grits_prefetch_unmark, prefetch);
+}
+
+/**
+ * grits_prefetch_cancel:
+ * @prefetch: the #GritsPrefetch to cancel
+ *
+ * Drop all queued downloads. Downloads which are already in progress are
+ * allowed to finish.
+ */
+void grits_prefetch_cancel(GritsPrefetch *prefetch)
+{
+	g_debug("GritsPrefetch: cancel");
+	g_atomic_int_inc(&prefetch->generation);
+	grits_tile_free(prefetch->wanted, NULL, NULL);
+	prefetch->wanted = _grits_prefetch_new_wanted(prefetch);
+}
+
+/**
+ * grits_prefetch_claim:
+ * @prefetch: the #GritsPrefetch to record the load in
+ * @tile:     a tile in the tree being prefetched for
+ *
+ * Record that @tile is being loaded, this is used to measure how effective
+ * prefetching is.
+ */
+void grits_prefetch_claim(GritsPrefetch *prefetch, GritsTile *tile)
+{
+	g_mutex_lock(prefetch->lock);
+	if (g_hash_table_remove(prefetch->done, &tile->key))
+		prefetch->stats.hits++;
+	else if (g_hash_table_lookup(prefetch->pending, &tile->key))
+		prefetch->stats.late++;
+	else
+		prefetch->stats.misses++;
+	g_mutex_unlock(prefetch->lock);
+}
+
+/**
+ * grits_prefetch_get_stats:
+ * @prefetch: the #GritsPrefetch to get statistics for
+ * @stats:    location to store the statistics
+ *
+ * Copy the counters describing how many tiles have been prefetched and how
+ * many of them were used. The hit rate is @hits / (@hits + @late + @misses).
+ */
+void grits_prefetch_get_stats(GritsPrefetch *prefetch, GritsPrefetchStats *stats)
+{
+	g_mutex_lock(prefetch->lock);
+	*stats = prefetch->stats;
+	g_mutex_unlock(prefetch->lock);
+}
+
+/**
+ * grits_prefetch_free:
+ * @prefetch: the #GritsPrefetch to free
+ *
+ * Cancel queued downloads, wait for the current download to finish, and
+ * free resources used by @prefetch.
+ */
+void grits_prefetch_free(GritsPrefetch *prefetch)
+{
+	g_debug("GritsPrefetch: free - hits=%u late=%u misses=%u",
+			prefetch->stats.hits,
+			prefetch->stats.late,
+			prefetch->stats.misses);
+	g_atomic_int_inc(&prefetch->generation);
+	g_thread_pool_free(prefetch->threads, FALSE, TRUE);
+	grits_tile_free(prefetch->wanted, NULL, NULL);
+	g_hash_table_destroy(prefetch->pending);
+	g_hash_table_destroy(prefetch->done);
+	g_mutex_free(prefetch->lock);
+	g_free(prefetch);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_PREFETCH_H__
+#define __GRITS_PREFETCH_H__
+
+#include <glib.h>
+
+#include "objects/grits-tile.h"
+
+/**
+ * GritsPrefetchFunc:
+ * @tile:      a tile which will be wanted soon
+ * @user_data: user data passed to grits_prefetch_new()
+ *
+ * Download the data for a tile without loading it. This is called from a
+ * background thread and @tile is not part of the tree being prefetched for.
+ *
+ * Returns: %TRUE if the data was downloaded
+ */
+typedef gboolean (*GritsPrefetchFunc)(GritsTile *tile, gpointer user_data);
+
+typedef struct _GritsPrefetchStats {
+	guint queued;    // tiles queued for prefetching
+	guint fetched;   // tiles downloaded before they were needed
+	guint cancelled; // queued tiles dropped because the motion changed
+	guint expired;   // fetched tiles which were never loaded
+	guint hits;      // loads of tiles which had already been fetched
+	guint late;      // loads of tiles which were still queued
+	guint misses;    // loads of tiles which were never prefetched
+} GritsPrefetchStats;
+
+typedef struct _GritsPrefetch {
+	GritsTile   *tiles;
+	GritsTile   *wanted;
+	gdouble      ahead;
+	gdouble      res;
+	gint         width;
+	gint         height;
+	GritsPrefetchFunc fetch;
+	gpointer     user_data;
+
+	GThreadPool *threads;
+	GMutex      *lock;
+	GHashTable  *pending;
+	GHashTable  *done;
+	gint         generation;
+	gdouble      motion[3];
+	GritsPrefetchStats stats;
+} GritsPrefetch;
+
+GritsPrefetch *grits_prefetch_new(GritsTile *tiles, gdouble ahead,
+		gdouble res, gint width, gint height,
+		GritsPrefetchFunc fetch, gpointer user_data);
+
+void grits_prefetch_update(GritsPrefetch *prefetch,
+		GritsPoint *eye, GritsPoint *future);
+
+void grits_prefetch_cancel(GritsPrefetch *prefetch);
+
+void grits_prefetch_claim(GritsPrefetch *prefetch, GritsTile *tile);
+
+void grits_prefetch_get_stats(GritsPrefetch *prefetch, GritsPrefetchStats *stats);
+
+void grits_prefetch_free(GritsPrefetch *prefetch);
+
+#endif
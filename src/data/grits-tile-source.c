@@ -0,0 +1,704 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-tile-source
+ * @short_description: Tile image servers
+ *
+ * A #GritsTileSource provides the images for a tree of #GritsTile<!-- -->s so
+ * that plugins do not need to know which kind of server the images come from.
+ *
+ * Two network sources are provided. A WMS source fetches each tile using a
+ * GetMap request, see #GritsWms. An XYZ source uses the pre-rendered web
+ * mercator tiles served by slippy maps, the tiles covering a #GritsTile are
+ * fetched in parallel and reprojected into a single image in the calling
+ * thread.
+ *
+ * Two offline sources are provided for elevation data. A local source reads
+ * tiles from a directory laid out the same way as the download cache. A
+ * fractal source generates repeatable terrain from a seed, which is useful
+ * for testing and benchmarking without a network connection.
+ */
+
+#include <config.h>
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "grits-tile-source.h"
+#include "grits-cache-manager.h"
+
+/* Web mercator does not reach the poles */
+#define XYZ_MAX_LAT   85.0511287798
+
+/* Size of the source tiles, assumed until one has been loaded */
+#define XYZ_TILE_SIZE 256
+
+/* Most source tiles to combine into one image */
+#define XYZ_MAX_TILES 64
+
+/*******
+ * WMS *
+ *******/
+struct _GritsTileSourceWms {
+	GritsTileSource source;
+	GritsWms       *wms;
+};
+
+static gchar *_grits_tile_source_wms_fetch(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	struct _GritsTileSourceWms *wms = (struct _GritsTileSourceWms*)source;
+	return grits_wms_fetch(wms->wms, tile, mode, callback, user_data);
+}
+
+static const guint8 *_grits_tile_source_wms_fetch_data(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data, gsize *length)
+{
+	struct _GritsTileSourceWms *wms = (struct _GritsTileSourceWms*)source;
+	return grits_wms_fetch_data(wms->wms, tile, mode,
+			callback, user_data, length);
+}
+
+static void _grits_tile_source_wms_release_data(GritsTileSource *source,
+		const guint8 *data)
+{
+	struct _GritsTileSourceWms *wms = (struct _GritsTileSourceWms*)source;
+	grits_wms_release_data(wms->wms, data);
+}
+
+static void _grits_tile_source_wms_free(GritsTileSource *source)
+{
+	struct _GritsTileSourceWms *wms = (struct _GritsTileSourceWms*)source;
+	grits_wms_free(wms->wms);
+}
+
+/**
+ * grits_tile_source_new_wms:
+ * @wms: the #GritsWms to fetch images from
+ *
+ * Create a tile source for a Web Map Service. The source takes ownership of
+ * @wms.
+ *
+ * Returns: the new #GritsTileSource
+ */
+GritsTileSource *grits_tile_source_new_wms(GritsWms *wms)
+{
+	g_debug("GritsTileSource: new_wms - %s", wms->uri_prefix);
+	struct _GritsTileSourceWms *source = g_new0(struct _GritsTileSourceWms, 1);
+	source->source.http  = wms->http;
+	source->source.fetch        = _grits_tile_source_wms_fetch;
+	source->source.fetch_data   = _grits_tile_source_wms_fetch_data;
+	source->source.release_data = _grits_tile_source_wms_release_data;
+	source->source.free         = _grits_tile_source_wms_free;
+	source->wms                 = wms;
+	return &source->source;
+}
+
+/*******
+ * XYZ *
+ *******/
+struct _GritsTileSourceXyz {
+	GritsTileSource source;
+	gchar          *uri;
+	gchar          *extension;
+	gint            width;
+	gint            height;
+	guint           max_zoom;
+};
+
+/* Waiting for the source tiles covering one image */
+struct _XyzFetch {
+	GMutex *lock;
+	GCond  *cond;
+	gint    pending;
+};
+
+struct _XyzPart {
+	struct _XyzFetch *fetch;
+	gchar            *path;
+	GdkPixbuf        *pixbuf;
+};
+
+/* Distance from the north edge of the mercator map, from 0 to 1 */
+static gdouble _lat2merc(gdouble lat)
+{
+	gdouble rad = CLAMP(lat, -XYZ_MAX_LAT, XYZ_MAX_LAT) * G_PI / 180;
+	return (1 - log(tan(rad) + 1/cos(rad)) / G_PI) / 2;
+}
+
+static gdouble _lon2merc(gdouble lon)
+{
+	return (lon + 180) / 360;
+}
+
+/* Expand {z}, {x}, {y} and {-y} (TMS) in the uri template */
+static gchar *_xyz_make_uri(struct _GritsTileSourceXyz *xyz,
+		guint z, guint x, guint y)
+{
+	GString *uri = g_string_new("");
+	const gchar *c = xyz->uri;
+	while (*c) {
+		if (g_str_has_prefix(c, "{z}")) {
+			g_string_append_printf(uri, "%u", z);
+			c += 3;
+		} else if (g_str_has_prefix(c, "{x}")) {
+			g_string_append_printf(uri, "%u", x);
+			c += 3;
+		} else if (g_str_has_prefix(c, "{y}")) {
+			g_string_append_printf(uri, "%u", y);
+			c += 3;
+		} else if (g_str_has_prefix(c, "{-y}")) {
+			g_string_append_printf(uri, "%u", (1<<z)-1-y);
+			c += 4;
+		} else {
+			g_string_append_c(uri, *c++);
+		}
+	}
+	return g_string_free(uri, FALSE);
+}
+
+static const gchar *_xyz_pixbuf_type(struct _GritsTileSourceXyz *xyz)
+{
+	return g_str_equal(xyz->extension, "png") ? "png" : "jpeg";
+}
+
+/* Runs in the shared HTTP thread, so the part is decoded by the caller */
+static void _xyz_done_cb(gchar *path, gpointer _part)
+{
+	struct _XyzPart  *part  = _part;
+	struct _XyzFetch *fetch = part->fetch;
+	part->path = path;
+	g_mutex_lock(fetch->lock);
+	if (--fetch->pending == 0)
+		g_cond_signal(fetch->cond);
+	g_mutex_unlock(fetch->lock);
+}
+
+/* Pick the smallest zoom level which is at least as detailed as the tile,
+ * limited so the number of source tiles stays reasonable */
+static guint _xyz_get_zoom(struct _GritsTileSourceXyz *xyz, GritsBounds *edge)
+{
+	gdouble want = 360 * xyz->width / ((edge->e - edge->w) * XYZ_TILE_SIZE);
+	guint   zoom = MIN(MAX(ceil(log2(want)), 0), xyz->max_zoom);
+	for (; zoom > 0; zoom--) {
+		gdouble n = 1 << zoom;
+		gint cols = floor(_lon2merc(edge->e) * n - 1e-9) -
+		            floor(_lon2merc(edge->w) * n) + 1;
+		gint rows = floor(_lat2merc(edge->s) * n - 1e-9) -
+		            floor(_lat2merc(edge->n) * n) + 1;
+		if (rows * cols <= XYZ_MAX_TILES)
+			break;
+	}
+	return zoom;
+}
+
+/* Resample the source tiles into the tile's lat-lon grid */
+static GdkPixbuf *_xyz_mosaic(struct _GritsTileSourceXyz *xyz,
+		GritsBounds *edge, guint zoom, gint x0, gint y0,
+		gint rows, gint cols, struct _XyzPart *parts)
+{
+	gboolean   alpha = g_str_equal(_xyz_pixbuf_type(xyz), "png");
+	GdkPixbuf *out   = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, 8,
+			xyz->width, xyz->height);
+	gdk_pixbuf_fill(out, 0);
+	guchar *dst      = gdk_pixbuf_get_pixels(out);
+	gint    dst_step = gdk_pixbuf_get_n_channels(out);
+	gint    dst_row  = gdk_pixbuf_get_rowstride(out);
+
+	gint size = XYZ_TILE_SIZE;
+	for (guint i = 0; parts[i].fetch; i++)
+		if (parts[i].pixbuf)
+			size = gdk_pixbuf_get_width(parts[i].pixbuf);
+	gdouble scale = (1 << zoom) * size;
+
+	for (gint j = 0; j < xyz->height; j++) {
+		gdouble lat = edge->n - (j+0.5) * (edge->n - edge->s) / xyz->height;
+		if (lat > XYZ_MAX_LAT || lat < -XYZ_MAX_LAT)
+			continue;
+		gint py = _lat2merc(lat) * scale;
+		gint ty = py / size - y0;
+		py %= size;
+		if (ty < 0 || ty >= rows)
+			continue;
+		for (gint i = 0; i < xyz->width; i++) {
+			gdouble lon = edge->w + (i+0.5) * (edge->e - edge->w) / xyz->width;
+			gint px = _lon2merc(lon) * scale;
+			gint tx = px / size - x0;
+			px %= size;
+			if (tx < 0 || tx >= cols)
+				continue;
+			GdkPixbuf *src = parts[ty*cols + tx].pixbuf;
+			if (!src || px >= gdk_pixbuf_get_width(src) ||
+			            py >= gdk_pixbuf_get_height(src))
+				continue;
+			gint    src_step = gdk_pixbuf_get_n_channels(src);
+			guchar *sp = gdk_pixbuf_get_pixels(src) +
+				py*gdk_pixbuf_get_rowstride(src) + px*src_step;
+			guchar *dp = dst + j*dst_row + i*dst_step;
+			dp[0] = sp[0];
+			dp[1] = sp[1];
+			dp[2] = sp[2];
+			if (alpha)
+				dp[3] = src_step == 4 ? sp[3] : 0xff;
+		}
+	}
+	return out;
+}
+
+static gchar *_grits_tile_source_xyz_fetch(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	struct _GritsTileSourceXyz *xyz = (struct _GritsTileSourceXyz*)source;
+
+	/* Use the reprojected image if possible */
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%s%s", tilep, xyz->extension);
+	gchar *path  = grits_http_get_cache_path(source->http, local);
+	g_free(tilep);
+	if ((mode == GRITS_LOCAL || mode == GRITS_ONCE) &&
+	    grits_cache_manager_claim(source->http->prefix, local, path)) {
+		g_free(local);
+		return path;
+	}
+	if (mode == GRITS_LOCAL) {
+		g_free(local);
+		g_free(path);
+		return NULL;
+	}
+
+	/* Fetch the source tiles in parallel */
+	GritsBounds *edge = &tile->edge;
+	guint zoom = _xyz_get_zoom(xyz, edge);
+	gdouble n  = 1 << zoom;
+	guint x0   = floor(_lon2merc(edge->w) * n);
+	guint x1   = MIN(floor(_lon2merc(edge->e) * n - 1e-9), n-1);
+	guint y0   = floor(_lat2merc(edge->n) * n);
+	guint y1   = MIN(floor(_lat2merc(edge->s) * n - 1e-9), n-1);
+	guint cols = x1 - x0 + 1;
+	guint rows = y1 - y0 + 1;
+	g_debug("GritsTileSource: xyz_fetch - %s z=%u x=%u-%u y=%u-%u",
+			local, zoom, x0, x1, y0, y1);
+
+	struct _XyzFetch fetch = {g_mutex_new(), g_cond_new(), rows*cols};
+	struct _XyzPart *parts = g_new0(struct _XyzPart, rows*cols + 1);
+	for (guint y = 0; y < rows; y++)
+	for (guint x = 0; x < cols; x++)
+		parts[y*cols + x].fetch = &fetch;
+	for (guint y = 0; y < rows; y++)
+	for (guint x = 0; x < cols; x++) {
+		gchar *uri  = _xyz_make_uri(xyz, zoom, x0+x, y0+y);
+		gchar *part = g_strdup_printf("%u/%u/%u.%s",
+				zoom, x0+x, y0+y, xyz->extension);
+		grits_http_fetch_async(source->http, uri, part,
+				mode == GRITS_REFRESH ? GRITS_UPDATE : mode,
+				callback, _xyz_done_cb, &parts[y*cols + x]);
+		g_free(uri);
+		g_free(part);
+	}
+	g_mutex_lock(fetch.lock);
+	while (fetch.pending > 0)
+		g_cond_wait(fetch.cond, fetch.lock);
+	g_mutex_unlock(fetch.lock);
+
+	/* Combine them, unless some are missing */
+	gboolean complete = TRUE;
+	for (guint i = 0; i < rows*cols && complete; i++) {
+		if (parts[i].path)
+			parts[i].pixbuf = gdk_pixbuf_new_from_file(parts[i].path, NULL);
+		complete = parts[i].pixbuf != NULL;
+	}
+	if (complete) {
+		GdkPixbuf *pixbuf = _xyz_mosaic(xyz, edge, zoom,
+				x0, y0, rows, cols, parts);
+		gchar *tmp = g_strconcat(path, ".part", NULL);
+		const gchar *type = _xyz_pixbuf_type(xyz);
+		gboolean ok = g_str_equal(type, "jpeg")
+			? gdk_pixbuf_save(pixbuf, tmp, type, NULL, "quality", "95", NULL)
+			: gdk_pixbuf_save(pixbuf, tmp, type, NULL, NULL);
+		if (ok && g_rename(tmp, path) == 0) {
+			grits_cache_manager_add(source->http->prefix, local, path);
+		} else {
+			g_warning("GritsTileSource: xyz_fetch - error saving %s", path);
+			g_remove(tmp);
+			complete = FALSE;
+		}
+		g_object_unref(pixbuf);
+		g_free(tmp);
+	}
+
+	for (guint i = 0; i < rows*cols; i++) {
+		if (parts[i].pixbuf)
+			g_object_unref(parts[i].pixbuf);
+		g_free(parts[i].path);
+	}
+	g_free(parts);
+	g_mutex_free(fetch.lock);
+	g_cond_free(fetch.cond);
+	g_free(local);
+	if (!complete) {
+		g_free(path);
+		return NULL;
+	}
+	return path;
+}
+
+static void _grits_tile_source_xyz_free(GritsTileSource *source)
+{
+	struct _GritsTileSourceXyz *xyz = (struct _GritsTileSourceXyz*)source;
+	grits_http_free(source->http);
+	g_free(xyz->uri);
+	g_free(xyz->extension);
+}
+
+/**
+ * grits_tile_source_new_xyz:
+ * @uri:       template for the tile URLs, {z}, {x} and {y} are replaced with
+ *             the tile location, or {-y} for TMS servers which count rows
+ *             from the south
+ * @prefix:    prefix to use for local files
+ * @extension: file extension for local files, "png" or "jpg"
+ * @width:     width in pixels for the reprojected images
+ * @height:    height in pixels for the reprojected images
+ * @max_zoom:  the deepest zoom level available from the server
+ *
+ * Create a tile source for a server using the z/x/y web mercator tiles used
+ * by slippy maps. For example:
+ * "http://tile.openstreetmap.org/{z}/{x}/{y}.png"
+ *
+ * Returns: the new #GritsTileSource
+ */
+GritsTileSource *grits_tile_source_new_xyz(const gchar *uri,
+		const gchar *prefix, const gchar *extension,
+		gint width, gint height, guint max_zoom)
+{
+	g_debug("GritsTileSource: new_xyz - %s", uri);
+	struct _GritsTileSourceXyz *source = g_new0(struct _GritsTileSourceXyz, 1);
+	source->source.http  = grits_http_new(prefix);
+	source->source.fetch = _grits_tile_source_xyz_fetch;
+	source->source.free  = _grits_tile_source_xyz_free;
+	source->uri          = g_strdup(uri);
+	source->extension    = g_strdup(extension);
+	source->width        = width;
+	source->height       = height;
+	source->max_zoom     = max_zoom;
+	return &source->source;
+}
+
+/*********
+ * Local *
+ *********/
+struct _GritsTileSourceLocal {
+	GritsTileSource source;
+	gchar          *dir;
+	gchar          *extension;
+};
+
+static gchar *_grits_tile_source_local_fetch(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	struct _GritsTileSourceLocal *local = (struct _GritsTileSourceLocal*)source;
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *file  = g_strdup_printf("%s%s", tilep, local->extension);
+	gchar *path  = g_build_filename(local->dir, file, NULL);
+	g_free(tilep);
+	g_free(file);
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+		g_debug("GritsTileSource: local_fetch - missing %s", path);
+		g_free(path);
+		return NULL;
+	}
+	return path;
+}
+
+static void _grits_tile_source_local_free(GritsTileSource *source)
+{
+	struct _GritsTileSourceLocal *local = (struct _GritsTileSourceLocal*)source;
+	g_free(local->dir);
+	g_free(local->extension);
+}
+
+/**
+ * grits_tile_source_new_local:
+ * @dir:       directory containing the tiles
+ * @extension: file extension of the tiles, e.g. "bil"
+ *
+ * Create a tile source which reads tiles from a directory instead of
+ * downloading them. The files are named the same way as in the download
+ * cache, so a cache directory can be copied to another machine and used
+ * directly. Tiles missing from the directory fail to load.
+ *
+ * Returns: the new #GritsTileSource
+ */
+GritsTileSource *grits_tile_source_new_local(const gchar *dir,
+		const gchar *extension)
+{
+	g_debug("GritsTileSource: new_local - %s", dir);
+	struct _GritsTileSourceLocal *source = g_new0(struct _GritsTileSourceLocal, 1);
+	source->source.fetch = _grits_tile_source_local_fetch;
+	source->source.free  = _grits_tile_source_local_free;
+	source->dir          = g_strdup(dir);
+	source->extension    = g_strdup(extension);
+	return &source->source;
+}
+
+/***********
+ * Fractal *
+ ***********/
+/* Size of the largest features in degrees, and their height in meters */
+#define FRACTAL_SCALE   16.0
+#define FRACTAL_HEIGHT  3000.0
+#define FRACTAL_OCTAVES 24
+
+struct _GritsTileSourceFractal {
+	GritsTileSource source;
+	guint64         seed;
+	gint            width;
+	gint            height;
+};
+
+/* Random value between -1 and 1 for a grid point */
+static gdouble _fractal_hash(guint64 seed, gint64 x, gint64 y)
+{
+	guint64 h = seed ^ (x * 0x9e3779b97f4a7c15ULL) ^ (y * 0xc2b2ae3d27d4eb4fULL);
+	h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return (h >> 11) * (2.0 / (1ULL << 53)) - 1;
+}
+
+/* Smoothly interpolated value noise */
+static gdouble _fractal_noise(guint64 seed, gdouble x, gdouble y)
+{
+	gdouble fx = floor(x), fy = floor(y);
+	gint64  ix = fx, iy = fy;
+	gdouble tx = x - fx, ty = y - fy;
+	tx = tx * tx * (3 - 2*tx);
+	ty = ty * ty * (3 - 2*ty);
+	gdouble v00 = _fractal_hash(seed, ix,   iy);
+	gdouble v10 = _fractal_hash(seed, ix+1, iy);
+	gdouble v01 = _fractal_hash(seed, ix,   iy+1);
+	gdouble v11 = _fractal_hash(seed, ix+1, iy+1);
+	return (v00 * (1-tx) + v10 * tx) * (1-ty) +
+	       (v01 * (1-tx) + v11 * tx) * ty;
+}
+
+/* Terrain height at a point, octaves finer than the tile resolution are
+ * skipped so tiles covering the same point at different levels agree
+ * except for the added detail */
+static gdouble _fractal_height(guint64 seed, gdouble lat, gdouble lon,
+		gint octaves)
+{
+	gdouble height = 0, amp = FRACTAL_HEIGHT, freq = 1 / FRACTAL_SCALE;
+	for (gint o = 0; o < octaves; o++) {
+		height += amp * _fractal_noise(seed + o, lon * freq, lat * freq);
+		amp  /= 2;
+		freq *= 2;
+	}
+	return height - FRACTAL_HEIGHT / 4;
+}
+
+static gchar *_grits_tile_source_fractal_fetch(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	struct _GritsTileSourceFractal *fractal =
+		(struct _GritsTileSourceFractal*)source;
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%sbil", tilep);
+	gchar *path  = grits_http_get_cache_path(source->http, local);
+	g_free(tilep);
+	if (mode != GRITS_REFRESH && g_file_test(path, G_FILE_TEST_EXISTS)) {
+		g_free(local);
+		return path;
+	}
+
+	/* Add octaves until the features are smaller than a pixel */
+	gint    width   = fractal->width, height = fractal->height;
+	gdouble pixel   = (tile->edge.n - tile->edge.s) / height;
+	gint    octaves = 1;
+	while (octaves < FRACTAL_OCTAVES &&
+	       FRACTAL_SCALE / (1 << octaves) > pixel)
+		octaves++;
+
+	gint16 *bil = g_new(gint16, width * height);
+	for (gint y = 0; y < height; y++) {
+		gdouble lat = tile->edge.n - (tile->edge.n - tile->edge.s) * y / height;
+		for (gint x = 0; x < width; x++) {
+			gdouble lon = tile->edge.w + (tile->edge.e - tile->edge.w) * x / width;
+			gdouble h   = _fractal_height(fractal->seed, lat, lon, octaves);
+			bil[y*width + x] = CLAMP(h, G_MININT16, G_MAXINT16);
+		}
+	}
+
+	gchar *dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0755);
+	gboolean ok = g_file_set_contents(path, (gchar*)bil,
+			width * height * sizeof(gint16), NULL);
+	if (ok)
+		grits_cache_manager_add(source->http->prefix, local, path);
+	else
+		g_warning("GritsTileSource: fractal_fetch - error saving %s", path);
+	g_free(dir);
+	g_free(bil);
+	g_free(local);
+	if (!ok) {
+		g_free(path);
+		return NULL;
+	}
+	return path;
+}
+
+static void _grits_tile_source_fractal_free(GritsTileSource *source)
+{
+	grits_http_free(source->http);
+}
+
+/**
+ * grits_tile_source_new_fractal:
+ * @prefix: prefix to use for local files
+ * @width:  width in pixels of the generated tiles
+ * @height: height in pixels of the generated tiles
+ * @seed:   seed for the terrain, the same seed always gives the same terrain
+ *
+ * Create a tile source which generates fractal terrain as 16 bit BIL
+ * elevation tiles. The tiles are saved in the download cache like any other
+ * tiles, so different seeds should use different prefixes.
+ *
+ * Returns: the new #GritsTileSource
+ */
+GritsTileSource *grits_tile_source_new_fractal(const gchar *prefix,
+		gint width, gint height, guint64 seed)
+{
+	g_debug("GritsTileSource: new_fractal - %" G_GUINT64_FORMAT, seed);
+	struct _GritsTileSourceFractal *source =
+		g_new0(struct _GritsTileSourceFractal, 1);
+	source->source.http  = grits_http_new(prefix);
+	source->source.fetch = _grits_tile_source_fractal_fetch;
+	source->source.free  = _grits_tile_source_fractal_free;
+	source->seed         = seed;
+	source->width        = width;
+	source->height       = height;
+	return &source->source;
+}
+
+/**********
+ * Common *
+ **********/
+/**
+ * grits_tile_source_fetch:
+ * @source:    the #GritsTileSource to fetch the image from
+ * @tile:      a #GritsTile representing the area to be fetched
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @user_data: user data to pass to the callback
+ *
+ * Fetch an image covering a #GritsTile. This blocks until the image is
+ * available and should be called from a worker thread.
+ *
+ * Returns: the path to the local file, or %NULL on error
+ */
+gchar *grits_tile_source_fetch(GritsTileSource *source, GritsTile *tile,
+		GritsCacheType mode, GritsChunkCallback callback,
+		gpointer user_data)
+{
+	return source->fetch(source, tile, mode, callback, user_data);
+}
+
+/**
+ * grits_tile_source_packed:
+ * @source: the #GritsTileSource to check
+ *
+ * Check whether images should be read with grits_tile_source_fetch_data(),
+ * which is the case when the source supports it and the packed cache is in
+ * use, see grits_http_use_pack().
+ *
+ * Returns: %TRUE if the images are stored in a pack
+ */
+gboolean grits_tile_source_packed(GritsTileSource *source)
+{
+	return source->fetch_data && source->http && source->http->pack;
+}
+
+/**
+ * grits_tile_source_fetch_data:
+ * @source:    the #GritsTileSource to fetch the image from
+ * @tile:      a #GritsTile representing the area to be fetched
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @user_data: user data to pass to the callback
+ * @length:    location to store the length of the image
+ *
+ * Fetch an image covering a #GritsTile into the packed cache, see
+ * grits_tile_source_packed(). The returned data points into the pack and
+ * must be released with grits_tile_source_release_data().
+ *
+ * Returns: the contents of the image file, or %NULL on error
+ */
+const guint8 *grits_tile_source_fetch_data(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data, gsize *length)
+{
+	g_return_val_if_fail(grits_tile_source_packed(source), NULL);
+	return source->fetch_data(source, tile, mode,
+			callback, user_data, length);
+}
+
+/**
+ * grits_tile_source_release_data:
+ * @source: the #GritsTileSource the image was fetched from
+ * @data:   data returned by grits_tile_source_fetch_data()
+ *
+ * Release an image returned by grits_tile_source_fetch_data().
+ */
+void grits_tile_source_release_data(GritsTileSource *source,
+		const guint8 *data)
+{
+	if (data)
+		source->release_data(source, data);
+}
+
+/**
+ * grits_tile_source_abort:
+ * @source: the #GritsTileSource to abort
+ *
+ * Cancel any pending downloads for @source.
+ */
+void grits_tile_source_abort(GritsTileSource *source)
+{
+	if (source->http)
+		grits_http_abort(source->http);
+}
+
+/**
+ * grits_tile_source_free:
+ * @source: the #GritsTileSource to free
+ *
+ * Free resources used by @source and cancel any pending requests.
+ */
+void grits_tile_source_free(GritsTileSource *source)
+{
+	g_debug("GritsTileSource: free");
+	source->free(source);
+	g_free(source);
+}
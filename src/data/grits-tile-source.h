@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_TILE_SOURCE_H__
+#define __GRITS_TILE_SOURCE_H__
+
+#include <glib.h>
+
+#include "data/grits-http.h"
+#include "data/grits-wms.h"
+#include "objects/grits-tile.h"
+
+typedef struct _GritsTileSource GritsTileSource;
+
+/**
+ * GritsTileSource:
+ * @http:         the #GritsHttp used to download images, %NULL for sources
+ *                which do not use the download cache
+ * @fetch:        fetch the image for a tile, see grits_tile_source_fetch()
+ * @fetch_data:   fetch the image into the packed cache, %NULL if the source
+ *                does not support it, see grits_tile_source_fetch_data()
+ * @release_data: release an image returned by @fetch_data
+ * @free:         free the source specific data
+ *
+ * A server which images for a #GritsTile can be fetched from.
+ */
+struct _GritsTileSource {
+	GritsHttp *http;
+	gchar *(*fetch)(GritsTileSource *source, GritsTile *tile,
+			GritsCacheType mode, GritsChunkCallback callback,
+			gpointer user_data);
+	const guint8 *(*fetch_data)(GritsTileSource *source, GritsTile *tile,
+			GritsCacheType mode, GritsChunkCallback callback,
+			gpointer user_data, gsize *length);
+	void   (*release_data)(GritsTileSource *source, const guint8 *data);
+	void   (*free)(GritsTileSource *source);
+};
+
+GritsTileSource *grits_tile_source_new_wms(GritsWms *wms);
+
+GritsTileSource *grits_tile_source_new_xyz(const gchar *uri,
+		const gchar *prefix, const gchar *extension,
+		gint width, gint height, guint max_zoom);
+
+GritsTileSource *grits_tile_source_new_local(const gchar *dir,
+		const gchar *extension);
+
+GritsTileSource *grits_tile_source_new_fractal(const gchar *prefix,
+		gint width, gint height, guint64 seed);
+
+gchar *grits_tile_source_fetch(GritsTileSource *source, GritsTile *tile,
+		GritsCacheType mode, GritsChunkCallback callback,
+		gpointer user_data);
+
+gboolean grits_tile_source_packed(GritsTileSource *source);
+
+const guint8 *grits_tile_source_fetch_data(GritsTileSource *source,
+		GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data, gsize *length);
+
+void grits_tile_source_release_data(GritsTileSource *source,
+		const guint8 *data);
+
+void grits_tile_source_abort(GritsTileSource *source);
+
+void grits_tile_source_free(GritsTileSource *source);
+
+#endif
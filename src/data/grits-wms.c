@@ -22,6 +22,11 @@
  * Provides an API for accessing image tiles form a Web Map Service (WMS)
  * server. #GritsWms integrates closely with #GritsTile. The remote server must
  * support the EPSG:4326 cartographic projection.
+ *
+ * When metatiles are enabled using grits_wms_set_metatile(), the children of a
+ * tile are fetched from the server as a single image and split locally into
+ * the files for each child. This saves round trips and server renders since
+ * sibling tiles are usually requested at the same time.
  */
 
 /*
@@ -71,11 +76,18 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
 #include <locale.h>
 
 #include "grits-wms.h"
 #include "grits-http.h"
+#include "grits-cache-manager.h"
+
+/* Largest image to request from the server */
+#define MAX_METATILE 4096
 
 static gchar *g_strdup_printf_safe(char *fmt, ...)
 {
@@ -88,7 +100,8 @@ static gchar *g_strdup_printf_safe(char *fmt, ...)
 	return str;
 }
 
-static gchar *_make_uri(GritsWms *wms, GritsTile *tile)
+static gchar *_make_uri(GritsWms *wms, GritsBounds *edge, const gchar *format,
+		gint width, gint height)
 {
 	return g_strdup_printf_safe(
 		"%s?"
@@ -104,13 +117,190 @@ static gchar *_make_uri(GritsWms *wms, GritsTile *tile)
 		"BBOX=%f,%f,%f,%f",
 		wms->uri_prefix,
 		wms->uri_layer,
-		wms->uri_format,
-		wms->width,
-		wms->height,
-		tile->edge.w,
-		tile->edge.s,
-		tile->edge.e,
-		tile->edge.n);
+		format,
+		width,
+		height,
+		edge->w,
+		edge->s,
+		edge->e,
+		edge->n);
+}
+
+static gchar *_make_local(GritsWms *wms, GritsTile *tile)
+{
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%s%s", tilep, wms->extension);
+	g_free(tilep);
+	return local;
+}
+
+/* The gdk-pixbuf format used to write split images, or NULL for raw data
+ * such as BIL files which are split by rows */
+static const gchar *_pixbuf_type(GritsWms *wms)
+{
+	if (g_str_equal(wms->extension, "png"))
+		return "png";
+	if (g_str_equal(wms->extension, "jpg") ||
+	    g_str_equal(wms->extension, "jpeg"))
+		return "jpeg";
+	return NULL;
+}
+
+/* Write the file for one child of a metatile */
+static void _grits_wms_split_save(GritsWms *wms, const gchar *dir,
+		GritsTile *parent, gint row, gint col,
+		GdkPixbuf *pixbuf, const gchar *raw, gsize raw_len)
+{
+	gchar *tilep = grits_tile_get_child_path(parent, row, col);
+	gchar *local = g_strdup_printf("%s%s", tilep, wms->extension);
+	gchar *path  = g_build_filename(dir, local, NULL);
+	gchar *part  = g_strconcat(path, ".part", NULL);
+	if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+		gboolean ok;
+		if (pixbuf) {
+			const gchar *type = _pixbuf_type(wms);
+			ok = g_str_equal(type, "jpeg")
+				? gdk_pixbuf_save(pixbuf, part, type, NULL,
+						"quality", "95", NULL)
+				: gdk_pixbuf_save(pixbuf, part, type, NULL, NULL);
+		} else {
+			ok = g_file_set_contents(part, raw, raw_len, NULL);
+		}
+		if (ok && g_rename(part, path) == 0)
+			grits_cache_manager_add(wms->http->prefix, local, path);
+		else
+			g_remove(part);
+	}
+	g_free(tilep);
+	g_free(local);
+	g_free(path);
+	g_free(part);
+}
+
+/* Cut a metatile into files for each child of parent, returns FALSE if the
+ * metatile could not be read */
+static gboolean _grits_wms_split(GritsWms *wms, GritsTile *parent,
+		const gchar *meta_path)
+{
+	const gchar *type = _pixbuf_type(wms);
+	gchar *dir = g_path_get_dirname(meta_path);
+	gint row, col;
+
+	if (type) {
+		/* Images, use whatever size the server sent */
+		GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(meta_path, NULL);
+		if (!pixbuf) {
+			g_free(dir);
+			return FALSE;
+		}
+		gint width  = gdk_pixbuf_get_width(pixbuf)  / parent->cols;
+		gint height = gdk_pixbuf_get_height(pixbuf) / parent->rows;
+		grits_tile_foreach_index(parent, row, col) {
+			GdkPixbuf *sub = gdk_pixbuf_new_subpixbuf(pixbuf,
+					col*width, row*height, width, height);
+			_grits_wms_split_save(wms, dir, parent, row, col,
+					sub, NULL, 0);
+			g_object_unref(sub);
+		}
+		g_object_unref(pixbuf);
+	} else {
+		/* Raw samples, the sample size is whatever fits */
+		gchar *raw = NULL;
+		gsize  len = 0;
+		g_file_get_contents(meta_path, &raw, &len, NULL);
+		gsize  meta_width = wms->width * parent->cols;
+		gsize  stride     = wms->width;
+		gsize  sample     = len / (meta_width * wms->height * parent->rows);
+		if (!raw || sample == 0) {
+			g_free(raw);
+			g_free(dir);
+			return FALSE;
+		}
+		gsize  tile_len = stride * wms->height * sample;
+		gchar *tile     = g_malloc(tile_len);
+		grits_tile_foreach_index(parent, row, col) {
+			for (gint y = 0; y < wms->height; y++)
+				memcpy(tile + y*stride*sample,
+				       raw  + ((row*wms->height + y)*meta_width +
+				               col*stride)*sample,
+				       stride*sample);
+			_grits_wms_split_save(wms, dir, parent, row, col,
+					NULL, tile, tile_len);
+		}
+		g_free(tile);
+		g_free(raw);
+	}
+	g_free(dir);
+	return TRUE;
+}
+
+/* Fetch a tile as part of a metatile covering its parent, returns NULL if the
+ * tile should be fetched on its own instead */
+static gchar *_grits_wms_fetch_meta(GritsWms *wms, GritsTile *tile,
+		GritsChunkCallback callback, gpointer user_data, gboolean *aborted)
+{
+	GritsTile *parent  = tile->parent;
+	gint       aborts  = g_atomic_int_get(&wms->http->aborts);
+	gchar     *parentp = grits_tile_get_path(parent);
+	gchar     *local   = _make_local(wms, tile);
+	gchar     *path    = grits_http_get_cache_path(wms->http, local);
+
+	/* Siblings wait for the first one to fetch and split the metatile */
+	g_mutex_lock(wms->lock);
+	while (g_hash_table_lookup(wms->metas, parentp))
+		g_cond_wait(wms->cond, wms->lock);
+	gboolean cached = grits_cache_manager_claim(wms->http->prefix, local, path);
+	*aborted = !cached && aborts != g_atomic_int_get(&wms->http->aborts);
+	if (!cached && !*aborted)
+		g_hash_table_insert(wms->metas, parentp, parentp);
+	g_mutex_unlock(wms->lock);
+	g_free(local);
+	if (cached || *aborted) {
+		g_free(parentp);
+		if (cached)
+			return path;
+		g_free(path);
+		return NULL;
+	}
+
+	/* Lossy images are fetched as PNG so they are only compressed once,
+	 * when they are split */
+	const gchar *type   = _pixbuf_type(wms);
+	gboolean     jpeg   = type && g_str_equal(type, "jpeg");
+	const gchar *format = jpeg ? "image/png" : wms->uri_format;
+	gchar *meta_local = g_strdup_printf("%smetatile.%s",
+			parentp, jpeg ? "png" : wms->extension);
+	gchar *meta_uri   = _make_uri(wms, &parent->edge, format,
+			wms->width  * parent->cols,
+			wms->height * parent->rows);
+	gchar *meta_path  = grits_http_fetch(wms->http, meta_uri, meta_local,
+			GRITS_ONCE, callback, user_data);
+	g_free(meta_uri);
+
+	/* The metatile is only kept until it has been split */
+	if (meta_path) {
+		g_debug("GritsWms: fetch_meta - splitting %s", meta_local);
+		if (!_grits_wms_split(wms, parent, meta_path))
+			g_warning("GritsWms: fetch_meta - "
+					"error reading %s", meta_path);
+		g_remove(meta_path);
+		grits_cache_manager_remove(wms->http->prefix, meta_local);
+	}
+	*aborted = !meta_path && aborts != g_atomic_int_get(&wms->http->aborts);
+	g_free(meta_local);
+	g_free(meta_path);
+
+	g_mutex_lock(wms->lock);
+	g_hash_table_remove(wms->metas, parentp);
+	g_cond_broadcast(wms->cond);
+	g_mutex_unlock(wms->lock);
+	g_free(parentp);
+
+	if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+		g_free(path);
+		return NULL;
+	}
+	return path;
 }
 
 /**
@@ -121,24 +311,100 @@ static gchar *_make_uri(GritsWms *wms, GritsTile *tile)
  * @callback:  callback to call when a chunk of data is received
  * @user_data: user data to pass to the callback
  *
- * Fetch a image coresponding to a #GritsTile from a WMS server. 
+ * Fetch a image coresponding to a #GritsTile from a WMS server. If metatiles
+ * are enabled and @mode is %GRITS_ONCE the image may be cut from an image of
+ * the tile's parent.
  *
  * Returns: the path to the local file.
  */
 gchar *grits_wms_fetch(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
 		GritsChunkCallback callback, gpointer user_data)
 {
-	gchar *uri   = _make_uri(wms, tile);
-	gchar *tilep = grits_tile_get_path(tile);
-	gchar *local = g_strdup_printf("%s%s", tilep, wms->extension);
+	if (wms->metatile && tile->parent && mode == GRITS_ONCE &&
+	    wms->width  * tile->parent->cols <= MAX_METATILE &&
+	    wms->height * tile->parent->rows <= MAX_METATILE) {
+		gboolean aborted = FALSE;
+		gchar *path = _grits_wms_fetch_meta(wms, tile,
+				callback, user_data, &aborted);
+		if (path || aborted)
+			return path;
+	}
+	gchar *uri   = _make_uri(wms, &tile->edge, wms->uri_format,
+			wms->width, wms->height);
+	gchar *local = _make_local(wms, tile);
 	gchar *path  = grits_http_fetch(wms->http, uri, local,
 			mode, callback, user_data);
 	g_free(uri);
-	g_free(tilep);
 	g_free(local);
 	return path;
 }
 
+/**
+ * grits_wms_fetch_data:
+ * @wms:       the #GritsWms to fetch the data from
+ * @tile:      a #GritsTile representing the area to be fetched
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @user_data: user data to pass to the callback
+ * @length:    location to store the length of the image
+ *
+ * Fetch an image from a WMS server into the packed cache, the packed cache
+ * must be enabled using grits_http_use_pack() on the @wms http connection.
+ * Images are fetched the same way as grits_wms_fetch() and then moved into
+ * the pack. The siblings cut from a metatile are moved when they are fetched.
+ *
+ * Returns: the contents of the image file, see grits_http_fetch_data(),
+ *          release it with grits_wms_release_data()
+ */
+const guint8 *grits_wms_fetch_data(GritsWms *wms, GritsTile *tile,
+		GritsCacheType mode, GritsChunkCallback callback,
+		gpointer user_data, gsize *length)
+{
+	gchar *local = _make_local(wms, tile);
+	const guint8 *data = NULL;
+	if (mode == GRITS_ONCE || mode == GRITS_LOCAL)
+		data = grits_http_get_data(wms->http, local, length);
+	if (!data) {
+		gchar *path = grits_wms_fetch(wms, tile, mode,
+				callback, user_data);
+		if (path)
+			data = grits_http_add_data(wms->http, local,
+					path, length);
+		g_free(path);
+	}
+	g_free(local);
+	return data;
+}
+
+/**
+ * grits_wms_release_data:
+ * @wms:  the #GritsWms the data was fetched from
+ * @data: data returned by grits_wms_fetch_data()
+ *
+ * Release an image returned by grits_wms_fetch_data().
+ */
+void grits_wms_release_data(GritsWms *wms, const guint8 *data)
+{
+	grits_http_release_data(wms->http, data);
+}
+
+/**
+ * grits_wms_set_metatile:
+ * @wms:     the #GritsWms to configure
+ * @enabled: %TRUE to fetch tiles as metatiles
+ *
+ * Fetch all children of a tile's parent as a single image instead of
+ * fetching each tile separately. For the default 2x2 tile layout each
+ * request covers a 2x2 block of tiles. Metatiles for JPEG layers are
+ * requested as PNG so tiles are only compressed once when they are split,
+ * raw formats such as BIL are split by rows.
+ */
+void grits_wms_set_metatile(GritsWms *wms, gboolean enabled)
+{
+	g_debug("GritsWms: set_metatile - %s %d", wms->uri_prefix, enabled);
+	wms->metatile = enabled;
+}
+
 /**
  * grits_wms_new:
  * @uri_prefix: the base URL for the WMS server
@@ -169,6 +435,9 @@ GritsWms *grits_wms_new(
 	wms->extension  = g_strdup(extension);
 	wms->width      = width;
 	wms->height     = height;
+	wms->lock       = g_mutex_new();
+	wms->cond       = g_cond_new();
+	wms->metas      = g_hash_table_new(g_str_hash, g_str_equal);
 	return wms;
 }
 
@@ -182,6 +451,9 @@ void grits_wms_free(GritsWms *wms)
 {
 	g_debug("GritsWms: free - %s", wms->uri_prefix);
 	grits_http_free(wms->http);
+	g_mutex_free(wms->lock);
+	g_cond_free(wms->cond);
+	g_hash_table_destroy(wms->metas);
 	g_free(wms->uri_prefix);
 	g_free(wms->uri_layer);
 	g_free(wms->uri_format);
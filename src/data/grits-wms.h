@@ -31,6 +31,10 @@ typedef struct _GritsWms {
 	gchar *extension;
 	gint   width;
 	gint   height;
+	gboolean metatile;
+	GMutex  *lock;
+	GCond   *cond;
+	GHashTable *metas; // parent tile paths with a metatile being fetched
 } GritsWms;
 
 GritsWms *grits_wms_new(
@@ -38,9 +42,17 @@ GritsWms *grits_wms_new(
 	const gchar *uri_format, const gchar *prefix,
 	const gchar *extension, gint width, gint height);
 
+void grits_wms_set_metatile(GritsWms *wms, gboolean enabled);
+
 gchar *grits_wms_fetch(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
 		GritsChunkCallback callback, gpointer user_data);
 
+const guint8 *grits_wms_fetch_data(GritsWms *wms, GritsTile *tile,
+		GritsCacheType mode, GritsChunkCallback callback,
+		gpointer user_data, gsize *length);
+
+void grits_wms_release_data(GritsWms *wms, const guint8 *data);
+
 void grits_wms_free(GritsWms *wms);
 
 #endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-worker
+ * @short_description: Coalescing background updates
+ *
+ * A #GritsWorker runs a function in a single long lived thread each time it
+ * is requested. Requests made while the function is running are combined
+ * into one more run once it finishes, so the work is never queued up and the
+ * last request is always handled. This suits updates which read the latest
+ * state when they run, such as loading tiles for the current camera
+ * position.
+ */
+
+#include <config.h>
+#include <glib.h>
+
+#include "grits-worker.h"
+
+static gpointer _grits_worker_run(gpointer _worker)
+{
+	GritsWorker *worker = _worker;
+	g_mutex_lock(worker->lock);
+	while (TRUE) {
+		while (!worker->pending && !worker->stop)
+			g_cond_wait(worker->cond, worker->lock);
+		if (worker->stop)
+			break;
+		worker->pending = FALSE;
+		g_mutex_unlock(worker->lock);
+		worker->func(worker->user_data);
+		g_mutex_lock(worker->lock);
+	}
+	g_mutex_unlock(worker->lock);
+	return NULL;
+}
+
+/**
+ * grits_worker_new:
+ * @func:      function to run for each request
+ * @user_data: user data to pass to @func
+ *
+ * Start a thread which runs @func whenever grits_worker_request() is called.
+ *
+ * Returns: the new #GritsWorker
+ */
+GritsWorker *grits_worker_new(GritsWorkerFunc func, gpointer user_data)
+{
+	GritsWorker *worker = g_new0(GritsWorker, 1);
+	worker->func      = func;
+	worker->user_data = user_data;
+	worker->lock      = g_mutex_new();
+	worker->cond      = g_cond_new();
+	worker->thread    = g_thread_create(_grits_worker_run, worker, TRUE, NULL);
+	return worker;
+}
+
+/**
+ * grits_worker_request:
+ * @worker: the #GritsWorker to run
+ *
+ * Ask the worker to run its function. If the function is already running it
+ * is run once more after it finishes, no matter how many times this is
+ * called in the meantime.
+ */
+void grits_worker_request(GritsWorker *worker)
+{
+	g_mutex_lock(worker->lock);
+	worker->pending = TRUE;
+	g_cond_signal(worker->cond);
+	g_mutex_unlock(worker->lock);
+}
+
+/**
+ * grits_worker_free:
+ * @worker: the #GritsWorker to free
+ *
+ * Stop the worker, waiting for the function to finish if it is running.
+ * Requests which have not started yet are dropped.
+ */
+void grits_worker_free(GritsWorker *worker)
+{
+	g_mutex_lock(worker->lock);
+	worker->stop = TRUE;
+	g_cond_signal(worker->cond);
+	g_mutex_unlock(worker->lock);
+	g_thread_join(worker->thread);
+	g_mutex_free(worker->lock);
+	g_cond_free(worker->cond);
+	g_free(worker);
+}
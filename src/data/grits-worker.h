@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_WORKER_H__
+#define __GRITS_WORKER_H__
+
+#include <glib.h>
+
+/**
+ * GritsWorkerFunc:
+ * @user_data: user data passed to grits_worker_new()
+ *
+ * Function run by a #GritsWorker in its thread.
+ */
+typedef void (*GritsWorkerFunc)(gpointer user_data);
+
+typedef struct _GritsWorker {
+	GritsWorkerFunc func;
+	gpointer        user_data;
+	GThread        *thread;
+	GMutex         *lock;
+	GCond          *cond;
+	gboolean        pending;
+	gboolean        stop;
+} GritsWorker;
+
+GritsWorker *grits_worker_new(GritsWorkerFunc func, gpointer user_data);
+
+void grits_worker_request(GritsWorker *worker);
+
+void grits_worker_free(GritsWorker *worker);
+
+#endif
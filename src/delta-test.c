@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark for the compressed elevation tile storage, run with a list of
+ * SRTM tiles or with no arguments to use the tiles in the cache. A synthetic
+ * tile is always checked first so the encoder is tested without any data */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "data/grits-delta.h"
+
+#define TILE_WIDTH  1024
+#define TILE_HEIGHT 512
+#define TILE_SIZE   (TILE_WIDTH*TILE_HEIGHT*sizeof(gint16))
+#define REPEAT      10
+
+/* Synthetic tile with a width which is not a multiple of the block size,
+ * covering flat areas, small and large differences, and differences which
+ * need the full 16 bits and wrap around */
+static gboolean check_synthetic(void)
+{
+	const gint width = 1000, height = 37;
+	gint16 *data = g_new(gint16, width * height);
+	gint16 *out  = g_new(gint16, width * height);
+	GRand  *rand = g_rand_new_with_seed(1);
+	for (gint y = 0; y < height; y++)
+	for (gint x = 0; x < width; x++) {
+		gint16 *px = &data[y*width + x];
+		if (x < 100)
+			*px = 42;
+		else if (x < 300)
+			*px = 1000 + g_rand_int_range(rand, -8, 8);
+		else if (x < 500)
+			*px = g_rand_int_range(rand, -200, 200);
+		else if (x < 700)
+			*px = y % 2 ? G_MAXINT16 : G_MININT16;
+		else
+			*px = g_rand_int_range(rand, G_MININT16, G_MAXINT16+1);
+	}
+
+	gboolean ok = TRUE;
+	gsize    len;
+	guint8  *buf = grits_delta_encode(data, width, height, &len);
+	if (!grits_delta_decode(buf, len, out, width, height) ||
+	    memcmp(data, out, width * height * sizeof(gint16))) {
+		g_printerr("synthetic: decoded tile does not match\n");
+		ok = FALSE;
+	}
+
+	/* Truncated, corrupt and mismatched data must be rejected */
+	gsize cuts[] = {0, 4, 8, 9, len/2, len-1};
+	for (gint i = 0; i < G_N_ELEMENTS(cuts); i++) {
+		if (grits_delta_decode(buf, cuts[i], out, width, height)) {
+			g_printerr("synthetic: accepted %d of %d bytes\n",
+					(gint)cuts[i], (gint)len);
+			ok = FALSE;
+		}
+	}
+	guint8 *bad = g_memdup(buf, len);
+	bad[8] = 0xff;
+	if (grits_delta_decode(bad, len, out, width, height)) {
+		g_printerr("synthetic: accepted a corrupt block type\n");
+		ok = FALSE;
+	}
+	memcpy(bad, "XXXX", 4);
+	if (grits_delta_decode(bad, len, out, width, height)) {
+		g_printerr("synthetic: accepted a corrupt header\n");
+		ok = FALSE;
+	}
+	if (grits_delta_decode(buf, len, out, width-1, height) ||
+	    grits_delta_decode(buf, len, out, width, height+1)) {
+		g_printerr("synthetic: accepted the wrong size\n");
+		ok = FALSE;
+	}
+	g_print("synthetic: %s, %.2fx\n", ok ? "ok" : "FAILED",
+			(gdouble)(width * height * sizeof(gint16)) / len);
+
+	g_free(bad);
+	g_free(buf);
+	g_rand_free(rand);
+	g_free(out);
+	g_free(data);
+	return ok;
+}
+
+static void find_tiles(const gchar *dir, GList **tiles)
+{
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	if (!gdir)
+		return;
+	const gchar *name;
+	while ((name = g_dir_read_name(gdir))) {
+		gchar *path = g_build_filename(dir, name, NULL);
+		if (g_file_test(path, G_FILE_TEST_IS_DIR))
+			find_tiles(path, tiles);
+		if (g_str_has_suffix(name, ".bil"))
+			*tiles = g_list_prepend(*tiles, path);
+		else
+			g_free(path);
+	}
+	g_dir_close(gdir);
+}
+
+int main(int argc, char **argv)
+{
+	int status = check_synthetic() ? 0 : 1;
+
+	GList *tiles = NULL;
+	for (int i = 1; i < argc; i++)
+		tiles = g_list_prepend(tiles, g_strdup(argv[i]));
+	if (!tiles) {
+		gchar *dir = g_build_filename(g_get_user_cache_dir(),
+				PACKAGE, "srtm", NULL);
+		find_tiles(dir, &tiles);
+		g_free(dir);
+	}
+
+	gint16  *out    = g_malloc(TILE_SIZE);
+	GTimer  *timer  = g_timer_new();
+	gint     count  = 0;
+	guint64  raw    = 0, packed = 0;
+	gdouble  encode = 0, decode = 0;
+
+	for (GList *cur = tiles; cur; cur = cur->next) {
+		gchar *data;
+		gsize  len, plen;
+		if (!g_file_get_contents(cur->data, &data, &len, NULL) ||
+		    len != TILE_SIZE) {
+			g_printerr("%s: not an elevation tile\n", (gchar*)cur->data);
+			continue;
+		}
+
+		guint8 *buf = NULL;
+		g_timer_start(timer);
+		for (int i = 0; i < REPEAT; i++) {
+			g_free(buf);
+			buf = grits_delta_encode((gint16*)data,
+					TILE_WIDTH, TILE_HEIGHT, &plen);
+		}
+		encode += g_timer_elapsed(timer, NULL) / REPEAT;
+
+		gboolean ok = TRUE;
+		g_timer_start(timer);
+		for (int i = 0; i < REPEAT; i++)
+			ok &= grits_delta_decode(buf, plen, out,
+					TILE_WIDTH, TILE_HEIGHT);
+		decode += g_timer_elapsed(timer, NULL) / REPEAT;
+
+		if (!ok || memcmp(data, out, TILE_SIZE)) {
+			g_printerr("%s: decoded tile does not match\n",
+					(gchar*)cur->data);
+			status = 1;
+		}
+		g_print("%s: %.2fx\n", (gchar*)cur->data, (gdouble)len/plen);
+
+		raw    += len;
+		packed += plen;
+		count++;
+		g_free(buf);
+		g_free(data);
+	}
+
+	if (count > 0)
+		g_print("%d tiles, %.1f MiB -> %.1f MiB (%.2fx), "
+				"encode %.0f MiB/s, decode %.0f MiB/s\n",
+				count, raw/1048576.0, packed/1048576.0,
+				(gdouble)raw/packed,
+				raw/1048576.0/encode, raw/1048576.0/decode);
+	else
+		g_print("no tiles found, skipping the benchmark\n");
+
+	g_timer_destroy(timer);
+	g_free(out);
+	g_list_foreach(tiles, (GFunc)g_free, NULL);
+	g_list_free(tiles);
+	return status;
+}
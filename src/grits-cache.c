@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Maintenance tool for the grits download cache */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "grits.h"
+
+/* Size of the images fetched by the plugins */
+#define SEED_WIDTH  1024
+#define SEED_HEIGHT 512
+
+static gboolean opt_remove    = FALSE;
+static gchar   *opt_bounds    = NULL;
+static gint     opt_min_level = 0;
+static gint     opt_max_level = 4;
+static gint     opt_jobs      = 4;
+static gint     opt_rate      = 0;
+static gchar   *opt_server    = NULL;
+static gboolean opt_no_meta   = FALSE;
+static gboolean opt_dry_run   = FALSE;
+
+static GOptionEntry entries[] =
+{
+	{"remove", 'r', 0, G_OPTION_ARG_NONE, &opt_remove,
+		"Delete files after importing them (sat and elev only)", NULL},
+	{"bounds", 'b', 0, G_OPTION_ARG_STRING, &opt_bounds,
+		"Area to seed (default: the whole world)", "N,S,E,W"},
+	{"min-level", 'm', 0, G_OPTION_ARG_INT, &opt_min_level,
+		"Shallowest tile level to seed (default: 0)", "LEVEL"},
+	{"max-level", 'M', 0, G_OPTION_ARG_INT, &opt_max_level,
+		"Deepest tile level to seed (default: 4)", "LEVEL"},
+	{"jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+		"Number of concurrent downloads (default: 4)", "N"},
+	{"rate", 'R', 0, G_OPTION_ARG_INT, &opt_rate,
+		"Limit the average download rate (default: unlimited)", "KiB/s"},
+	{"server", 's', 0, G_OPTION_ARG_STRING, &opt_server,
+		"Fetch from this WMS server instead of the layer's", "URI"},
+	{"no-metatile", 0, 0, G_OPTION_ARG_NONE, &opt_no_meta,
+		"Fetch each tile separately, for servers limiting image sizes", NULL},
+	{"dry-run", 'n', 0, G_OPTION_ARG_NONE, &opt_dry_run,
+		"List the files which would be seeded", NULL},
+	{NULL}
+};
+
+/* The WMS layers used by the sat, map and elev plugins, the layouts must
+ * match the plugins so the seeded paths are the ones they load. Packed layers
+ * are read from the pack by their plugin once one has been imported */
+static const struct {
+	const gchar    *name;
+	const gchar    *uri;
+	const gchar    *layer;
+	const gchar    *format;
+	const gchar    *prefix;
+	const gchar    *extension;
+	GritsTileLayout layout;
+	gboolean        metatile;
+	gboolean        packed;
+} layers[] = {
+	{"sat",  "http://www.nasa.network.com/wms", "bmng200406",
+		"image/jpeg", "bmng/", "jpg", {2, 2, 2, 2, FALSE}, TRUE, TRUE},
+	{"map",  "http://vmap0.tiles.osgeo.org/wms/vmap0",
+		"basic,priroad,secroad,depthcontour,clabel,statelabel",
+		"image/png", "osm/", "png", {2, 2, 2, 2, FALSE}, TRUE, FALSE},
+	{"elev", "http://www.nasa.network.com/elev", "mergedSrtm",
+		"application/bil", "srtm/", "bil", {2, 2, 2, 2, FALSE}, TRUE, TRUE},
+};
+
+/* Progress of a seeding run */
+struct _Seed {
+	const gchar *name;
+	GritsWms    *wms;
+	GMainLoop   *loop;
+	GMutex      *lock;
+	GTimeVal     start;
+	gint         total;
+	gint         done;
+	gint         cached;
+	gint         failed;
+	guint64      bytes;
+	GHashTable  *received; // path -> bytes of it counted so far
+};
+
+static gchar *cache_dir(const gchar *prefix)
+{
+	return g_build_filename(g_get_user_cache_dir(), PACKAGE, prefix, NULL);
+}
+
+/* Whether the plugin using a cache prefix reads it from the pack */
+static gboolean is_packed(const gchar *prefix)
+{
+	gchar *name = g_str_has_suffix(prefix, "/") ?
+		g_strdup(prefix) : g_strconcat(prefix, "/", NULL);
+	gboolean packed = FALSE;
+	for (gint i = 0; i < G_N_ELEMENTS(layers); i++)
+		if (g_str_equal(layers[i].prefix, name))
+			packed = layers[i].packed;
+	g_free(name);
+	return packed;
+}
+
+/* The quota index is kept, the plugin marks the entries as packed when it
+ * opens the pack so their access times are not lost */
+static int do_import(const gchar *prefix)
+{
+	if (opt_remove && !is_packed(prefix)) {
+		g_printerr("%s: not read from a pack, import without --remove\n",
+				prefix);
+		return 1;
+	}
+	gchar     *dir  = cache_dir(prefix);
+	GritsPack *pack = grits_pack_open(dir);
+	g_free(dir);
+	if (!pack)
+		return 1;
+	gint count = grits_pack_import(pack, opt_remove);
+	g_print("%s: imported %d files\n", prefix, count);
+	grits_pack_close(pack);
+	return 0;
+}
+
+static int do_compact(const gchar *prefix)
+{
+	gchar     *dir  = cache_dir(prefix);
+	GritsPack *pack = grits_pack_open(dir);
+	g_free(dir);
+	if (!pack)
+		return 1;
+	gboolean ok = grits_pack_compact(pack);
+	g_print("%s: %s, %d files\n", prefix, ok ? "compacted" : "failed",
+			g_hash_table_size(pack->entries));
+	grits_pack_close(pack);
+	return ok ? 0 : 1;
+}
+
+/* Seconds since the seeding run started */
+static gdouble seed_elapsed(struct _Seed *seed)
+{
+	GTimeVal now;
+	g_get_current_time(&now);
+	return (now.tv_sec  - seed->start.tv_sec) +
+	       (now.tv_usec - seed->start.tv_usec) / 1000000.0;
+}
+
+/* Add the tiles which grits_tile_update() would create inside the bounds,
+ * the tiles are split the same way so their paths match */
+static void seed_enumerate(GritsTile *tile, GritsBounds *bounds, GList **tiles)
+{
+	/* Placeholder roots are never loaded */
+	gboolean placeholder = tile->level == 0 &&
+		grits_tile_get_layout(tile)->placeholder;
+	if (tile->level >= opt_min_level && !placeholder)
+		*tiles = g_list_prepend(*tiles, tile);
+	if (tile->level >= opt_max_level)
+		return;
+	const gdouble lat_step = (tile->edge.n - tile->edge.s) / tile->rows;
+	const gdouble lon_step = (tile->edge.e - tile->edge.w) / tile->cols;
+	int row, col;
+	grits_tile_foreach_index(tile, row, col) {
+		GritsBounds edge;
+		edge.n = tile->edge.n-(lat_step*(row+0));
+		edge.s = tile->edge.n-(lat_step*(row+1));
+		edge.e = tile->edge.w+(lon_step*(col+1));
+		edge.w = tile->edge.w+(lon_step*(col+0));
+		if (edge.s >= bounds->n || edge.n <= bounds->s ||
+		    edge.w >= bounds->e || edge.e <= bounds->w)
+			continue;
+		GritsTile *child = grits_tile_new(tile,
+				edge.n, edge.s, edge.e, edge.w);
+		grits_tile_child(tile, row, col) = child;
+		seed_enumerate(child, bounds, tiles);
+	}
+}
+
+/* Quit from the main loop, the last tile may finish before it is running
+ * and a direct g_main_loop_quit() would be lost */
+static gboolean seed_quit(gpointer loop)
+{
+	g_main_loop_quit(loop);
+	return FALSE;
+}
+
+/* Count the bytes received as they arrive so the rate limit also covers
+ * metatiles and downloads in progress. Runs in the main thread, the seed is
+ * used as user data since updates can arrive after the fetch has returned.
+ * Resumed downloads count the part which was already on disk */
+static void seed_chunk(gchar *path, goffset cur, goffset total, gpointer _seed)
+{
+	struct _Seed *seed = _seed;
+	g_mutex_lock(seed->lock);
+	goffset *last = g_hash_table_lookup(seed->received, path);
+	if (!last) {
+		last = g_new0(goffset, 1);
+		g_hash_table_insert(seed->received, g_strdup(path), last);
+	}
+	if (cur > *last)
+		seed->bytes += cur - *last;
+	*last = cur;
+	if (total > 0 && cur >= total)
+		g_hash_table_remove(seed->received, path);
+	g_mutex_unlock(seed->lock);
+}
+
+/* Runs in the worker threads */
+static void seed_fetch(gpointer _tile, gpointer _seed)
+{
+	GritsTile    *tile = _tile;
+	struct _Seed *seed = _seed;
+
+	/* Hold off until the average rate is below the limit */
+	while (opt_rate > 0) {
+		g_mutex_lock(seed->lock);
+		gboolean over = seed->bytes > opt_rate * 1024.0 * seed_elapsed(seed);
+		g_mutex_unlock(seed->lock);
+		if (!over)
+			break;
+		g_usleep(G_USEC_PER_SEC / 10);
+	}
+
+	/* Partial downloads are resumed by GritsHttp, elevation tiles may have
+	 * been replaced by a compressed copy. Tiles are added to the pack when
+	 * the plugin reads from one */
+	GritsPack *pack  = seed->wms->http->pack;
+	gchar     *tilep = grits_tile_get_path(tile);
+	gchar     *local = g_strdup_printf("%s%s", tilep, seed->wms->extension);
+	gchar     *path  = grits_http_get_cache_path(seed->wms->http, local);
+	gchar     *delta = g_strconcat(local, ".delta", NULL);
+	gchar     *delta_path = g_strconcat(path, ".delta", NULL);
+	gboolean cached = g_file_test(path,       G_FILE_TEST_EXISTS) ||
+	                  g_file_test(delta_path, G_FILE_TEST_EXISTS) ||
+	                  (pack && (grits_pack_contains(pack, local) ||
+	                            grits_pack_contains(pack, delta)));
+	gboolean fetched = FALSE;
+	if (!cached && pack) {
+		gsize len;
+		const guint8 *data = grits_wms_fetch_data(seed->wms, tile,
+				GRITS_ONCE, seed_chunk, seed, &len);
+		grits_wms_release_data(seed->wms, data);
+		fetched = data != NULL;
+	} else if (!cached) {
+		gchar *file = grits_wms_fetch(seed->wms, tile,
+				GRITS_ONCE, seed_chunk, seed);
+		fetched = file != NULL;
+		g_free(file);
+	}
+
+	g_mutex_lock(seed->lock);
+	if (cached)
+		seed->cached++;
+	else if (!fetched)
+		seed->failed++;
+	if (++seed->done == seed->total)
+		g_idle_add(seed_quit, seed->loop);
+	g_mutex_unlock(seed->lock);
+
+	g_free(tilep);
+	g_free(local);
+	g_free(path);
+	g_free(delta);
+	g_free(delta_path);
+}
+
+static gboolean seed_progress(gpointer _seed)
+{
+	struct _Seed *seed = _seed;
+	g_mutex_lock(seed->lock);
+	gdouble elapsed = seed_elapsed(seed);
+	g_print("\r%s: %d/%d tiles, %d cached, %d failed, %.1f MiB, %.1f KiB/s",
+			seed->name, seed->done, seed->total,
+			seed->cached, seed->failed,
+			seed->bytes / 1048576.0,
+			elapsed > 0 ? seed->bytes / 1024.0 / elapsed : 0);
+	g_mutex_unlock(seed->lock);
+	return TRUE;
+}
+
+static int do_seed(const gchar *name)
+{
+	gint layer = -1;
+	for (gint i = 0; i < G_N_ELEMENTS(layers); i++)
+		if (g_str_equal(layers[i].name, name))
+			layer = i;
+	if (layer < 0) {
+		g_printerr("unknown layer: %s\n", name);
+		return 1;
+	}
+
+	GritsBounds bounds = {90, -90, 180, -180};
+	if (opt_bounds && sscanf(opt_bounds, "%lf,%lf,%lf,%lf",
+			&bounds.n, &bounds.s, &bounds.e, &bounds.w) != 4) {
+		g_printerr("invalid bounds: %s\n", opt_bounds);
+		return 1;
+	}
+
+	struct _Seed seed = {};
+	seed.name = name;
+	seed.wms  = grits_wms_new(opt_server ?: layers[layer].uri,
+			layers[layer].layer, layers[layer].format,
+			layers[layer].prefix, layers[layer].extension,
+			SEED_WIDTH, SEED_HEIGHT);
+	grits_wms_set_metatile(seed.wms, layers[layer].metatile && !opt_no_meta);
+	if (layers[layer].packed)
+		grits_http_find_pack(seed.wms->http);
+
+	/* Tiles are fetched in the order the viewer would load them */
+	GritsTile *root  = grits_tile_new_with_layout(&layers[layer].layout,
+			90, -90, 180, -180);
+	GList     *tiles = NULL;
+	seed_enumerate(root, &bounds, &tiles);
+	tiles = g_list_reverse(tiles);
+	seed.total = g_list_length(tiles);
+
+	if (opt_dry_run) {
+		for (GList *cur = tiles; cur; cur = cur->next) {
+			gchar *tilep = grits_tile_get_path(cur->data);
+			g_print("%s%s%s\n", layers[layer].prefix,
+					tilep, layers[layer].extension);
+			g_free(tilep);
+		}
+	} else if (seed.total > 0) {
+		seed.loop = g_main_loop_new(NULL, FALSE);
+		seed.lock = g_mutex_new();
+		seed.received = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, g_free);
+		g_get_current_time(&seed.start);
+		GThreadPool *pool = g_thread_pool_new(seed_fetch, &seed,
+				MAX(opt_jobs, 1), FALSE, NULL);
+		for (GList *cur = tiles; cur; cur = cur->next)
+			g_thread_pool_push(pool, cur->data, NULL);
+		guint timer = g_timeout_add_seconds(1, seed_progress, &seed);
+		g_main_loop_run(seed.loop);
+		g_source_remove(timer);
+		g_thread_pool_free(pool, FALSE, TRUE);
+		seed_progress(&seed);
+		g_print("\n");
+		g_main_loop_unref(seed.loop);
+		g_mutex_free(seed.lock);
+		g_hash_table_destroy(seed.received);
+	}
+
+	g_list_free(tiles);
+	grits_tile_free(root, NULL, NULL);
+	grits_wms_free(seed.wms);
+	return seed.failed > 0;
+}
+
+int main(int argc, char **argv)
+{
+	g_thread_init(NULL);
+	g_type_init();
+
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new("COMMAND PREFIX...");
+	g_option_context_set_summary(context,
+		"Commands:\n"
+		"  import   Move cached files into a packed cache\n"
+		"  compact  Remove replaced files from a packed cache\n"
+		"  seed     Download tiles for offline use, PREFIX is a layer:\n"
+		"           sat, map or elev");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+	if (argc < 3) {
+		g_printerr("usage: %s [OPTION...] <import|compact|seed> <prefix>...\n",
+				argv[0]);
+		return 1;
+	}
+
+	int status = 0;
+	for (int i = 2; i < argc; i++) {
+		if (g_str_equal(argv[1], "import"))
+			status |= do_import(argv[i]);
+		else if (g_str_equal(argv[1], "compact"))
+			status |= do_compact(argv[i]);
+		else if (g_str_equal(argv[1], "seed"))
+			status |= do_seed(argv[i]);
+		else {
+			g_printerr("unknown command: %s\n", argv[1]);
+			return 1;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-texture-pool
+ * @short_description: Shared storage for tile textures
+ *
+ * #GritsTexturePool packs fixed size tile images into a few large atlas
+ * textures. Slots are recycled when tiles are freed, so loading a tile
+ * reuses existing texture storage instead of creating a new texture object,
+ * and tiles sharing an atlas can be drawn without rebinding.
+ *
+ * All functions must be called from the main thread with the OpenGL context
+ * current, typically from an idle callback.
+ */
+
+#include <config.h>
+#include <glib.h>
+
+#include "gtkgl.h"
+#include "grits-texture-pool.h"
+
+/* Upper limit for the atlas size, even if the driver allows more */
+#define MAX_ATLAS_SIZE 4096
+
+/* A single texture divided into slots */
+struct _GritsTextureAtlas {
+	guint             tex;
+	gint              width;
+	gint              height;
+	gint              count;
+	gint              used;
+	GritsTextureSlot *slots;
+	GSList           *unused;
+};
+
+/* Allocate a new atlas texture. The first atlas has a single slot and each
+ * one after it has twice as many, up to the largest texture allowed, so
+ * pools holding a few tiles do not allocate a full size atlas */
+static GritsTextureAtlas *_grits_texture_pool_grow(GritsTexturePool *pool)
+{
+	if (!pool->cols || !pool->rows) {
+		GLint max = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max);
+		max = CLAMP(max, 1, MAX_ATLAS_SIZE);
+		pool->cols = MAX(1, max / pool->width);
+		pool->rows = MAX(1, max / pool->height);
+		pool->next = 1;
+	}
+	gint cols = MIN(pool->cols, pool->next);
+	gint rows = MIN(pool->rows, (pool->next + cols - 1) / cols);
+	pool->next = MIN(pool->next * 2, pool->cols * pool->rows);
+	g_debug("GritsTexturePool: grow - %dx%d slots of %dx%d",
+			cols, rows, pool->width, pool->height);
+
+	GritsTextureAtlas *atlas = g_new0(GritsTextureAtlas, 1);
+	atlas->width  = cols * pool->width;
+	atlas->height = rows * pool->height;
+	atlas->count  = cols * rows;
+	atlas->slots  = g_new0(GritsTextureSlot, atlas->count);
+	glGenTextures(1, &atlas->tex);
+	glBindTexture(GL_TEXTURE_2D, atlas->tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, 4, atlas->width, atlas->height, 0,
+			GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+
+	for (int i = atlas->count-1; i >= 0; i--) {
+		GritsTextureSlot *slot = &atlas->slots[i];
+		slot->tex   = atlas->tex;
+		slot->x     = i % cols * pool->width;
+		slot->y     = i / cols * pool->height;
+		slot->pool  = pool;
+		slot->atlas = atlas;
+		atlas->unused = g_slist_prepend(atlas->unused, slot);
+	}
+	pool->atlases = g_list_prepend(pool->atlases, atlas);
+	return atlas;
+}
+
+static void _grits_texture_atlas_free(GritsTextureAtlas *atlas)
+{
+	glDeleteTextures(1, &atlas->tex);
+	g_slist_free(atlas->unused);
+	g_free(atlas->slots);
+	g_free(atlas);
+}
+
+static void _grits_texture_pool_destroy(GritsTexturePool *pool)
+{
+	g_debug("GritsTexturePool: destroy - %d textures",
+			g_list_length(pool->atlases));
+	g_list_foreach(pool->atlases, (GFunc)_grits_texture_atlas_free, NULL);
+	g_list_free(pool->atlases);
+	g_free(pool);
+}
+
+/**
+ * grits_texture_pool_new:
+ * @width:  width in pixels of each slot
+ * @height: height in pixels of each slot
+ *
+ * Create a pool of texture slots. No OpenGL resources are allocated until
+ * the first image is uploaded.
+ *
+ * Returns: the new #GritsTexturePool
+ */
+GritsTexturePool *grits_texture_pool_new(gint width, gint height)
+{
+	g_debug("GritsTexturePool: new - %dx%d", width, height);
+	GritsTexturePool *pool = g_new0(GritsTexturePool, 1);
+	pool->width    = width;
+	pool->height   = height;
+	return pool;
+}
+
+/**
+ * grits_texture_pool_upload:
+ * @pool:   the #GritsTexturePool to allocate from
+ * @pixels: RGB or RGBA image data with no row padding
+ * @alpha:  %TRUE if @pixels contains an alpha channel
+ * @width:  width of the image, no larger than the slot width
+ * @height: height of the image, no larger than the slot height
+ *
+ * Copy an image into an unused slot, a new atlas is allocated if all the
+ * slots are in use. Each new atlas has twice as many slots as the last. The
+ * coords of the slot are set to the area covered by the image, inset by half
+ * a texel so that neighbouring slots do not bleed into each other when
+ * filtering.
+ *
+ * Returns: the slot, or %NULL if the image does not fit in a slot
+ */
+GritsTextureSlot *grits_texture_pool_upload(GritsTexturePool *pool,
+		const guint8 *pixels, gboolean alpha, gint width, gint height)
+{
+	if (width > pool->width || height > pool->height) {
+		g_warning("GritsTexturePool: upload - %dx%d image does not fit in %dx%d slot",
+				width, height, pool->width, pool->height);
+		return NULL;
+	}
+	GritsTextureAtlas *atlas = NULL;
+	for (GList *cur = pool->atlases; cur && !atlas; cur = cur->next)
+		if (((GritsTextureAtlas*)cur->data)->unused)
+			atlas = cur->data;
+	if (!atlas)
+		atlas = _grits_texture_pool_grow(pool);
+
+	GritsTextureSlot *slot = atlas->unused->data;
+	atlas->unused = g_slist_delete_link(atlas->unused, atlas->unused);
+	atlas->used++;
+	pool->used++;
+
+	glBindTexture(GL_TEXTURE_2D, slot->tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, slot->x, slot->y, width, height,
+			(alpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, pixels);
+
+	gdouble tw = atlas->width;
+	gdouble th = atlas->height;
+	slot->coords.n = (slot->y + 0.5)          / th;
+	slot->coords.s = (slot->y + height - 0.5) / th;
+	slot->coords.e = (slot->x + width  - 0.5) / tw;
+	slot->coords.w = (slot->x + 0.5)          / tw;
+	return slot;
+}
+
+/**
+ * grits_texture_pool_set_tile:
+ * @slot: the slot holding the image for @tile
+ * @tile: the tile to draw using @slot
+ *
+ * Set the tiles data and texture coordinates so that it is drawn using the
+ * area of the atlas covered by @slot.
+ */
+void grits_texture_pool_set_tile(GritsTextureSlot *slot, GritsTile *tile)
+{
+	tile->coords = slot->coords;
+	tile->proxy  = NULL;
+	tile->data   = slot;
+}
+
+/**
+ * grits_texture_pool_release:
+ * @slot: the slot to return to it's pool
+ *
+ * Mark a slot as unused so it can be reused by the next upload. Atlases
+ * which become empty are freed while other atlases have room.
+ */
+void grits_texture_pool_release(GritsTextureSlot *slot)
+{
+	GritsTexturePool  *pool  = slot->pool;
+	GritsTextureAtlas *atlas = slot->atlas;
+	atlas->unused = g_slist_prepend(atlas->unused, slot);
+	atlas->used--;
+	pool->used--;
+	if (pool->closed && pool->used == 0) {
+		_grits_texture_pool_destroy(pool);
+		return;
+	}
+
+	/* Free empty atlases, unless it is the only one with unused slots */
+	if (atlas->used > 0)
+		return;
+	for (GList *cur = pool->atlases; cur; cur = cur->next) {
+		GritsTextureAtlas *other = cur->data;
+		if (other != atlas && other->unused) {
+			g_debug("GritsTexturePool: release - freeing empty atlas");
+			pool->atlases = g_list_remove(pool->atlases, atlas);
+			_grits_texture_atlas_free(atlas);
+			return;
+		}
+	}
+}
+
+/**
+ * grits_texture_pool_free:
+ * @pool: the #GritsTexturePool to free
+ *
+ * Free the pool and it's textures. If some slots are still in use this is
+ * delayed until they have all been released.
+ */
+void grits_texture_pool_free(GritsTexturePool *pool)
+{
+	g_debug("GritsTexturePool: free - %d slots in use", pool->used);
+	pool->closed = TRUE;
+	if (pool->used == 0)
+		_grits_texture_pool_destroy(pool);
+}
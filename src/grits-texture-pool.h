@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_TEXTURE_POOL_H__
+#define __GRITS_TEXTURE_POOL_H__
+
+#include <glib.h>
+
+#include "objects/grits-tile.h"
+
+typedef struct _GritsTexturePool  GritsTexturePool;
+typedef struct _GritsTextureAtlas GritsTextureAtlas;
+
+typedef struct _GritsTextureSlot {
+	/* OpenGL has to be first so tiles can be drawn as *(guint*)data */
+	guint              tex;
+	GritsBounds        coords;
+	gint               x, y;
+	GritsTexturePool  *pool;
+	GritsTextureAtlas *atlas;
+} GritsTextureSlot;
+
+struct _GritsTexturePool {
+	gint       width;
+	gint       height;
+	gint       cols;  // largest number of slots across an atlas
+	gint       rows;
+	gint       next;  // number of slots in the next atlas
+	GList     *atlases;
+	gint       used;
+	gboolean   closed;
+};
+
+GritsTexturePool *grits_texture_pool_new(gint width, gint height);
+
+GritsTextureSlot *grits_texture_pool_upload(GritsTexturePool *pool,
+		const guint8 *pixels, gboolean alpha, gint width, gint height);
+
+void grits_texture_pool_set_tile(GritsTextureSlot *slot, GritsTile *tile);
+
+void grits_texture_pool_release(GritsTextureSlot *slot);
+
+void grits_texture_pool_free(GritsTexturePool *pool);
+
+#endif
@@ -27,6 +27,7 @@
 
 #include <config.h>
 #include <math.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
 
@@ -34,9 +35,13 @@
 #include "grits-viewer.h"
 
 #include "grits-util.h"
+#include "data/grits-cache-manager.h"
 
 
 /* Constants */
+#define HISTORY_WINDOW 0.5  // Seconds of history used to measure motion
+#define HISTORY_STALE  0.25 // Camera is stopped if unchanged for this long
+
 enum {
 	SIG_TIME_CHANGED,
 	SIG_LOCATION_CHANGED,
@@ -61,9 +66,29 @@ static void _grits_viewer_fix_location(GritsViewer *viewer)
 	viewer->location[2] = ABS(viewer->location[2]);
 }
 
+static gdouble _grits_viewer_now(void)
+{
+	GTimeVal tv;
+	g_get_current_time(&tv);
+	return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static void _grits_viewer_add_history(GritsViewer *viewer)
+{
+	g_mutex_lock(viewer->history_lock);
+	gdouble *entry = viewer->history[viewer->history_pos];
+	entry[0] = _grits_viewer_now();
+	entry[1] = viewer->location[0];
+	entry[2] = viewer->location[1];
+	entry[3] = viewer->location[2];
+	viewer->history_pos = (viewer->history_pos+1) % GRITS_VIEWER_HISTORY;
+	g_mutex_unlock(viewer->history_lock);
+}
+
 /* Signal helpers */
 static void _grits_viewer_emit_location_changed(GritsViewer *viewer)
 {
+	_grits_viewer_add_history(viewer);
 	g_signal_emit(viewer, signals[SIG_LOCATION_CHANGED], 0,
 			viewer->location[0],
 			viewer->location[1],
@@ -204,6 +229,11 @@ void grits_viewer_setup(GritsViewer *viewer, GritsPlugins *plugins, GritsPrefs *
 	viewer->plugins = plugins;
 	viewer->prefs   = prefs;
 	viewer->offline = grits_prefs_get_boolean(prefs, "grits/offline", NULL);
+
+	/* Disk cache limit in megabytes */
+	gint quota = grits_prefs_get_integer(prefs, "grits/cache_quota", NULL);
+	if (quota > 0)
+		grits_cache_manager_set_quota(NULL, (guint64)quota << 20);
 }
 
 /**
@@ -318,6 +348,75 @@ void grits_viewer_zoom(GritsViewer *viewer, gdouble scale)
 	_grits_viewer_emit_location_changed(viewer);
 }
 
+/**
+ * grits_viewer_predict_location:
+ * @viewer: the viewer
+ * @ahead:  number of seconds into the future to predict
+ * @lat:  the location to store the predicted latitude
+ * @lon:  the location to store the predicted longitude
+ * @elev: the location to store the predicted elevation
+ *
+ * Estimate where the camera will be if the current motion continues. The
+ * velocity is measured over the most recent location changes. Elevation is
+ * extrapolated logarithmically since zooming scales the elevation.
+ *
+ * If the camera is not moving the current location is stored. This can be
+ * called from any thread.
+ *
+ * Returns: %TRUE if the camera is moving
+ */
+gboolean grits_viewer_predict_location(GritsViewer *viewer, gdouble ahead,
+		gdouble *lat, gdouble *lon, gdouble *elev)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+
+	/* Copy the history, it is updated from the main thread */
+	gdouble history[GRITS_VIEWER_HISTORY][4];
+	g_mutex_lock(viewer->history_lock);
+	memcpy(history, viewer->history, sizeof(history));
+	gint pos = viewer->history_pos;
+	g_mutex_unlock(viewer->history_lock);
+
+	/* The newest entry is the current location */
+	gint     last   = (pos + GRITS_VIEWER_HISTORY - 1) % GRITS_VIEWER_HISTORY;
+	gdouble *newest = history[last];
+	*lat  = newest[0] ? newest[1] : viewer->location[0];
+	*lon  = newest[0] ? newest[2] : viewer->location[1];
+	*elev = newest[0] ? newest[3] : viewer->location[2];
+
+	/* Find the oldest entry inside the window */
+	gdouble *oldest = NULL;
+	if (newest[0] == 0 || _grits_viewer_now() - newest[0] > HISTORY_STALE)
+		return FALSE;
+	for (int i = 1; i < GRITS_VIEWER_HISTORY; i++) {
+		gdouble *entry = history[
+			(last + GRITS_VIEWER_HISTORY - i) % GRITS_VIEWER_HISTORY];
+		if (entry[0] == 0 || newest[0] - entry[0] > HISTORY_WINDOW)
+			break;
+		oldest = entry;
+	}
+	if (!oldest || newest[0] <= oldest[0])
+		return FALSE;
+
+	/* Extrapolate, the longitude may have wrapped between entries */
+	gdouble dt   = newest[0] - oldest[0];
+	gdouble dlat = newest[1] - oldest[1];
+	gdouble dlon = newest[2] - oldest[2];
+	if (dlon >  180) dlon -= 360;
+	if (dlon < -180) dlon += 360;
+	gdouble rate = newest[3] > 0 && oldest[3] > 0 ?
+		log(newest[3] / oldest[3]) : 0;
+	if (dlat == 0 && dlon == 0 && rate == 0)
+		return FALSE;
+
+	*lat  = CLAMP(*lat + dlat/dt*ahead, -90, 90);
+	*lon  = *lon + dlon/dt*ahead;
+	*elev = *elev * exp(rate/dt*ahead);
+	while (*lon < -180) *lon += 360;
+	while (*lon >  180) *lon -= 360;
+	return TRUE;
+}
+
 /**
  * grits_viewer_set_rotation:
  * @viewer: the viewer
@@ -419,6 +518,169 @@ gboolean grits_viewer_get_offline(GritsViewer *viewer)
 	return viewer->offline;
 }
 
+/* A function registered with grits_viewer_add_heights_func() */
+struct _GritsHeightsProvider {
+	GritsHeightsFunc func;
+	gpointer         user_data;
+};
+
+/**
+ * grits_viewer_add_heights_func:
+ * @viewer:       the viewer
+ * @heights_func: function to look up the elevation of several points
+ * @user_data:    user data to pass to the function
+ *
+ * Install a bulk height provider for grits_viewer_sample_heights() and
+ * grits_viewer_sample_grid(). The most recently added provider is used,
+ * removing it restores the previous one. Usually added by the same plugin
+ * which sets the height function.
+ */
+void grits_viewer_add_heights_func(GritsViewer *viewer,
+		GritsHeightsFunc heights_func, gpointer user_data)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	struct _GritsHeightsProvider *provider =
+		g_new0(struct _GritsHeightsProvider, 1);
+	provider->func      = heights_func;
+	provider->user_data = user_data;
+	viewer->heights_funcs = g_list_prepend(viewer->heights_funcs, provider);
+}
+
+/**
+ * grits_viewer_remove_heights_func:
+ * @viewer:       the viewer
+ * @heights_func: the function passed to grits_viewer_add_heights_func()
+ * @user_data:    the user data passed to grits_viewer_add_heights_func()
+ *
+ * Remove a bulk height provider.
+ */
+void grits_viewer_remove_heights_func(GritsViewer *viewer,
+		GritsHeightsFunc heights_func, gpointer user_data)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	for (GList *cur = viewer->heights_funcs; cur; cur = cur->next) {
+		struct _GritsHeightsProvider *provider = cur->data;
+		if (provider->func == heights_func &&
+		    provider->user_data == user_data) {
+			viewer->heights_funcs =
+				g_list_delete_link(viewer->heights_funcs, cur);
+			g_free(provider);
+			return;
+		}
+	}
+}
+
+static gboolean _grits_viewer_sample_timeout(gpointer _timed_out)
+{
+	*(gboolean*)_timed_out = TRUE;
+	return FALSE;
+}
+
+/**
+ * grits_viewer_sample_heights:
+ * @viewer:  the viewer
+ * @lats:    latitudes of the points to sample
+ * @lons:    longitudes of the points to sample
+ * @heights: location to store the elevation of each point
+ * @count:   the number of points
+ * @res:     the resolution wanted in meters per pixel, or 0 for the most
+ *           detailed data available
+ * @wait:    %TRUE to wait for elevation data which is still being loaded
+ *
+ * Look up the ground elevation for many points with a single call to the
+ * installed height provider, such as a profile along a flight path. Points
+ * should be ordered so that neighbours are next to each other. The provider
+ * starts loading data for points which do not have it at @res, even when they
+ * are far from the camera.
+ *
+ * When @wait is %TRUE the main loop is run until every point has elevation
+ * data at @res, for up to %GRITS_VIEWER_SAMPLE_TIMEOUT seconds. This must be
+ * called from the main thread.
+ *
+ * Returns: %TRUE if every point had elevation data at @res
+ */
+gboolean grits_viewer_sample_heights(GritsViewer *viewer,
+		const gdouble *lats, const gdouble *lons,
+		gdouble *heights, guint count, gdouble res, gboolean wait)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	if (!viewer->heights_funcs) {
+		for (guint i = 0; i < count; i++)
+			heights[i] = 0;
+		return count == 0;
+	}
+	struct _GritsHeightsProvider *provider = viewer->heights_funcs->data;
+	guint missing = provider->func(lats, lons, heights, count, res,
+			provider->user_data);
+	if (missing == 0 || !wait)
+		return missing == 0;
+
+	/* Tiles are attached from idle callbacks, so run the main loop until
+	 * they arrive or the timeout fires */
+	gboolean timed_out = FALSE;
+	guint timeout = g_timeout_add(GRITS_VIEWER_SAMPLE_TIMEOUT * 1000,
+			_grits_viewer_sample_timeout, &timed_out);
+	while (missing > 0 && !timed_out) {
+		g_main_context_iteration(NULL, TRUE);
+		/* The provider may have been removed by a callback */
+		if (!viewer->heights_funcs)
+			break;
+		provider = viewer->heights_funcs->data;
+		missing  = provider->func(lats, lons, heights, count, res,
+				provider->user_data);
+	}
+	if (!timed_out)
+		g_source_remove(timeout);
+	g_debug("GritsViewer: sample_heights - %u of %u points missing",
+			missing, count);
+	return missing == 0;
+}
+
+/**
+ * grits_viewer_sample_grid:
+ * @viewer:  the viewer
+ * @bounds:  the area to sample
+ * @rows:    number of rows of samples, from north to south
+ * @cols:    number of columns of samples, from west to east
+ * @heights: location to store @rows * @cols elevations, row by row
+ * @res:     the resolution wanted in meters per pixel, or 0 for the most
+ *           detailed data available
+ * @wait:    %TRUE to wait for elevation data which is still being loaded
+ *
+ * Look up the ground elevation on an evenly spaced grid, the first and last
+ * rows and columns lie on the edges of @bounds. The grid is passed to the
+ * height provider a batch of rows at a time. See
+ * grits_viewer_sample_heights().
+ *
+ * Returns: %TRUE if every point had elevation data
+ */
+gboolean grits_viewer_sample_grid(GritsViewer *viewer, GritsBounds *bounds,
+		guint rows, guint cols, gdouble *heights, gdouble res, gboolean wait)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	if (rows == 0 || cols == 0)
+		return TRUE;
+	gdouble lat_step = rows > 1 ? (bounds->n - bounds->s) / (rows-1) : 0;
+	gdouble lon_step = cols > 1 ? (bounds->e - bounds->w) / (cols-1) : 0;
+	guint   batch    = MAX(GRITS_VIEWER_SAMPLE_BATCH / cols, 1);
+	gdouble *lats    = g_new(gdouble, batch * cols);
+	gdouble *lons    = g_new(gdouble, batch * cols);
+	gboolean found   = TRUE;
+	for (guint row = 0; row < rows; row += batch) {
+		guint nrows = MIN(batch, rows - row);
+		for (guint r = 0; r < nrows; r++)
+		for (guint c = 0; c < cols; c++) {
+			lats[r*cols + c] = bounds->n - lat_step * (row + r);
+			lons[r*cols + c] = bounds->w + lon_step * c;
+		}
+		found &= grits_viewer_sample_heights(viewer, lats, lons,
+				heights + row*cols, nrows*cols, res, wait);
+	}
+	g_free(lats);
+	g_free(lons);
+	return found;
+}
+
 /***********************************
  * To be implemented by subclasses *
  ***********************************/
@@ -566,6 +828,7 @@ static void grits_viewer_init(GritsViewer *viewer)
 	viewer->rotation[0] = 0;
 	viewer->rotation[1] = 0;
 	viewer->rotation[2] = 0;
+	viewer->history_lock = g_mutex_new();
 
 	g_object_set(viewer, "can-focus", TRUE, NULL);
 	gtk_widget_add_events(GTK_WIDGET(viewer),
@@ -589,6 +852,10 @@ static void grits_viewer_init(GritsViewer *viewer)
 static void grits_viewer_finalize(GObject *gobject)
 {
 	g_debug("GritsViewer: finalize");
+	GritsViewer *viewer = GRITS_VIEWER(gobject);
+	g_list_foreach(viewer->heights_funcs, (GFunc)g_free, NULL);
+	g_list_free(viewer->heights_funcs);
+	g_mutex_free(viewer->history_lock);
 	G_OBJECT_CLASS(grits_viewer_parent_class)->finalize(gobject);
 	g_debug("GritsViewer: finalize - done");
 }
@@ -95,10 +95,39 @@ typedef struct _GritsViewerClass GritsViewerClass;
  */
 typedef gdouble (*GritsHeightFunc)(gdouble lat, gdouble lon, gpointer user_data);
 
+/**
+ * GritsHeightsFunc:
+ * @lats:      latitudes of the points
+ * @lons:      longitudes of the points
+ * @heights:   location to store the elevation of each point
+ * @count:     the number of points
+ * @res:       the resolution wanted in meters per pixel, or 0 for the most
+ *             detailed data available
+ * @user_data: user data passed to the function
+ *
+ * Determine the surface elevation of several points at once. Points without
+ * any elevation data should be given a height of 0. Points with only less
+ * detailed data than @res should be given the best height available, and the
+ * provider should start loading the data they need.
+ *
+ * Returns: the number of points without elevation data at @res
+ */
+typedef guint (*GritsHeightsFunc)(const gdouble *lats, const gdouble *lons,
+		gdouble *heights, guint count, gdouble res, gpointer user_data);
+
 #include "grits-plugin.h"
 #include "grits-prefs.h"
 #include "objects/grits-object.h"
 
+/* Number of recent locations kept for predicting camera motion */
+#define GRITS_VIEWER_HISTORY 16
+
+/* Longest time grits_viewer_sample_heights() waits for data, in seconds */
+#define GRITS_VIEWER_SAMPLE_TIMEOUT 10.0
+
+/* Points passed to the height provider at once by grits_viewer_sample_grid() */
+#define GRITS_VIEWER_SAMPLE_BATCH 16384
+
 struct _GritsViewer {
 	GtkDrawingArea parent_instance;
 
@@ -110,6 +139,15 @@ struct _GritsViewer {
 	gdouble     rotation[3];
 	gboolean    offline;
 
+	/* Recent locations as {time, lat, lon, elev}, the lock is held while
+	 * they are written so they can be read from the tile loading threads */
+	gdouble     history[GRITS_VIEWER_HISTORY][4];
+	gint        history_pos;
+	GMutex     *history_lock;
+
+	/* Bulk height providers, newest first */
+	GList      *heights_funcs;
+
 	/* For dragging */
 	gint    drag_mode;
 	gdouble drag_x, drag_y;
@@ -148,6 +186,8 @@ void grits_viewer_set_location(GritsViewer *viewer, gdouble  lat, gdouble  lon,
 void grits_viewer_get_location(GritsViewer *viewer, gdouble *lat, gdouble *lon, gdouble *elev);
 void grits_viewer_pan(GritsViewer *viewer, gdouble forward, gdouble right, gdouble up);
 void grits_viewer_zoom(GritsViewer *viewer, gdouble  scale);
+gboolean grits_viewer_predict_location(GritsViewer *viewer, gdouble ahead,
+		gdouble *lat, gdouble *lon, gdouble *elev);
 
 void grits_viewer_set_rotation(GritsViewer *viewer, gdouble  x, gdouble  y, gdouble  z);
 void grits_viewer_get_rotation(GritsViewer *viewer, gdouble *x, gdouble *y, gdouble *z);
@@ -158,6 +198,16 @@ void grits_viewer_refresh(GritsViewer *viewer);
 void grits_viewer_set_offline(GritsViewer *viewer, gboolean offline);
 gboolean grits_viewer_get_offline(GritsViewer *viewer);
 
+void grits_viewer_add_heights_func(GritsViewer *viewer,
+		GritsHeightsFunc heights_func, gpointer user_data);
+void grits_viewer_remove_heights_func(GritsViewer *viewer,
+		GritsHeightsFunc heights_func, gpointer user_data);
+gboolean grits_viewer_sample_heights(GritsViewer *viewer,
+		const gdouble *lats, const gdouble *lons,
+		gdouble *heights, guint count, gdouble res, gboolean wait);
+gboolean grits_viewer_sample_grid(GritsViewer *viewer, GritsBounds *bounds,
+		guint rows, guint cols, gdouble *heights, gdouble res, gboolean wait);
+
 /* To be implemented by subclasses */
 void grits_viewer_center_position(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elev);
@@ -21,13 +21,21 @@
 /* Grits Core */
 #include <grits-viewer.h>
 #include <grits-opengl.h>
+#include <grits-texture-pool.h>
 #include <grits-prefs.h>
 #include <grits-util.h>
 
 /* Grits data */
 #include <data/grits-data.h>
 #include <data/grits-http.h>
+#include <data/grits-cache-manager.h>
+#include <data/grits-pack.h>
 #include <data/grits-wms.h>
+#include <data/grits-tile-source.h>
+#include <data/grits-prefetch.h>
+#include <data/grits-worker.h>
+#include <data/grits-delta.h>
+#include <data/grits-colormap.h>
 
 /* Grits objects */
 #include <objects/grits-object.h>
@@ -33,14 +33,156 @@
  */
 
 #include <config.h>
+#include <math.h>
 #include "gtkgl.h"
 #include "grits-tile.h"
 
-gchar *grits_tile_path_table[2][2] = {
-	{"00.", "01."},
-	{"10.", "11."},
+/* Layout used by grits_tile_new, each tile is split into 2x2 children */
+static const GritsTileLayout grits_tile_layout_default = {2, 2, 2, 2, FALSE};
+
+/* Index of resident tiles, this is keyed on the integer location of each tile
+ * so tiles can be found without walking down through the tree */
+struct _GritsTileIndex {
+	GHashTable     *tiles;  // &tile->key -> tile
+	GMutex         *lock;
+	guint           levels; // deepest level that has been inserted
+	gint            refs;
+	GritsTileLayout layout;
 };
 
+static guint _grits_tile_key_hash(gconstpointer key)
+{
+	guint64 value = *(const guint64*)key;
+	return (guint)(value ^ (value >> 32));
+}
+
+static gboolean _grits_tile_key_equal(gconstpointer a, gconstpointer b)
+{
+	return *(const guint64*)a == *(const guint64*)b;
+}
+
+static GritsTileIndex *_grits_tile_index_new(const GritsTileLayout *layout)
+{
+	GritsTileIndex *index = g_new0(GritsTileIndex, 1);
+	index->tiles  = g_hash_table_new(_grits_tile_key_hash, _grits_tile_key_equal);
+	index->lock   = g_mutex_new();
+	index->refs   = 1;
+	index->layout = *layout;
+	return index;
+}
+
+static GritsTileIndex *_grits_tile_index_ref(GritsTileIndex *index)
+{
+	g_atomic_int_inc(&index->refs);
+	return index;
+}
+
+static void _grits_tile_index_unref(GritsTileIndex *index)
+{
+	if (!g_atomic_int_dec_and_test(&index->refs))
+		return;
+	g_hash_table_destroy(index->tiles);
+	g_mutex_free(index->lock);
+	g_free(index);
+}
+
+static void _grits_tile_index_insert(GritsTileIndex *index, GritsTile *tile)
+{
+	g_mutex_lock(index->lock);
+	g_hash_table_replace(index->tiles, &tile->key, tile);
+	index->levels = MAX(index->levels, tile->level);
+	g_mutex_unlock(index->lock);
+}
+
+static void _grits_tile_index_remove(GritsTileIndex *index, GritsTile *tile)
+{
+	g_mutex_lock(index->lock);
+	if (g_hash_table_lookup(index->tiles, &tile->key) == tile)
+		g_hash_table_remove(index->tiles, &tile->key);
+	g_mutex_unlock(index->lock);
+}
+
+/* Find the tile at level which contains the point, the point is given as a
+ * fraction of the distance across root. Must be called with the index locked */
+static GritsTile *_grits_tile_index_probe(GritsTile *root, guint level,
+		gdouble fx, gdouble fy)
+{
+	const GritsTileLayout *layout = &root->index->layout;
+	guint64 nrows = 1, ncols = 1;
+	for (guint i = root->level; i < level; i++) {
+		nrows *= i == 0 ? layout->root_rows : layout->rows;
+		ncols *= i == 0 ? layout->root_cols : layout->cols;
+	}
+	guint64 x = MIN((guint64)(fx * ncols), ncols-1);
+	guint64 y = MIN((guint64)(fy * nrows), nrows-1);
+	guint64 key = GRITS_TILE_KEY(level,
+			root->x * ncols + x,
+			root->y * nrows + y);
+	return g_hash_table_lookup(root->index->tiles, &key);
+}
+
+/* Point the tile at the texture it should be drawn with. Once the tile has
+ * data it uses it's own texture, until then it borrows the texture of the
+ * closest loaded ancestor and maps the part of it which covers the tile */
+static void _grits_tile_update_proxy(GritsTile *tile)
+{
+	if (tile->data) {
+		if (tile->proxy) {
+			tile->proxy = NULL;
+			grits_bounds_set_bounds(&tile->coords, 0, 1, 1, 0);
+		}
+		return;
+	}
+
+	GritsTile *parent = tile->parent;
+	tile->proxy = !parent      ? NULL   :
+	              parent->data ? parent : parent->proxy;
+	if (!tile->proxy)
+		return;
+
+	/* The parents coords already map it onto the proxy texture */
+	gdouble xscale = (parent->coords.e - parent->coords.w) /
+	                 (parent->edge.e   - parent->edge.w);
+	gdouble yscale = (parent->coords.s - parent->coords.n) /
+	                 (parent->edge.n   - parent->edge.s);
+	tile->coords.n = parent->coords.n + (parent->edge.n - tile->edge.n) * yscale;
+	tile->coords.s = parent->coords.n + (parent->edge.n - tile->edge.s) * yscale;
+	tile->coords.e = parent->coords.w + (tile->edge.e - parent->edge.w) * xscale;
+	tile->coords.w = parent->coords.w + (tile->edge.w - parent->edge.w) * xscale;
+}
+
+/* Create a tile and add it to the index of the tree, parent may be NULL
+ * in which case a new tree is started */
+static GritsTile *_grits_tile_new(GritsTile *parent, GritsTileIndex *index,
+	gdouble n, gdouble s, gdouble e, gdouble w)
+{
+	GritsTile *tile = g_object_new(GRITS_TYPE_TILE, NULL);
+	tile->parent = parent;
+	tile->atime  = time(NULL);
+	tile->index  = index;
+	grits_bounds_set_bounds(&tile->coords, 0, 1, 1, 0);
+	grits_bounds_set_bounds(&tile->edge, n, s, e, w);
+	if (parent) {
+		const gint rows = parent->rows;
+		const gint cols = parent->cols;
+		const gdouble lat_step = (parent->edge.n - parent->edge.s) / rows;
+		const gdouble lon_step = (parent->edge.e - parent->edge.w) / cols;
+		gint row = (parent->edge.n - n) / lat_step + 0.5;
+		gint col = (w - parent->edge.w) / lon_step + 0.5;
+		tile->level = parent->level + 1;
+		tile->x     = parent->x * cols + CLAMP(col, 0, cols-1);
+		tile->y     = parent->y * rows + CLAMP(row, 0, rows-1);
+	}
+	const GritsTileLayout *layout = &index->layout;
+	tile->rows     = tile->level == 0 ? layout->root_rows : layout->rows;
+	tile->cols     = tile->level == 0 ? layout->root_cols : layout->cols;
+	tile->children = g_new0(GritsTile*, tile->rows * tile->cols);
+	tile->key      = GRITS_TILE_KEY(tile->level, tile->x, tile->y);
+	_grits_tile_index_insert(tile->index, tile);
+	_grits_tile_update_proxy(tile);
+	return tile;
+}
+
 /**
  * grits_tile_new:
  * @parent: the parent for the tile, or NULL
@@ -51,17 +193,87 @@ gchar *grits_tile_path_table[2][2] = {
  *
  * Create a tile associated with a particular latitude/longitude box.
  *
+ * If @parent is given, the tiles integer location is determined by where the
+ * box falls within the parent, the box should be one of the parents children
+ * as split by grits_tile_update(). Until data is loaded for the tile it is
+ * drawn using the texture of the closest ancestor which has data.
+ *
+ * If @parent is NULL a new tree is started where each tile is split into
+ * 2x2 children, see grits_tile_new_with_layout().
+ *
  * Returns: the new #GritsTile
  */
 GritsTile *grits_tile_new(GritsTile *parent,
 	gdouble n, gdouble s, gdouble e, gdouble w)
 {
-	GritsTile *tile = g_object_new(GRITS_TYPE_TILE, NULL);
-	tile->parent = parent;
-	tile->atime  = time(NULL);
-	grits_bounds_set_bounds(&tile->coords, 0, 1, 1, 0);
-	grits_bounds_set_bounds(&tile->edge, n, s, e, w);
-	return tile;
+	if (!parent)
+		return grits_tile_new_with_layout(&grits_tile_layout_default,
+				n, s, e, w);
+	return _grits_tile_new(parent, _grits_tile_index_ref(parent->index),
+			n, s, e, w);
+}
+
+/**
+ * grits_tile_new_with_layout:
+ * @layout: how tiles in the new tree are split
+ * @n:      the northern border of the tile
+ * @s:      the southern border of the tile
+ * @e:      the eastern border of the tile
+ * @w:      the western border of the tile
+ *
+ * Create the root tile for a tree which is split according to @layout. This
+ * can be used to match the tile pyramid of a server, for example a
+ * placeholder root split into 1x2 tiles each of which is split into 2x2
+ * children.
+ *
+ * Returns: the new #GritsTile
+ */
+GritsTile *grits_tile_new_with_layout(const GritsTileLayout *layout,
+	gdouble n, gdouble s, gdouble e, gdouble w)
+{
+	g_return_val_if_fail(layout->root_rows && layout->root_cols &&
+	                     layout->rows      && layout->cols, NULL);
+	return _grits_tile_new(NULL, _grits_tile_index_new(layout),
+			n, s, e, w);
+}
+
+/**
+ * grits_tile_get_layout:
+ * @tile: any tile in the tree
+ *
+ * Get the layout used to split the tiles in a tree.
+ *
+ * Returns: the layout, owned by the tree
+ */
+const GritsTileLayout *grits_tile_get_layout(GritsTile *tile)
+{
+	return &tile->index->layout;
+}
+
+/* Build the path for the tile at an integer location */
+static gchar *_grits_tile_path(const GritsTileLayout *layout,
+		guint level, guint x, guint y)
+{
+	/* The location within each parent is the remainder of the integer
+	 * location once the parents location has been divided out */
+	gboolean wide = layout->rows      > 10 || layout->cols      > 10 ||
+	                layout->root_rows > 10 || layout->root_cols > 10;
+	GList *parts = NULL;
+	for (; level > 0; level--) {
+		guint rows = level == 1 ? layout->root_rows : layout->rows;
+		guint cols = level == 1 ? layout->root_cols : layout->cols;
+		parts = g_list_prepend(parts, g_strdup_printf(
+				wide ? "%d_%d." : "%d%d.", y%rows, x%cols));
+		x /= cols;
+		y /= rows;
+	}
+	GString *path = g_string_new("");
+	for (GList *cur = parts; cur; cur = cur->next) {
+		g_string_append(path, cur->data);
+		g_free(cur->data);
+	}
+	g_list_free(parts);
+	return g_string_free(path, FALSE);
 }
 
 /**
@@ -71,24 +283,33 @@ GritsTile *grits_tile_new(GritsTile *parent,
  * Generate a string representation of a tiles location in a group of nested
  * tiles. The string returned consists of groups of two digits separated by a
  * delimiter. Each group of digits the tiles location with respect to it's
- * parent tile.
+ * parent tile. If the tree has more than 10 rows or columns of children the
+ * two numbers in each group are separated by an underscore.
  *
  * Returns: the path representing the tiles's location
  */
 gchar *grits_tile_get_path(GritsTile *child)
 {
-	/* This could be easily cached if necessary */
-	int x, y;
-	GList *parts = NULL;
-	for (GritsTile *parent = child->parent; parent; child = parent, parent = child->parent)
-		grits_tile_foreach_index(child, x, y)
-			if (parent->children[x][y] == child)
-				parts = g_list_prepend(parts, grits_tile_path_table[x][y]);
-	GString *path = g_string_new("");
-	for (GList *cur = parts; cur; cur = cur->next)
-		g_string_append(path, cur->data);
-	g_list_free(parts);
-	return g_string_free(path, FALSE);
+	return _grits_tile_path(&child->index->layout,
+			child->level, child->x, child->y);
+}
+
+/**
+ * grits_tile_get_child_path:
+ * @parent: the parent of the tile to generate a path for
+ * @row:    the row of the child within @parent
+ * @col:    the column of the child within @parent
+ *
+ * Generate the path for a child of @parent, see grits_tile_get_path(). The
+ * child does not need to exist.
+ *
+ * Returns: the path representing the child's location
+ */
+gchar *grits_tile_get_child_path(GritsTile *parent, guint row, guint col)
+{
+	return _grits_tile_path(&parent->index->layout, parent->level + 1,
+			parent->x * parent->cols + col,
+			parent->y * parent->rows + row);
 }
 
 static gdouble _grits_tile_get_min_dist(GritsPoint *eye, GritsBounds *bounds)
@@ -156,12 +377,14 @@ void grits_tile_update(GritsTile *root, GritsPoint *eye,
 	root->atime = time(NULL);
 	//g_debug("GritsTile: update - %p->atime = %u",
 	//		root, (guint)root->atime);
-	const gdouble rows = G_N_ELEMENTS(root->children);
-	const gdouble cols = G_N_ELEMENTS(root->children[0]);
+	const gdouble rows = root->rows;
+	const gdouble cols = root->cols;
 	const gdouble lat_dist = root->edge.n - root->edge.s;
 	const gdouble lon_dist = root->edge.e - root->edge.w;
 	const gdouble lat_step = lat_dist / rows;
 	const gdouble lon_step = lon_dist / cols;
+	/* A placeholder root is never used by itself */
+	gboolean split = root->level == 0 && root->index->layout.placeholder;
 	int row, col;
 	grits_tile_foreach_index(root, row, col) {
 		GritsBounds edge;
@@ -170,8 +393,8 @@ void grits_tile_update(GritsTile *root, GritsPoint *eye,
 		edge.e = root->edge.w+(lon_step*(col+1));
 		edge.w = root->edge.w+(lon_step*(col+0));
 
-		GritsTile **child = &root->children[row][col];
-		if (!_grits_tile_precise(eye, &edge, res,
+		GritsTile **child = &grits_tile_child(root, row, col);
+		if (split || !_grits_tile_precise(eye, &edge, res,
 				width/cols, height/rows)) {
 			if (!*child) {
 				*child = grits_tile_new(root, edge.n, edge.s,
@@ -195,37 +418,70 @@ void grits_tile_update(GritsTile *root, GritsPoint *eye,
  * @lon:  target longitude
  *
  * Locate the subtile with the highest resolution which contains the given
- * lat/lon point.
- * 
- * Returns: the child tile
+ * lat/lon point and has data loaded. The deepest resident tile is found by a
+ * binary search over the levels in the tree's index, so the cost does not
+ * grow with the depth of the tree.
+ *
+ * Returns: the child tile, or @root if no children have been loaded
  */
 GritsTile *grits_tile_find(GritsTile *root, gdouble lat, gdouble lon)
 {
-	gint    rows = G_N_ELEMENTS(root->children);
-	gint    cols = G_N_ELEMENTS(root->children[0]);
-
-	gdouble lat_step = (root->edge.n - root->edge.s) / rows;
-	gdouble lon_step = (root->edge.e - root->edge.w) / cols;
-
-	gdouble lat_offset = root->edge.n - lat;;
-	gdouble lon_offset = lon - root->edge.w;
-
-	gint    row = lat_offset / lat_step;
-	gint    col = lon_offset / lon_step;
-
-	if (lon == 180) col--;
-	if (lat == -90) row--;
+	gdouble fx = (lon - root->edge.w) / (root->edge.e - root->edge.w);
+	gdouble fy = (root->edge.n - lat) / (root->edge.n - root->edge.s);
 
 	//if (lon == 180 || lon == -180)
-	//	g_message("lat=%f,lon=%f step=%f,%f off=%f,%f row=%d/%d,col=%d/%d",
-	//		lat,lon, lat_step,lon_step, lat_offset,lon_offset, row,rows,col,cols);
+	//	g_message("lat=%f,lon=%f fx=%f,fy=%f", lat,lon, fx,fy);
 
-	if (row < 0 || row >= rows || col < 0 || col >= cols)
+	if (fx < 0 || fx > 1 || fy < 0 || fy > 1)
 		return NULL;
-	else if (root->children[row][col] && root->children[row][col]->data)
-		return grits_tile_find(root->children[row][col], lat, lon);
-	else
-		return root;
+
+	/* Tiles are only added below their parents, so if a tile exists at
+	 * some level, every level above it contains the point as well */
+	GritsTileIndex *index = root->index;
+	g_mutex_lock(index->lock);
+	GritsTile *found = root;
+	guint lo = root->level;
+	guint hi = MAX(root->level, index->levels);
+	while (lo < hi) {
+		guint mid = (lo + hi + 1) / 2;
+		GritsTile *tile = _grits_tile_index_probe(root, mid, fx, fy);
+		if (tile) {
+			found = tile;
+			lo    = mid;
+		} else {
+			hi    = mid - 1;
+		}
+	}
+	while (found != root && !found->data)
+		found = found->parent;
+	g_mutex_unlock(index->lock);
+	return found;
+}
+
+/**
+ * grits_tile_lookup:
+ * @root:  any tile in the tree to search
+ * @level: depth of the tile, 0 for the root tile
+ * @x:     column of the tile within its level
+ * @y:     row of the tile within its level
+ *
+ * Find a resident tile by its integer location. This does not descend
+ * through the tree and does not require the tile to have data.
+ *
+ * This can be called from any thread, but no reference is taken on the tile.
+ * Tiles are freed by the thread which updates the tree, so only that thread
+ * may use the returned tile, other threads may only compare the pointer or
+ * test it against %NULL.
+ *
+ * Returns: the tile, or %NULL if it has not been created
+ */
+GritsTile *grits_tile_lookup(GritsTile *root, guint level, guint x, guint y)
+{
+	guint64 key = GRITS_TILE_KEY(level, x, y);
+	g_mutex_lock(root->index->lock);
+	GritsTile *tile = g_hash_table_lookup(root->index->tiles, &key);
+	g_mutex_unlock(root->index->lock);
+	return tile;
 }
 
 /**
@@ -248,10 +504,10 @@ GritsTile *grits_tile_gc(GritsTile *root, time_t atime,
 	gboolean has_children = FALSE;
 	int x, y;
 	grits_tile_foreach_index(root, x, y) {
-		root->children[x][y] = grits_tile_gc(
-				root->children[x][y], atime,
+		grits_tile_child(root, x, y) = grits_tile_gc(
+				grits_tile_child(root, x, y), atime,
 				free_func, user_data);
-		if (root->children[x][y])
+		if (grits_tile_child(root, x, y))
 			has_children = TRUE;
 	}
 	//g_debug("GritsTile: gc - %p->atime=%u < atime=%u",
@@ -285,10 +541,20 @@ void grits_tile_free(GritsTile *root, GritsTileFreeFunc free_func, gpointer user
 	g_object_unref(root);
 }
 
+/* Texture bound by the last tile drawn, only valid while drawing */
+static guint grits_tile_bound;
+
 /* Draw a single tile */
 static void grits_tile_draw_one(GritsTile *tile, GritsOpenGL *opengl, GList *triangles)
 {
-	if (!tile || !tile->data)
+	if (!tile)
+		return;
+	gpointer data = tile->data ?: tile->proxy ? tile->proxy->data : NULL;
+	if (!data)
+		return;
+	/* Data may be loaded before its texture, such as elevation tiles
+	 * which are shaded later, skip them until the texture is ready */
+	if (!*(guint*)data)
 		return;
 	if (!triangles)
 		g_warning("GritsOpenGL: _draw_tiles - No triangles to draw: edges=%f,%f,%f,%f",
@@ -308,6 +574,16 @@ static void grits_tile_draw_one(GritsTile *tile, GritsOpenGL *opengl, GList *tri
 	gdouble xscale = tile->coords.e - tile->coords.w;
 	gdouble yscale = tile->coords.s - tile->coords.n;
 
+	/* Tiles sharing a texture, such as an atlas or a proxy, are drawn
+	 * without binding it again */
+	glEnable(GL_TEXTURE_2D);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	if (grits_tile_bound != *(guint*)data) {
+		grits_tile_bound = *(guint*)data;
+		glBindTexture(GL_TEXTURE_2D, grits_tile_bound);
+	}
+	glPolygonOffset(0, -tile->zindex);
+	glBegin(GL_TRIANGLES);
 	for (GList *cur = triangles; cur; cur = cur->next) {
 		RoamTriangle *tri = cur->data;
 
@@ -350,66 +626,92 @@ static void grits_tile_draw_one(GritsTile *tile, GritsOpenGL *opengl, GList *tri
 			xy[i][1] = tile->coords.n + xy[i][1]*yscale;
 		}
 
-		glEnable(GL_TEXTURE_2D);
-		glEnable(GL_POLYGON_OFFSET_FILL);
-		glBindTexture(GL_TEXTURE_2D, *(guint*)tile->data);
-		glPolygonOffset(0, -tile->zindex);
-		glBegin(GL_TRIANGLES);
 		glNormal3dv(tri->p.r->norm); glTexCoord2dv(xy[0]); glVertex3dv((double*)tri->p.r);
 		glNormal3dv(tri->p.m->norm); glTexCoord2dv(xy[1]); glVertex3dv((double*)tri->p.m);
 		glNormal3dv(tri->p.l->norm); glTexCoord2dv(xy[2]); glVertex3dv((double*)tri->p.l);
-		glEnd();
+	}
+	glEnd();
+}
+
+/* Split a list of triangles between the children of a tile. Triangles
+ * crossing the edge of a child are added to each child they intersect */
+static void _grits_tile_split_triangles(GritsTile *tile, GList *triangles,
+		GList **lists)
+{
+	const gdouble lat_step = (tile->edge.n - tile->edge.s) / tile->rows;
+	const gdouble lon_step = (tile->edge.e - tile->edge.w) / tile->cols;
+	for (GList *cur = triangles; cur; cur = cur->next) {
+		RoamTriangle *tri = cur->data;
+		gint r0 = floor((tile->edge.n - tri->edge.n) / lat_step);
+		gint r1 = ceil ((tile->edge.n - tri->edge.s) / lat_step) - 1;
+		gint c0 = floor((tri->edge.w - tile->edge.w) / lon_step);
+		gint c1 = ceil ((tri->edge.e - tile->edge.w) / lon_step) - 1;
+		r0 = MAX(r0, 0); r1 = MIN(r1, tile->rows-1);
+		c0 = MAX(c0, 0); c1 = MIN(c1, tile->cols-1);
+		for (int row = r0; row <= r1; row++)
+		for (int col = c0; col <= c1; col++) {
+			GList **list = &lists[row * tile->cols + col];
+			*list = g_list_prepend(*list, tri);
+		}
 	}
 }
 
-/* Draw the tile */
-static void grits_tile_draw_rec(GritsTile *tile, GritsOpenGL *opengl)
+/* Draw the tile using triangles which intersect it, the triangles are split
+ * between the children so the sphere is only searched once per frame */
+static void grits_tile_draw_rec(GritsTile *tile, GritsOpenGL *opengl,
+		GList *triangles)
 {
-	/* Only draw children if possible */
+	/* Only draw children if possible, children without data of their own
+	 * can still be drawn using a proxy texture */
 	gboolean has_children = FALSE;
 	GritsTile *child;
-	grits_tile_foreach(tile, child)
-		if (child && child->data)
+	grits_tile_foreach(tile, child) {
+		if (!child)
+			continue;
+		_grits_tile_update_proxy(child);
+		if (child->data || child->proxy)
 			has_children = TRUE;
+	}
 
-	GList *triangles = NULL;
-	if (has_children && !GRITS_OBJECT(tile)->hidden) {
-		/* TODO: simplify this */
-		const gdouble rows = G_N_ELEMENTS(tile->children);
-		const gdouble cols = G_N_ELEMENTS(tile->children[0]);
-		const gdouble lat_dist = tile->edge.n - tile->edge.s;
-		const gdouble lon_dist = tile->edge.e - tile->edge.w;
-		const gdouble lat_step = lat_dist / rows;
-		const gdouble lon_step = lon_dist / cols;
-		int row, col;
-		grits_tile_foreach_index(tile, row, col) {
-			GritsTile *child = tile->children[row][col];
-			if (child && child->data) {
-				grits_tile_draw_rec(child, opengl);
-			} else {
-				const gdouble n = tile->edge.n-(lat_step*(row+0));
-				const gdouble s = tile->edge.n-(lat_step*(row+1));
-				const gdouble e = tile->edge.w+(lon_step*(col+1));
-				const gdouble w = tile->edge.w+(lon_step*(col+0));
-				GList *these = roam_sphere_get_intersect(opengl->sphere,
-						FALSE, n, s, e, w);
-				triangles = g_list_concat(triangles, these);
-			}
+	if (!has_children || GRITS_OBJECT(tile)->hidden) {
+		if (triangles)
+			grits_tile_draw_one(tile, opengl, triangles);
+		return;
+	}
+
+	/* Areas covered by children which can't be drawn use this tile */
+	GList **lists = g_new0(GList*, tile->rows * tile->cols);
+	_grits_tile_split_triangles(tile, triangles, lists);
+	GList *these = NULL;
+	int row, col;
+	grits_tile_foreach_index(tile, row, col) {
+		GritsTile *child = grits_tile_child(tile, row, col);
+		GList *list = lists[row * tile->cols + col];
+		if (child && (child->data || child->proxy)) {
+			if (list)
+				grits_tile_draw_rec(child, opengl, list);
+			g_list_free(list);
+		} else {
+			these = g_list_concat(these, list);
 		}
-	} else {
-		triangles = roam_sphere_get_intersect(opengl->sphere, FALSE,
-				tile->edge.n, tile->edge.s, tile->edge.e, tile->edge.w);
 	}
-	if (triangles)
-		grits_tile_draw_one(tile, opengl, triangles);
-	g_list_free(triangles);
+	if (these)
+		grits_tile_draw_one(tile, opengl, these);
+	g_list_free(these);
+	g_free(lists);
 }
 
 static void grits_tile_draw(GritsObject *tile, GritsOpenGL *opengl)
 {
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
-	grits_tile_draw_rec(GRITS_TILE(tile), opengl);
+	_grits_tile_update_proxy(GRITS_TILE(tile));
+	grits_tile_bound = 0;
+	GritsTile *root = GRITS_TILE(tile);
+	GList *triangles = roam_sphere_get_intersect(opengl->sphere, FALSE,
+			root->edge.n, root->edge.s, root->edge.e, root->edge.w);
+	grits_tile_draw_rec(root, opengl, triangles);
+	g_list_free(triangles);
 }
 
 
@@ -419,9 +721,21 @@ static void grits_tile_init(GritsTile *tile)
 {
 }
 
+static void grits_tile_finalize(GObject *_tile)
+{
+	GritsTile *tile = GRITS_TILE(_tile);
+	_grits_tile_index_remove(tile->index, tile);
+	_grits_tile_index_unref(tile->index);
+	g_free(tile->children);
+	G_OBJECT_CLASS(grits_tile_parent_class)->finalize(_tile);
+}
+
 static void grits_tile_class_init(GritsTileClass *klass)
 {
 	g_debug("GritsTile: class_init");
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	gobject_class->finalize = grits_tile_finalize;
+
 	GritsObjectClass *object_class = GRITS_OBJECT_CLASS(klass);
 	object_class->draw = grits_tile_draw;
 }
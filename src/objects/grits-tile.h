@@ -31,6 +31,39 @@
 
 typedef struct _GritsTile      GritsTile;
 typedef struct _GritsTileClass GritsTileClass;
+typedef struct _GritsTileIndex GritsTileIndex;
+
+/**
+ * GritsTileLayout:
+ * @root_rows: number of rows the root tile is split into
+ * @root_cols: number of columns the root tile is split into
+ * @rows:      number of rows each tile below the root is split into
+ * @cols:      number of columns each tile below the root is split into
+ * @placeholder: %TRUE if the root tile is never loaded and is always split
+ *
+ * Describes how the tiles in a tree are subdivided. A placeholder root is
+ * used when the server has no single image covering the whole tree, such as
+ * when the root grid differs from the branching factor.
+ */
+typedef struct _GritsTileLayout {
+	guint    root_rows;
+	guint    root_cols;
+	guint    rows;
+	guint    cols;
+	gboolean placeholder;
+} GritsTileLayout;
+
+/**
+ * GRITS_TILE_KEY:
+ * @level: depth of the tile, 0 for the root tile
+ * @x:     column of the tile within its level, counting from the west
+ * @y:     row of the tile within its level, counting from the north
+ *
+ * Pack the integer location of a tile into a single 64 bit key. The level
+ * uses the top 8 bits and the row and column use 28 bits each.
+ */
+#define GRITS_TILE_KEY(level, x, y) \
+	(((guint64)(level) << 56) | ((guint64)(y) << 28) | (guint64)(x))
 
 struct _GritsTile {
 	GritsObject  parent_instance;
@@ -47,9 +80,24 @@ struct _GritsTile {
 	/* Texture mapping coordinates */
 	GritsBounds coords;
 
+	/* Closest ancestor with data, drawn in place of this tile using the
+	 * coords sub-rectangle until the tiles own data is loaded */
+	GritsTile *proxy;
+
 	/* Pointers to parent/child nodes */
-	GritsTile *parent;
-	GritsTile *children[2][2];
+	GritsTile  *parent;
+	GritsTile **children;
+
+	/* Grid of children, children[row*cols+col] */
+	guint rows, cols;
+
+	/* Integer location within the tree, see GRITS_TILE_KEY */
+	guint   level;
+	guint   x, y;
+	guint64 key;
+
+	/* Resident tiles, shared by every tile in the tree */
+	GritsTileIndex *index;
 
 	/* Last access time (for garbage collection) */
 	time_t atime;
@@ -78,6 +126,17 @@ typedef void (*GritsTileLoadFunc)(GritsTile *tile, gpointer user_data);
  */
 typedef void (*GritsTileFreeFunc)(GritsTile *tile, gpointer user_data);
 
+/**
+ * grits_tile_child:
+ * @parent: the #GritsTile containing the child
+ * @row:    row of the child, counting from the north
+ * @col:    column of the child, counting from the west
+ *
+ * Access the child of @parent at @row and @col, this can be assigned to.
+ */
+#define grits_tile_child(parent, row, col) \
+	((parent)->children[(row) * (parent)->cols + (col)])
+
 /* Forech functions */
 /**
  * grits_tile_foreach:
@@ -87,24 +146,20 @@ typedef void (*GritsTileFreeFunc)(GritsTile *tile, gpointer user_data);
  * Iterate over each imediate subtile of @parent. 
  */
 #define grits_tile_foreach(parent, child) \
-	for (int _x = 0; _x < G_N_ELEMENTS(parent->children); _x++) \
-	for (int _y = 0; child = parent->children[_x][_y], \
-		_y < G_N_ELEMENTS(parent->children[_x]); _y++)
+	for (int _i = 0; _i < (parent)->rows * (parent)->cols && \
+		(child = (parent)->children[_i], TRUE); _i++)
 
 /**
  * grits_tile_foreach_index:
  * @parent: the #GritsTile to iterate over
- * @x:      integer to store the x index of the current subtile
- * @y:      integer to store the y index of the current subtile
+ * @row:    integer to store the row of the current subtile
+ * @col:    integer to store the column of the current subtile
  *
  * Iterate over each imediate subtile of @parent. 
  */
-#define grits_tile_foreach_index(parent, x, y) \
-	for (x = 0; x < G_N_ELEMENTS(parent->children); x++) \
-	for (y = 0; y < G_N_ELEMENTS(parent->children[x]); y++)
-
-/* Path to string table, keep in sync with tile->children */
-extern gchar *grits_tile_path_table[2][2];
+#define grits_tile_foreach_index(parent, row, col) \
+	for (row = 0; row < (parent)->rows; row++) \
+	for (col = 0; col < (parent)->cols; col++)
 
 GType grits_tile_get_type(void);
 
@@ -112,9 +167,19 @@ GType grits_tile_get_type(void);
 GritsTile *grits_tile_new(GritsTile *parent,
 	gdouble n, gdouble s, gdouble e, gdouble w);
 
+/* Allocate a new root tile with a specific layout */
+GritsTile *grits_tile_new_with_layout(const GritsTileLayout *layout,
+	gdouble n, gdouble s, gdouble e, gdouble w);
+
+/* Layout shared by all tiles in the tree */
+const GritsTileLayout *grits_tile_get_layout(GritsTile *tile);
+
 /* Return a string representation of the tile's path */
 gchar *grits_tile_get_path(GritsTile *child);
 
+/* Return the path for a child which may not exist yet */
+gchar *grits_tile_get_child_path(GritsTile *parent, guint row, guint col);
+
 /* Update a root tile */
 /* Based on eye distance */
 void grits_tile_update(GritsTile *root, GritsPoint *eye,
@@ -124,6 +189,9 @@ void grits_tile_update(GritsTile *root, GritsPoint *eye,
 /* Find the leaf tile containing lat-lon */
 GritsTile *grits_tile_find(GritsTile *root, gdouble lat, gdouble lon);
 
+/* Find a resident tile by its integer location */
+GritsTile *grits_tile_lookup(GritsTile *root, guint level, guint x, guint y);
+
 /* Delete nodes that haven't been accessed since atime */
 GritsTile *grits_tile_gc(GritsTile *root, time_t atime,
 		GritsTileFreeFunc free_func, gpointer user_data);
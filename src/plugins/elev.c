@@ -25,6 +25,9 @@
  * greyscale elevation overlay on the planets surface.
  */
 
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <glib/gstdio.h>
 
 #include <grits.h>
@@ -35,137 +38,835 @@
 #define TILE_WIDTH     1024
 #define TILE_HEIGHT    512
 #define TILE_SIZE      (TILE_WIDTH*TILE_HEIGHT*sizeof(guint16))
+#define PREFETCH_AHEAD 1.0 // seconds
+#define REQUEST_LOADS  16  // tiles loaded for height requests per update
+
+/* The colour ramp covers elevations from RAMP_MIN with one entry for every
+ * 1<<RAMP_SHIFT meters */
+#define RAMP_MIN       -8192
+#define RAMP_SHIFT     3
+#define RAMP_SIZE      (16384 >> RAMP_SHIFT)
+#define RAMP_DEFAULT   "-8000:10306b,-1:4a78b5,0:3c7a3c,500:8db360," \
+                       "1500:e0d080,3000:a0703c,5000:ffffff"
+#define SHADE_AMBIENT  0.35
+#define SHADE_SCALE    2.0 // vertical exaggeration
+#define OVERLAY_ALPHA  160
+
+/* The finest level of the min/max pyramid has one cell for each block of
+ * PYRAMID_BLOCK x PYRAMID_BLOCK pixels, each level above it halves the
+ * resolution until there is a single cell */
+#define PYRAMID_BLOCK  4
+#define PYRAMID_LEVELS 16
+
+/* Saved pyramids start with the size and modification time of the file they
+ * were built from, so a pyramid is rebuilt when its tile changes */
+struct _ElevPyramidHeader {
+	guint64 size;
+	gint64  mtime;
+};
+
+struct _ElevPyramid {
+	gint    levels;
+	gint    width[PYRAMID_LEVELS];
+	gint    height[PYRAMID_LEVELS];
+	gint16 *min[PYRAMID_LEVELS];
+	gint16 *max[PYRAMID_LEVELS];
+	gchar  *buf;
+	gsize   len;
+};
 
 struct _TileData {
 	/* OpenGL has to be first to make grits_opengl_render_tiles happy */
 	guint      opengl;
 	guint16   *bil;
+	GMappedFile *mapped;
+	GritsTileSource *packed; // bil points into this source's pack
+	struct _ElevPyramid *pyramid;
+	gboolean   shaded;
+	gint       refs;
+	gint       level;
+	GritsBounds edge;
+};
+
+/* Tiles with elevation data, most detailed first. The index is replaced
+ * instead of modified so readers never need to lock it, see _index_enter() */
+struct _ElevIndex {
+	guint             count;
+	struct _TileData *data[];
+};
+
+/*****************
+ * Tile payloads *
+ *****************/
+/* Tile data is reference counted, it is held by the tile, by the index, and
+ * by height lookups which are using it. Whichever releases it last frees it,
+ * so the elevation data is never freed while it is being sampled. */
+static void _free_bil(guint16 *bil, GMappedFile *mapped)
+{
+	if (mapped)
+		g_mapped_file_free(mapped);
+	else
+		g_free(bil);
+}
+
+static void _pyramid_free(struct _ElevPyramid *pyramid)
+{
+	if (!pyramid)
+		return;
+	g_free(pyramid->buf);
+	g_free(pyramid);
+}
+
+static gboolean _delete_texture_cb(gpointer _opengl)
+{
+	guint opengl = GPOINTER_TO_UINT(_opengl);
+	glDeleteTextures(1, &opengl);
+	return FALSE;
+}
+
+static struct _TileData *_tile_data_ref(struct _TileData *data)
+{
+	g_atomic_int_inc(&data->refs);
+	return data;
+}
+
+static void _tile_data_unref(struct _TileData *data)
+{
+	if (!g_atomic_int_dec_and_test(&data->refs))
+		return;
+	if (data->packed)
+		grits_tile_source_release_data(data->packed, (guint8*)data->bil);
+	else
+		_free_bil(data->bil, data->mapped);
+	_pyramid_free(data->pyramid);
+	/* The last reference may be dropped outside the main thread */
+	if (data->opengl)
+		g_idle_add_full(G_PRIORITY_LOW, _delete_texture_cb,
+				GUINT_TO_POINTER(data->opengl), NULL);
+	g_free(data);
+}
+
+/* Readers announce themselves in the counter for the current epoch. Writers
+ * publish a new index, advance the epoch and wait for the readers of the old
+ * epoch to leave before releasing the old index. Readers never wait. */
+static gint _index_enter(GritsPluginElev *elev)
+{
+	while (TRUE) {
+		gint epoch = g_atomic_int_get(&elev->epoch);
+		g_atomic_int_inc(&elev->readers[epoch & 1]);
+		if (g_atomic_int_get(&elev->epoch) == epoch)
+			return epoch;
+		g_atomic_int_add(&elev->readers[epoch & 1], -1);
+	}
+}
+
+static void _index_leave(GritsPluginElev *elev, gint epoch)
+{
+	g_atomic_int_add(&elev->readers[epoch & 1], -1);
+}
+
+/* Add and/or remove tile data from the index, may be called from any thread */
+static void _index_update(GritsPluginElev *elev,
+		struct _TileData *add, struct _TileData *remove)
+{
+	g_mutex_lock(elev->index_lock);
+	struct _ElevIndex *old = elev->index;
+	guint count = (old ? old->count : 0) + (add ? 1 : 0);
+	struct _ElevIndex *index = g_malloc(sizeof(struct _ElevIndex) +
+			count * sizeof(struct _TileData*));
+	gboolean removed = FALSE;
+	index->count = 0;
+	for (guint i = 0; old && i < old->count; i++) {
+		if (old->data[i] == remove) {
+			removed = TRUE;
+			continue;
+		}
+		if (add && add->level > old->data[i]->level) {
+			index->data[index->count++] = _tile_data_ref(add);
+			add = NULL;
+		}
+		index->data[index->count++] = old->data[i];
+	}
+	if (add)
+		index->data[index->count++] = _tile_data_ref(add);
+
+	g_atomic_pointer_set((gpointer*)&elev->index, index);
+	g_atomic_int_inc(&elev->version);
+	gint epoch = g_atomic_int_get(&elev->epoch);
+	g_atomic_int_inc(&elev->epoch);
+	while (g_atomic_int_get(&elev->readers[epoch & 1]) > 0)
+		g_thread_yield();
+	g_mutex_unlock(elev->index_lock);
+
+	if (removed)
+		_tile_data_unref(remove);
+	g_free(old);
+}
+
+/* Find and reference the most detailed data containing a region */
+static struct _TileData *_index_find(GritsPluginElev *elev,
+		gdouble n, gdouble s, gdouble e, gdouble w)
+{
+	struct _TileData *found = NULL;
+	gint epoch = _index_enter(elev);
+	struct _ElevIndex *index = g_atomic_pointer_get((gpointer*)&elev->index);
+	for (guint i = 0; index && i < index->count; i++) {
+		struct _TileData *data = index->data[i];
+		if (n <= data->edge.n && s >= data->edge.s &&
+		    e <= data->edge.e && w >= data->edge.w) {
+			found = _tile_data_ref(data);
+			break;
+		}
+	}
+	_index_leave(elev, epoch);
+	return found;
+}
+
+/* Height lookups remember the last tile they used since neighbouring samples
+ * almost always fall in the same tile. The sampler holds a reference to the
+ * tile data so it stays valid, and it looks for a better tile whenever the
+ * index version changes. Each thread uses its own sampler. */
+struct _ElevSampler {
+	struct _TileData *data;
+	gint     version;
+	guint16 *bil;
+	gdouble  n, s, e, w;
+	gdouble  xscale, yscale; // pixels per degree
 };
 
+static void _sampler_clear(struct _ElevSampler *sampler)
+{
+	if (sampler->data)
+		_tile_data_unref(sampler->data);
+	sampler->data = NULL;
+	sampler->bil  = NULL;
+}
+
+static void _sampler_free(gpointer _sampler)
+{
+	_sampler_clear(_sampler);
+	g_free(_sampler);
+}
+
+/* Find the tile containing a point, returns FALSE if there is no data */
+static gboolean _sampler_resolve(GritsPluginElev *elev,
+		struct _ElevSampler *sampler, gdouble lat, gdouble lon)
+{
+	gint version = g_atomic_int_get(&elev->version);
+	if (sampler->data && sampler->version == version &&
+	    lat <= sampler->n && lat >= sampler->s &&
+	    lon <= sampler->e && lon >= sampler->w)
+		return TRUE;
+
+	_sampler_clear(sampler);
+	sampler->version = version;
+	struct _TileData *data = _index_find(elev, lat, lat, lon, lon);
+	if (!data)
+		return FALSE;
+	sampler->data   = data;
+	sampler->bil    = data->bil;
+	sampler->n      = data->edge.n;
+	sampler->s      = data->edge.s;
+	sampler->e      = data->edge.e;
+	sampler->w      = data->edge.w;
+	sampler->xscale = TILE_WIDTH  / (data->edge.e - data->edge.w);
+	sampler->yscale = TILE_HEIGHT / (data->edge.n - data->edge.s);
+	return TRUE;
+}
+
+/* Bilinear filter over a run of samples in the current tile. The loop has no
+ * branches so the compiler can vectorize it */
+static void _sampler_filter(struct _ElevSampler *sampler,
+		const gdouble *lats, const gdouble *lons, gdouble *heights, gint count)
+{
+	const gint     w      = TILE_WIDTH;
+	const gint     h      = TILE_HEIGHT;
+	const guint16 *bil    = sampler->bil;
+	const gdouble  north  = sampler->n;
+	const gdouble  west   = sampler->w;
+	const gdouble  xscale = sampler->xscale;
+	const gdouble  yscale = sampler->yscale;
+	for (gint i = 0; i < count; i++) {
+		gdouble x = (lons[i] - west)  * xscale;
+		gdouble y = (north - lats[i]) * yscale;
+		gint x_flr = (gint)x;
+		gint y_flr = (gint)y;
+		gdouble x_rem = x - x_flr;
+		gdouble y_rem = y - y_flr;
+
+		/* TODO: Fix interpolation at edges:
+		 *   - Pad these at the edges instead of wrapping/truncating
+		 *   - Figure out which pixels to index (is 0,0 edge, center, etc) */
+		gint x0 = MIN(x_flr,   w-1), x1 = MIN(x_flr+1, w-1);
+		gint y0 = MIN(y_flr,   h-1), y1 = MIN(y_flr+1, h-1);
+		gint16 px00 = bil[y0*w + x0];
+		gint16 px10 = bil[y0*w + x1];
+		gint16 px01 = bil[y1*w + x0];
+		gint16 px11 = bil[y1*w + x1];
+
+		heights[i] = px00 * (1-x_rem) * (1-y_rem) +
+		             px10 * (  x_rem) * (1-y_rem) +
+		             px01 * (1-x_rem) * (  y_rem) +
+		             px11 * (  x_rem) * (  y_rem);
+	}
+}
+
 static gdouble _height_func(gdouble lat, gdouble lon, gpointer _elev)
 {
 	GritsPluginElev *elev = _elev;
 	if (!elev) return 0;
 
-	GritsTile *tile = grits_tile_find(elev->tiles, lat, lon);
-	if (!tile) return 0;
+	struct _ElevSampler *sampler = g_static_private_get(&elev->sampler);
+	if (!sampler) {
+		sampler = g_new0(struct _ElevSampler, 1);
+		g_static_private_set(&elev->sampler, sampler, _sampler_free);
+	}
+	if (!_sampler_resolve(elev, sampler, lat, lon))
+		return 0;
 
-	struct _TileData *data = tile->data;
-	if (!data) return 0;
+	gdouble height;
+	_sampler_filter(sampler, &lat, &lon, &height, 1);
+	return height;
+}
 
-	guint16 *bil  = data->bil;
-	if (!bil)  return 0;
+/* Resolution of a tile in meters per pixel, measured the same way as when
+ * splitting tiles */
+static gdouble _tile_res(GritsBounds *edge)
+{
+	gdouble lat_point = edge->n < 0 ? edge->n :
+	                    edge->s > 0 ? edge->s : 0;
+	return ll2m(edge->e - edge->w, lat_point) / TILE_WIDTH;
+}
 
-	gint w = TILE_WIDTH;
-	gint h = TILE_HEIGHT;
+/**
+ * grits_plugin_elev_get_heights:
+ * @elev:    the elevation plugin
+ * @lats:    latitudes of the points to sample
+ * @lons:    longitudes of the points to sample
+ * @heights: location to store the height of each point
+ * @count:   the number of points
+ * @res:     the resolution wanted in meters per pixel, or 0 for the most
+ *           detailed data available
+ *
+ * Look up the ground elevation for several points at once. Runs of points
+ * which fall in the same tile are filtered together, so points should be
+ * ordered so that neighbours are next to each other. Points without any
+ * elevation data are given a height of 0. Points without data at @res use the
+ * best data which is loaded, and the tiles they need are loaded in the
+ * background. This can be called from any thread and never blocks while
+ * tiles are being loaded or freed.
+ *
+ * Returns: the number of points without elevation data at @res
+ */
+guint grits_plugin_elev_get_heights(GritsPluginElev *elev,
+		const gdouble *lats, const gdouble *lons,
+		gdouble *heights, guint count, gdouble res)
+{
+	res = MAX(res, MAX_RESOLUTION);
+	struct _ElevSampler sampler_ = {}, *sampler = &sampler_;
+	GArray *wanted = g_array_new(FALSE, FALSE, sizeof(GritsPoint));
+	guint i = 0, missing = 0;
+	while (i < count) {
+		if (!_sampler_resolve(elev, sampler, lats[i], lons[i])) {
+			GritsPoint point = {lats[i], lons[i], 0};
+			g_array_append_val(wanted, point);
+			heights[i++] = 0;
+			missing++;
+			continue;
+		}
+		guint end = i + 1;
+		while (end < count &&
+		       lats[end] <= sampler->n && lats[end] >= sampler->s &&
+		       lons[end] <= sampler->e && lons[end] >= sampler->w)
+			end++;
+		_sampler_filter(sampler, lats+i, lons+i, heights+i, end-i);
+		if (_tile_res(&sampler->data->edge) > res) {
+			for (guint j = i; j < end; j++) {
+				GritsPoint point = {lats[j], lons[j], 0};
+				g_array_append_val(wanted, point);
+			}
+			missing += end - i;
+		}
+		i = end;
+	}
+	_sampler_clear(sampler);
 
-	gdouble ymin  = tile->edge.s;
-	gdouble ymax  = tile->edge.n;
-	gdouble xmin  = tile->edge.w;
-	gdouble xmax  = tile->edge.e;
+	/* Replace any earlier request, callers waiting for data ask again
+	 * until they have it */
+	if (wanted->len > 0) {
+		g_mutex_lock(elev->request_lock);
+		if (elev->requests)
+			g_array_free(elev->requests, TRUE);
+		elev->requests    = wanted;
+		elev->request_res = res;
+		g_mutex_unlock(elev->request_lock);
+		grits_worker_request(elev->worker);
+	} else {
+		g_array_free(wanted, TRUE);
+	}
+	return missing;
+}
 
-	gdouble xdist = xmax - xmin;
-	gdouble ydist = ymax - ymin;
+static guint _heights_func(const gdouble *lats, const gdouble *lons,
+		gdouble *heights, guint count, gdouble res, gpointer _elev)
+{
+	return grits_plugin_elev_get_heights(_elev, lats, lons,
+			heights, count, res);
+}
 
-	gdouble x =    (lon-xmin)/xdist  * w;
-	gdouble y = (1-(lat-ymin)/ydist) * h;
+/******************
+ * Min/max pyramid *
+ ******************/
+/* Allocate a pyramid and set up the pointers to each level */
+static struct _ElevPyramid *_pyramid_new(gchar *buf)
+{
+	struct _ElevPyramid *pyramid = g_new0(struct _ElevPyramid, 1);
+	gint width  = TILE_WIDTH  / PYRAMID_BLOCK;
+	gint height = TILE_HEIGHT / PYRAMID_BLOCK;
+	while (pyramid->levels < PYRAMID_LEVELS) {
+		pyramid->width[pyramid->levels]  = width;
+		pyramid->height[pyramid->levels] = height;
+		pyramid->len += 2 * width * height * sizeof(gint16);
+		pyramid->levels++;
+		if (width == 1 && height == 1)
+			break;
+		width  = MAX(width/2,  1);
+		height = MAX(height/2, 1);
+	}
+	pyramid->buf = buf ?: g_malloc0(sizeof(struct _ElevPyramidHeader) +
+			pyramid->len);
+	gint16 *cur = (gint16*)(pyramid->buf + sizeof(struct _ElevPyramidHeader));
+	for (gint l = 0; l < pyramid->levels; l++) {
+		gint cells = pyramid->width[l] * pyramid->height[l];
+		pyramid->min[l] = cur;
+		pyramid->max[l] = cur + cells;
+		cur += 2 * cells;
+	}
+	return pyramid;
+}
 
-	gdouble x_rem = x - (int)x;
-	gdouble y_rem = y - (int)y;
-	guint x_flr = (int)x;
-	guint y_flr = (int)y;
+/* Build the pyramid from the tile data, each cell also covers the next row
+ * and column of pixels since they are used when interpolating */
+static struct _ElevPyramid *_pyramid_build(guint16 *_bil)
+{
+	gint16 *bil = (gint16*)_bil;
+	struct _ElevPyramid *pyramid = _pyramid_new(NULL);
+	for (gint cy = 0; cy < pyramid->height[0]; cy++)
+	for (gint cx = 0; cx < pyramid->width[0];  cx++) {
+		gint16 min = G_MAXINT16, max = G_MININT16;
+		gint y1 = MIN((cy+1)*PYRAMID_BLOCK, TILE_HEIGHT-1);
+		gint x1 = MIN((cx+1)*PYRAMID_BLOCK, TILE_WIDTH-1);
+		for (gint y = cy*PYRAMID_BLOCK; y <= y1; y++)
+		for (gint x = cx*PYRAMID_BLOCK; x <= x1; x++) {
+			min = MIN(min, bil[y*TILE_WIDTH + x]);
+			max = MAX(max, bil[y*TILE_WIDTH + x]);
+		}
+		pyramid->min[0][cy*pyramid->width[0] + cx] = min;
+		pyramid->max[0][cy*pyramid->width[0] + cx] = max;
+	}
+	for (gint l = 1; l < pyramid->levels; l++) {
+		gint pw = pyramid->width[l-1], ph = pyramid->height[l-1];
+		for (gint cy = 0; cy < pyramid->height[l]; cy++)
+		for (gint cx = 0; cx < pyramid->width[l];  cx++) {
+			gint16 min = G_MAXINT16, max = G_MININT16;
+			for (gint y = cy*2; y < MIN(cy*2+2, ph); y++)
+			for (gint x = cx*2; x < MIN(cx*2+2, pw); x++) {
+				min = MIN(min, pyramid->min[l-1][y*pw + x]);
+				max = MAX(max, pyramid->max[l-1][y*pw + x]);
+			}
+			pyramid->min[l][cy*pyramid->width[l] + cx] = min;
+			pyramid->max[l][cy*pyramid->width[l] + cx] = max;
+		}
+	}
+	return pyramid;
+}
 
-	//if (lon == 180 || lon == -180)
-	//	g_message("lon=%f w=%d min=%f max=%f dist=%f x=%f rem=%f flr=%d",
-	//	           lon,   w,  xmin,  xmax,  xdist,   x, x_rem, x_flr);
+/* Load the pyramid saved in the cache next to the tile, or build and save
+ * it. The saved pyramid is a cache entry of its own so it counts towards the
+ * quota, @path is the file the tile was loaded from. Pyramids for sources
+ * outside the cache are never saved, their directory may be read-only, and
+ * neither are pyramids for tiles read from a pack, which have no @path */
+static struct _ElevPyramid *_pyramid_load(GritsPluginElev *elev,
+		GritsTile *tile, gchar *path, guint16 *bil)
+{
+	struct stat st;
+	if (!elev->source->http || !path || g_stat(path, &st) != 0)
+		return _pyramid_build(bil);
+	struct _ElevPyramidHeader header = {st.st_size, st.st_mtime};
 
-	/* TODO: Fix interpolation at edges:
-	 *   - Pad these at the edges instead of wrapping/truncating
-	 *   - Figure out which pixels to index (is 0,0 edge, center, etc) */
-	gint16 px00 = bil[MIN((y_flr  ),h-1)*w + MIN((x_flr  ),w-1)];
-	gint16 px10 = bil[MIN((y_flr  ),h-1)*w + MIN((x_flr+1),w-1)];
-	gint16 px01 = bil[MIN((y_flr+1),h-1)*w + MIN((x_flr  ),w-1)];
-	gint16 px11 = bil[MIN((y_flr+1),h-1)*w + MIN((x_flr+1),w-1)];
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%sbil.minmax", tilep);
+	gchar *pyramid_path = grits_http_get_cache_path(elev->source->http, local);
+	g_free(tilep);
 
-	return px00 * (1-x_rem) * (1-y_rem) +
-	       px10 * (  x_rem) * (1-y_rem) +
-	       px01 * (1-x_rem) * (  y_rem) +
-	       px11 * (  x_rem) * (  y_rem);
+	gchar *buf = NULL;
+	gsize  len = 0;
+	struct _ElevPyramid *pyramid = NULL;
+	if (g_file_get_contents(pyramid_path, &buf, &len, NULL)) {
+		pyramid = _pyramid_new(buf);
+		if (len != sizeof(header) + pyramid->len ||
+		    memcmp(buf, &header, sizeof(header))) {
+			_pyramid_free(pyramid);
+			pyramid = NULL;
+		} else {
+			grits_cache_manager_access(elev->source->http->prefix,
+					local, TRUE);
+		}
+	}
+	if (!pyramid) {
+		pyramid = _pyramid_build(bil);
+		memcpy(pyramid->buf, &header, sizeof(header));
+		if (!g_file_set_contents(pyramid_path, pyramid->buf,
+					sizeof(header) + pyramid->len, NULL))
+			g_warning("GritsPluginElev: _pyramid_load - "
+					"error saving %s", pyramid_path);
+		else
+			grits_cache_manager_add(elev->source->http->prefix,
+					local, pyramid_path);
+	}
+	g_free(local);
+	g_free(pyramid_path);
+	return pyramid;
+}
+
+/* Min and max over an inclusive range of pixels, uses the finest level where
+ * the range covers no more than a few cells in each direction */
+static void _pyramid_range(struct _ElevPyramid *pyramid,
+		gint x0, gint y0, gint x1, gint y1, gint16 *min, gint16 *max)
+{
+	gint l = 0;
+	while (l < pyramid->levels-1 &&
+	       ((x1-x0) / (PYRAMID_BLOCK<<l) > 4 ||
+	        (y1-y0) / (PYRAMID_BLOCK<<l) > 4))
+		l++;
+	gint w = pyramid->width[l], h = pyramid->height[l];
+	gint cx0 = MIN(x0 / (PYRAMID_BLOCK<<l), w-1);
+	gint cx1 = MIN(x1 / (PYRAMID_BLOCK<<l), w-1);
+	gint cy0 = MIN(y0 / (PYRAMID_BLOCK<<l), h-1);
+	gint cy1 = MIN(y1 / (PYRAMID_BLOCK<<l), h-1);
+	*min = G_MAXINT16;
+	*max = G_MININT16;
+	for (gint cy = cy0; cy <= cy1; cy++)
+	for (gint cx = cx0; cx <= cx1; cx++) {
+		*min = MIN(*min, pyramid->min[l][cy*w + cx]);
+		*max = MAX(*max, pyramid->max[l][cy*w + cx]);
+	}
+}
+
+/* Fold the range of the part of a tile within the bounds into min and max */
+static void _range_fold(struct _TileData *data, GritsBounds *bounds,
+		gint16 *min, gint16 *max)
+{
+	GritsBounds *edge = &data->edge;
+	gdouble xscale = TILE_WIDTH  / (edge->e - edge->w);
+	gdouble yscale = TILE_HEIGHT / (edge->n - edge->s);
+	gint x0 = CLAMP((bounds->w - edge->w) * xscale, 0, TILE_WIDTH-1);
+	gint x1 = CLAMP((bounds->e - edge->w) * xscale, 0, TILE_WIDTH-1);
+	gint y0 = CLAMP((edge->n - bounds->n) * yscale, 0, TILE_HEIGHT-1);
+	gint y1 = CLAMP((edge->n - bounds->s) * yscale, 0, TILE_HEIGHT-1);
+	gint16 lo, hi;
+	_pyramid_range(data->pyramid, x0, y0, x1, y1, &lo, &hi);
+	*min = MIN(*min, lo);
+	*max = MAX(*max, hi);
+}
+
+/**
+ * grits_plugin_elev_get_range:
+ * @elev:   the elevation plugin
+ * @bounds: the region to query
+ * @min:    location to store the lowest elevation in the region
+ * @max:    location to store the highest elevation in the region
+ *
+ * Find bounds on the ground elevation within a region without sampling each
+ * point. The bounds combine the most detailed tile which covers the whole
+ * region with every more detailed tile which covers part of it, so they are
+ * conservative, every height returned by the height function within @bounds
+ * lies between @min and @max. This can be called from any thread.
+ *
+ * Returns: %FALSE if no elevation data is loaded for the region
+ */
+gboolean grits_plugin_elev_get_range(GritsPluginElev *elev,
+		GritsBounds *bounds, gdouble *min, gdouble *max)
+{
+	/* The index is ordered most detailed first, so the tiles before the
+	 * one covering the bounds are the ones which can be more detailed */
+	GPtrArray *found = g_ptr_array_new();
+	gboolean covered = FALSE;
+	gint epoch = _index_enter(elev);
+	struct _ElevIndex *index = g_atomic_pointer_get((gpointer*)&elev->index);
+	for (guint i = 0; index && i < index->count && !covered; i++) {
+		struct _TileData *data = index->data[i];
+		/* Tiles touching the edge are used for points on the edge */
+		if (data->edge.s > bounds->n || data->edge.n < bounds->s ||
+		    data->edge.w > bounds->e || data->edge.e < bounds->w)
+			continue;
+		covered = bounds->n <= data->edge.n && bounds->s >= data->edge.s &&
+		          bounds->e <= data->edge.e && bounds->w >= data->edge.w;
+		g_ptr_array_add(found, _tile_data_ref(data));
+	}
+	_index_leave(elev, epoch);
+
+	gint16 lo = G_MAXINT16, hi = G_MININT16;
+	for (guint i = 0; i < found->len; i++) {
+		struct _TileData *data = g_ptr_array_index(found, i);
+		if (!data->pyramid)
+			covered = FALSE;
+		else if (covered)
+			_range_fold(data, bounds, &lo, &hi);
+		_tile_data_unref(data);
+	}
+	g_ptr_array_free(found, TRUE);
+	if (!covered)
+		return FALSE;
+	*min = lo;
+	*max = hi;
+	return TRUE;
+}
+
+/***********
+ * Overlay *
+ ***********/
+/* Parse a colour ramp of the form "elev:rrggbb,elev:rrggbb,..." into a lookup
+ * table, colours between the listed elevations are interpolated */
+static guchar *_ramp_new(const gchar *spec)
+{
+	gchar **stops = g_strsplit(spec, ",", -1);
+	gint    count = 0;
+	gint    elev[64];
+	guint   rgb[64];
+	for (gint i = 0; stops[i] && count < 64; i++) {
+		if (sscanf(stops[i], "%d:%x", &elev[count], &rgb[count]) != 2) {
+			g_warning("GritsPluginElev: _ramp_new - "
+					"invalid colour stop '%s'", stops[i]);
+			continue;
+		}
+		if (count > 0 && elev[count] <= elev[count-1]) {
+			g_warning("GritsPluginElev: _ramp_new - "
+					"colour stops out of order at '%s'", stops[i]);
+			continue;
+		}
+		count++;
+	}
+	g_strfreev(stops);
+	if (count == 0)
+		return NULL;
+
+	guchar *ramp = g_malloc(RAMP_SIZE*4);
+	for (gint i = 0, stop = 0; i < RAMP_SIZE; i++) {
+		gint value = RAMP_MIN + (i << RAMP_SHIFT);
+		while (stop < count-1 && value >= elev[stop+1])
+			stop++;
+		gdouble frac = stop == count-1 || value <= elev[stop] ? 0 :
+			(gdouble)(value - elev[stop]) / (elev[stop+1] - elev[stop]);
+		for (gint c = 0; c < 3; c++) {
+			gint shift = 16 - c*8;
+			gint lo = (rgb[stop] >> shift) & 0xff;
+			gint hi = (rgb[MIN(stop+1, count-1)] >> shift) & 0xff;
+			ramp[i*4+c] = lo + (hi - lo) * frac;
+		}
+		ramp[i*4+3] = OVERLAY_ALPHA;
+	}
+	return ramp;
+}
+
+/* Colour the tile using the ramp and shade it by the slope of the terrain,
+ * lit from the north west. Each row is processed in passes over plain arrays
+ * so the inner loops can be vectorized. */
+static guchar *_shade_tile(GritsTile *tile, guint16 *_bil, guchar *ramp)
+{
+	gint16 *bil  = (gint16*)_bil;
+	guchar *rgba = g_malloc(TILE_WIDTH*TILE_HEIGHT*4);
+
+	/* Convert height differences between neighbours to slopes */
+	gdouble lat  = (tile->edge.n + tile->edge.s) / 2;
+	gdouble celly = (tile->edge.n - tile->edge.s) / TILE_HEIGHT * 111320;
+	gdouble cellx = (tile->edge.e - tile->edge.w) / TILE_WIDTH  * 111320 *
+		MAX(cos(lat*G_PI/180), 0.01);
+	gfloat  sx = SHADE_SCALE / (2*cellx);
+	gfloat  sy = SHADE_SCALE / (2*celly);
+
+	/* Light direction, from the north west at 45 degrees */
+	const gfloat lx = -0.5, ly = 0.5, lz = 0.7071;
+
+	gfloat  dx[TILE_WIDTH], dy[TILE_WIDTH], shade[TILE_WIDTH];
+	for (gint y = 0; y < TILE_HEIGHT; y++) {
+		const gint16 *row   = bil + y*TILE_WIDTH;
+		const gint16 *above = bil + MAX(y-1, 0)*TILE_WIDTH;
+		const gint16 *below = bil + MIN(y+1, TILE_HEIGHT-1)*TILE_WIDTH;
+		guchar       *out   = rgba + y*TILE_WIDTH*4;
+
+		dx[0] = (row[1] - row[0]) * sx * 2;
+		for (gint x = 1; x < TILE_WIDTH-1; x++)
+			dx[x] = (row[x+1] - row[x-1]) * sx;
+		dx[TILE_WIDTH-1] = (row[TILE_WIDTH-1] - row[TILE_WIDTH-2]) * sx * 2;
+		for (gint x = 0; x < TILE_WIDTH; x++)
+			dy[x] = (above[x] - below[x]) * sy;
+
+		/* The surface normal is (-dx, -dy, 1) before normalizing */
+		for (gint x = 0; x < TILE_WIDTH; x++) {
+			gfloat dot = (lz - lx*dx[x] - ly*dy[x]) /
+				sqrtf(1 + dx[x]*dx[x] + dy[x]*dy[x]);
+			dot = dot < 0 ? 0 : dot;
+			shade[x] = (SHADE_AMBIENT + (1-SHADE_AMBIENT)*dot) * 256;
+		}
+
+		for (gint x = 0; x < TILE_WIDTH; x++) {
+			gint    value = CLAMP(row[x], RAMP_MIN, RAMP_MIN+16383);
+			guchar *color = &ramp[((value-RAMP_MIN) >> RAMP_SHIFT)*4];
+			guint   light = MIN((guint)shade[x], 256);
+			out[x*4+0] = color[0] * light >> 8;
+			out[x*4+1] = color[1] * light >> 8;
+			out[x*4+2] = color[2] * light >> 8;
+			out[x*4+3] = color[3];
+		}
+	}
+	return rgba;
+}
+
+/* Upload the shaded tile, must be called from the main thread */
+static void _load_opengl(struct _TileData *data, guchar *rgba)
+{
+	if (!data->opengl)
+		glGenTextures(1, &data->opengl);
+	glBindTexture(GL_TEXTURE_2D, data->opengl);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, 4, TILE_WIDTH, TILE_HEIGHT, 0,
+			GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	g_debug("GritsPluginElev: load_opengl %d", data->opengl);
+}
+
+struct _ShadeTileData {
+	GritsPluginElev  *elev;
+	struct _TileData *data;
+	guchar           *rgba;
+};
+static gboolean _shade_tile_cb(gpointer _shade)
+{
+	struct _ShadeTileData *shade = _shade;
+	_load_opengl(shade->data, shade->rgba);
+	gtk_widget_queue_draw(GTK_WIDGET(shade->elev->viewer));
+	_tile_data_unref(shade->data);
+	g_free(shade->rgba);
+	g_free(shade);
+	return FALSE;
+}
+
+/* Shade tiles which were loaded while the overlay was hidden, runs in the
+ * worker thread which is also the only place tiles are freed from */
+static void _shade_tiles(GritsPluginElev *elev, GritsTile *tile)
+{
+	struct _TileData *data = tile->data;
+	if (data && data->bil && !data->shaded) {
+		struct _ShadeTileData *shade = g_new0(struct _ShadeTileData, 1);
+		shade->elev   = elev;
+		shade->data   = _tile_data_ref(data);
+		shade->rgba   = _shade_tile(tile, data->bil, elev->ramp);
+		data->shaded  = TRUE;
+		g_idle_add_full(G_PRIORITY_LOW, _shade_tile_cb, shade, NULL);
+	}
+	GritsTile *child;
+	grits_tile_foreach(tile, child)
+		if (child)
+			_shade_tiles(elev, child);
 }
 
 /**********************
  * Loader and Freeers *
  **********************/
 #define LOAD_BIL    TRUE
-#define LOAD_OPENGL FALSE
 struct _LoadTileData {
 	GritsPluginElev    *elev;
 	gchar            *path;
 	GritsTile          *tile;
-	GdkPixbuf        *pixbuf;
+	guchar           *rgba;
 	struct _TileData *data;
 };
-static guint16 *_load_bil(gchar *path)
+
+/* Map the tile read-only so it is shared with the page cache, and fall back
+ * to reading it into memory when it cannot be mapped. Completed cache files
+ * are replaced by renaming, never rewritten, so the mapping stays valid */
+static guint16 *_load_bil(gchar *path, GMappedFile **mapped)
 {
-	gsize len;
+	gsize len = 0;
 	gchar *data = NULL;
-	g_file_get_contents(path, &data, &len, NULL);
-	g_debug("GritsPluginElev: load_bil %p", data);
+	*mapped = g_mapped_file_new(path, FALSE, NULL);
+	if (*mapped) {
+		data = g_mapped_file_get_contents(*mapped);
+		len  = g_mapped_file_get_length(*mapped);
+	} else {
+		g_file_get_contents(path, &data, &len, NULL);
+	}
+	g_debug("GritsPluginElev: load_bil %p%s", data, *mapped ? " (mapped)" : "");
 	if (len != TILE_SIZE) {
 		g_warning("GritsPluginElev: _load_bil - unexpected tile size %ld, != %ld",
 				(glong)len, (glong)TILE_SIZE);
-		g_free(data);
+		_free_bil((guint16*)data, *mapped);
+		*mapped = NULL;
 		return NULL;
 	}
 	return (guint16*)data;
 }
-static GdkPixbuf *_load_pixbuf(guint16 *bil)
-{
-	GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, TILE_WIDTH, TILE_HEIGHT);
-	guchar    *pixels = gdk_pixbuf_get_pixels(pixbuf);
-	gint       stride = gdk_pixbuf_get_rowstride(pixbuf);
-	gint       nchan  = gdk_pixbuf_get_n_channels(pixbuf);
-
-	for (int r = 0; r < TILE_HEIGHT; r++) {
-		for (int c = 0; c < TILE_WIDTH; c++) {
-			gint16 value = bil[r*TILE_WIDTH + c];
-			//guchar color = (float)(MAX(value,0))/8848 * 255;
-			guchar color = (float)value/8848 * 255;
-			pixels[r*stride + c*nchan + 0] = color;
-			pixels[r*stride + c*nchan + 1] = color;
-			pixels[r*stride + c*nchan + 2] = color;
-			if (nchan == 4)
-				pixels[r*stride + c*nchan + 3] = 128;
-		}
+/* Compressed tiles are stored next to the raw tile path */
+static gchar *_delta_local(GritsPluginElev *elev, GritsTile *tile)
+{
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%sbil.delta", tilep);
+	g_free(tilep);
+	return local;
+}
+/* Path to the compressed tile, or NULL for sources outside the cache */
+static gchar *_delta_path(GritsPluginElev *elev, GritsTile *tile)
+{
+	if (!elev->source->http)
+		return NULL;
+	gchar *local = _delta_local(elev, tile);
+	gchar *delta = grits_http_get_cache_path(elev->source->http, local);
+	g_free(local);
+	return delta;
+}
+static guint16 *_load_delta(gchar *path)
+{
+	gsize len;
+	gchar *buf = NULL;
+	if (!g_file_get_contents(path, &buf, &len, NULL))
+		return NULL;
+	guint16 *bil = g_malloc(TILE_SIZE);
+	if (!grits_delta_decode((guint8*)buf, len, (gint16*)bil,
+				TILE_WIDTH, TILE_HEIGHT)) {
+		g_warning("GritsPluginElev: _load_delta - invalid tile %s", path);
+		g_free(bil);
+		bil = NULL;
 	}
-	g_debug("GritsPluginElev: load_pixbuf %p", pixbuf);
-	return pixbuf;
+	g_debug("GritsPluginElev: load_delta %p", bil);
+	g_free(buf);
+	return bil;
 }
-static guint _load_opengl(GdkPixbuf *pixbuf)
+/* Replace the raw tile with a compressed copy */
+static void _save_delta(GritsPluginElev *elev, GritsTile *tile,
+		gchar *path, guint16 *bil)
 {
-	/* Load image */
-	guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
-	gint    alpha  = gdk_pixbuf_get_has_alpha(pixbuf);
-	gint    nchan  = 4; // gdk_pixbuf_get_n_channels(pixbuf);
-	gint    width  = gdk_pixbuf_get_width(pixbuf);
-	gint    height = gdk_pixbuf_get_height(pixbuf);
-
-	/* Create Texture */
-	guint opengl;
-	glGenTextures(1, &opengl);
-	glBindTexture(GL_TEXTURE_2D, opengl);
-
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, nchan, width, height, 0,
-			(alpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, pixels);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-
-	g_debug("GritsPluginElev: load_opengl %d", opengl);
-	return opengl;
+	gsize   len;
+	guint8 *buf   = grits_delta_encode((gint16*)bil,
+			TILE_WIDTH, TILE_HEIGHT, &len);
+	gchar  *local = _delta_local(elev, tile);
+	gchar  *delta = grits_http_get_cache_path(elev->source->http, local);
+	if (g_file_set_contents(delta, (gchar*)buf, len, NULL)) {
+		gchar *raw_local = g_strndup(local, strlen(local)-strlen(".delta"));
+		grits_cache_manager_add(elev->source->http->prefix, local, delta);
+		grits_cache_manager_remove(elev->source->http->prefix, raw_local);
+		g_remove(path);
+		g_free(raw_local);
+	}
+	g_free(buf);
+	g_free(local);
+	g_free(delta);
 }
 static gboolean _load_tile_cb(gpointer _load)
 {
@@ -173,14 +874,16 @@ static gboolean _load_tile_cb(gpointer _load)
 	g_debug("GritsPluginElev: _load_tile_cb: %s", load->path);
 	GritsPluginElev    *elev   = load->elev;
 	GritsTile          *tile   = load->tile;
-	GdkPixbuf        *pixbuf = load->pixbuf;
+	guchar           *rgba   = load->rgba;
 	struct _TileData *data   = load->data;
 	g_free(load->path);
 	g_free(load);
 
-	if (LOAD_OPENGL)
-		data->opengl = _load_opengl(pixbuf);
+	if (rgba)
+		_load_opengl(data, rgba);
 
+	/* Index the data first, the worker may free the tile once it has data */
+	_index_update(elev, data, NULL);
 	tile->data = data;
 
 	/* Do necessasairy processing */
@@ -189,73 +892,265 @@ static gboolean _load_tile_cb(gpointer _load)
 		grits_viewer_set_height_func(elev->viewer, &tile->edge,
 				_height_func, elev, TRUE);
 
-	/* Cleanup unneeded things */
-	if (!LOAD_BIL)
-		g_free(data->bil);
-	if (LOAD_OPENGL)
-		g_object_unref(pixbuf);
+	g_free(rgba);
 
 	return FALSE;
 }
+/* Load a tile from the packed cache, see grits_http_use_pack(). Raw tiles are
+ * used in place, tiles which were compressed before being imported into the
+ * pack are decoded */
+static guint16 *_load_pack(GritsPluginElev *elev, GritsTile *tile,
+		struct _TileData *data)
+{
+	GritsHttp    *http  = elev->source->http;
+	gchar        *local = _delta_local(elev, tile);
+	gsize         len   = 0;
+	const guint8 *buf   = grits_http_get_data(http, local, &len);
+	guint16      *bil   = NULL;
+	if (buf) {
+		bil = g_malloc(TILE_SIZE);
+		if (!grits_delta_decode(buf, len, (gint16*)bil,
+					TILE_WIDTH, TILE_HEIGHT)) {
+			g_warning("GritsPluginElev: _load_pack - invalid tile %s", local);
+			g_free(bil);
+			bil = NULL;
+		}
+		grits_http_release_data(http, buf);
+	} else if ((buf = grits_tile_source_fetch_data(elev->source, tile,
+					GRITS_ONCE, NULL, NULL, &len))) {
+		if (len != TILE_SIZE) {
+			g_warning("GritsPluginElev: _load_pack - unexpected tile size %ld, != %ld",
+					(glong)len, (glong)TILE_SIZE);
+		} else if (GPOINTER_TO_SIZE(buf) % sizeof(guint16)) {
+			/* Files are not aligned within the pack */
+			bil = g_memdup(buf, TILE_SIZE);
+		} else {
+			data->packed = elev->source;
+			bil = (guint16*)buf;
+		}
+		if (!data->packed)
+			grits_tile_source_release_data(elev->source, buf);
+	}
+	g_debug("GritsPluginElev: load_pack %p%s", bil, data->packed ? " (packed)" : "");
+	g_free(local);
+	return bil;
+}
+/* Load a tile from the download cache, or from a source outside the cache */
+static gboolean _load_file(GritsPluginElev *elev, GritsTile *tile,
+		struct _LoadTileData *load)
+{
+	gchar   *delta      = _delta_path(elev, tile);
+	gboolean compressed = FALSE;
+	if (delta) {
+		/* Record the use, the download cache only sees the raw tile */
+		gchar *local = _delta_local(elev, tile);
+		compressed = grits_cache_manager_claim(elev->source->http->prefix,
+				local, delta);
+		g_free(local);
+	}
+	if (compressed) {
+		load->path = g_strndup(delta, strlen(delta)-strlen(".delta"));
+	} else
+		load->path = grits_tile_source_fetch(elev->source, tile,
+				GRITS_ONCE, NULL, NULL);
+	if (!load->path) { // Canceled/error
+		g_free(delta);
+		return FALSE;
+	}
+	g_debug("GritsPluginElev: _load_tile: %s", load->path);
+	if (LOAD_BIL || elev->overlay) {
+		if (compressed)
+			load->data->bil = _load_delta(delta);
+		else
+			load->data->bil = _load_bil(load->path, &load->data->mapped);
+		if (load->data->bil && !compressed && delta && elev->compress)
+			_save_delta(elev, tile, load->path, load->data->bil);
+		if (!load->data->bil) {
+			/* Only remove broken files from the cache */
+			if (elev->source->http)
+				g_remove(compressed ? delta : load->path);
+			g_free(delta);
+			return FALSE;
+		}
+		load->data->pyramid = _pyramid_load(elev, tile,
+				compressed ? delta : load->path, load->data->bil);
+	}
+	g_free(delta);
+	return TRUE;
+}
 static void _load_tile(GritsTile *tile, gpointer _elev)
 {
 	GritsPluginElev *elev = _elev;
+	grits_prefetch_claim(elev->prefetch, tile);
 
 	struct _LoadTileData *load = g_new0(struct _LoadTileData, 1);
-	load->path = grits_wms_fetch(elev->wms, tile, GRITS_ONCE, NULL, NULL);
-	if (!load->path) return; // Canceled/error
-	g_debug("GritsPluginElev: _load_tile: %s", load->path);
 	load->elev = elev;
 	load->tile = tile;
 	load->data = g_new0(struct _TileData, 1);
-	if (LOAD_BIL || LOAD_OPENGL) {
-		load->data->bil = _load_bil(load->path);
-		if (!load->data->bil) {
-			g_remove(load->path);
-			g_free(load->data);
-			g_free(load->path);
-			g_free(load);
-			return;
-		}
+	load->data->refs  = 1;
+	load->data->level = tile->level;
+	load->data->edge  = tile->edge;
+	gboolean ok;
+	if (grits_tile_source_packed(elev->source)) {
+		/* Packed tiles are always loaded, they are used in place */
+		load->path = grits_tile_get_path(tile);
+		load->data->bil = _load_pack(elev, tile, load->data);
+		ok = load->data->bil != NULL;
+		if (ok)
+			load->data->pyramid = _pyramid_load(elev, tile,
+					NULL, load->data->bil);
+	} else {
+		ok = _load_file(elev, tile, load);
 	}
-	if (LOAD_OPENGL) {
-		load->pixbuf = _load_pixbuf(load->data->bil);
+	if (!ok) {
+		g_free(load->data);
+		g_free(load->path);
+		g_free(load);
+		return;
+	}
+	if (elev->overlay && load->data->bil) {
+		load->rgba = _shade_tile(tile, load->data->bil, elev->ramp);
+		load->data->shaded = TRUE;
 	}
 
 	g_idle_add_full(G_PRIORITY_LOW, _load_tile_cb, load, NULL);
 }
 
+static gboolean _prefetch_tile(GritsTile *tile, gpointer _elev)
+{
+	GritsPluginElev *elev = _elev;
+	if (grits_tile_source_packed(elev->source)) {
+		gchar *local = _delta_local(elev, tile);
+		gboolean found = grits_pack_contains(elev->source->http->pack, local);
+		g_free(local);
+		if (found)
+			return TRUE;
+		gsize len;
+		const guint8 *data = grits_tile_source_fetch_data(elev->source,
+				tile, GRITS_ONCE, NULL, NULL, &len);
+		grits_tile_source_release_data(elev->source, data);
+		return data != NULL;
+	}
+	gchar *delta = _delta_path(elev, tile);
+	gchar *path  = delta && g_file_test(delta, G_FILE_TEST_EXISTS) ?
+		g_strdup(delta) : grits_tile_source_fetch(elev->source, tile,
+				GRITS_ONCE, NULL, NULL);
+	g_free(delta);
+	g_free(path);
+	return path != NULL;
+}
+
 static gboolean _free_tile_cb(gpointer _data)
 {
-	struct _TileData *data = _data;
-	if (LOAD_BIL)
-		g_free(data->bil);
-	if (LOAD_OPENGL)
-		glDeleteTextures(1, &data->opengl);
-	g_free(data);
+	_tile_data_unref(_data);
 	return FALSE;
 }
+/* Used once the tiles are no longer drawn, packed tiles must be released
+ * before the source is freed */
+static void _free_tile_now(GritsTile *tile, gpointer _elev)
+{
+	GritsPluginElev *elev = _elev;
+	if (tile->data) {
+		_index_update(elev, NULL, tile->data);
+		_tile_data_unref(tile->data);
+	}
+}
 static void _free_tile(GritsTile *tile, gpointer _elev)
 {
+	GritsPluginElev *elev = _elev;
 	g_debug("GritsPluginElev: _free_tile: %p", tile->data);
-	if (tile->data)
+	if (tile->data) {
+		/* Stop new lookups now, the tile's own reference is dropped
+		 * in the main thread once it can no longer be drawn */
+		_index_update(elev, NULL, tile->data);
 		g_idle_add_full(G_PRIORITY_LOW, _free_tile_cb, tile->data, NULL);
+	}
 }
 
-static gpointer _update_tiles(gpointer _elev)
+/* Split tiles down to the requested resolution at a point, returns the
+ * number of tiles loaded */
+static guint _request_tiles(GritsPluginElev *elev, GritsPoint *point,
+		gdouble res)
+{
+	guint loads = 0;
+	GritsTile *tile = elev->tiles;
+	tile->atime = time(NULL);
+	while (_tile_res(&tile->edge) > res) {
+		const gdouble lat_step = (tile->edge.n - tile->edge.s) / tile->rows;
+		const gdouble lon_step = (tile->edge.e - tile->edge.w) / tile->cols;
+		gint row = CLAMP((tile->edge.n - point->lat) / lat_step, 0, tile->rows-1);
+		gint col = CLAMP((point->lon - tile->edge.w) / lon_step, 0, tile->cols-1);
+		GritsTile **child = &grits_tile_child(tile, row, col);
+		if (!*child) {
+			*child = grits_tile_new(tile,
+					tile->edge.n-(lat_step*(row+0)),
+					tile->edge.n-(lat_step*(row+1)),
+					tile->edge.w+(lon_step*(col+1)),
+					tile->edge.w+(lon_step*(col+0)));
+			GRITS_OBJECT(*child)->hidden = TRUE;
+			_load_tile(*child, elev);
+			loads++;
+		}
+		tile = *child;
+		tile->atime = time(NULL);
+	}
+	return loads;
+}
+
+/* Load the tiles needed by grits_plugin_elev_get_heights(), a few at a time
+ * so tiles around the camera are not held up for long */
+static void _update_requests(GritsPluginElev *elev)
+{
+	g_mutex_lock(elev->request_lock);
+	GArray *requests = elev->requests;
+	gdouble res      = elev->request_res;
+	elev->requests   = NULL;
+	g_mutex_unlock(elev->request_lock);
+	if (!requests)
+		return;
+
+	guint i = 0, loads = 0;
+	while (i < requests->len && loads < REQUEST_LOADS)
+		loads += _request_tiles(elev,
+				&g_array_index(requests, GritsPoint, i++), res);
+
+	/* Keep the rest unless a newer request has replaced it */
+	g_mutex_lock(elev->request_lock);
+	if (i < requests->len && !elev->requests) {
+		g_array_remove_range(requests, 0, i);
+		elev->requests = requests;
+		requests = NULL;
+		grits_worker_request(elev->worker);
+	}
+	g_mutex_unlock(elev->request_lock);
+	if (requests)
+		g_array_free(requests, TRUE);
+}
+
+static void _update_tiles(gpointer _elev)
 {
 	GritsPluginElev *elev = _elev;
-	if (!g_mutex_trylock(elev->mutex))
-		return NULL;
+
+	/* Load the root tile the first time */
+	if (!elev->started) {
+		_load_tile(elev->tiles, elev);
+		elev->started = TRUE;
+	}
+
 	GritsPoint eye;
 	grits_viewer_get_location(elev->viewer, &eye.lat, &eye.lon, &eye.elev);
 	grits_tile_update(elev->tiles, &eye,
 			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH,
 			_load_tile, elev);
+	GritsPoint future;
+	gboolean moving = grits_viewer_predict_location(elev->viewer,
+			elev->prefetch->ahead, &future.lat, &future.lon, &future.elev);
+	grits_prefetch_update(elev->prefetch, &eye, moving ? &future : NULL);
+	_update_requests(elev);
+	if (elev->overlay)
+		_shade_tiles(elev, elev->tiles);
 	grits_tile_gc(elev->tiles, time(NULL)-10,
 			_free_tile, elev);
-	g_mutex_unlock(elev->mutex);
-	return NULL;
 }
 
 /*************
@@ -264,19 +1159,30 @@ static gpointer _update_tiles(gpointer _elev)
 static void _on_location_changed(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elevation, GritsPluginElev *elev)
 {
-	g_thread_create(_update_tiles, elev, FALSE, NULL);
-}
-
-static gpointer _threaded_init(GritsPluginElev *elev)
-{
-	_load_tile(elev->tiles, elev);
-	_update_tiles(elev);
-	return NULL;
+	grits_worker_request(elev->worker);
 }
 
 /***********
  * Methods *
  ***********/
+/**
+ * grits_plugin_elev_set_overlay:
+ * @elev:    the elevation plugin
+ * @enabled: %TRUE to draw the elevation overlay
+ *
+ * Show or hide a shaded relief map of the elevation data on top of the
+ * ground. Tiles are shaded in the background the first time the overlay is
+ * shown, hiding it again keeps the shaded tiles so it can be toggled quickly.
+ */
+void grits_plugin_elev_set_overlay(GritsPluginElev *elev, gboolean enabled)
+{
+	elev->overlay = enabled;
+	grits_object_hide(GRITS_OBJECT(elev->tiles), !enabled);
+	if (enabled)
+		grits_worker_request(elev->worker);
+	gtk_widget_queue_draw(GTK_WIDGET(elev->viewer));
+}
+
 /**
  * grits_plugin_elev_new:
  * @viewer: the #GritsViewer to use for drawing
@@ -291,16 +1197,62 @@ GritsPluginElev *grits_plugin_elev_new(GritsViewer *viewer)
 	GritsPluginElev *elev = g_object_new(GRITS_TYPE_PLUGIN_ELEV, NULL);
 	elev->viewer = g_object_ref(viewer);
 
+	/* Use offline elevation data if it is configured */
+	gchar *source = viewer->prefs ?
+		grits_prefs_get_string(viewer->prefs, "elev/source", NULL) : NULL;
+	if (source && g_str_equal(source, "fractal")) {
+		gint   seed   = grits_prefs_get_integer(viewer->prefs, "elev/seed", NULL);
+		gchar *prefix = g_strdup_printf("fractal-%d/", seed);
+		grits_tile_source_free(elev->source);
+		elev->source = grits_tile_source_new_fractal(prefix,
+				TILE_WIDTH, TILE_HEIGHT, seed);
+		g_free(prefix);
+	} else if (source && g_str_equal(source, "local")) {
+		gchar *dir = grits_prefs_get_string(viewer->prefs, "elev/dir", NULL);
+		if (dir) {
+			grits_tile_source_free(elev->source);
+			elev->source = grits_tile_source_new_local(dir, "bil");
+			g_free(dir);
+		} else {
+			g_warning("GritsPluginElev: new - elev/dir is not set");
+		}
+	} else if (source && !g_str_equal(source, "wms")) {
+		g_warning("GritsPluginElev: new - unknown source %s", source);
+	}
+	g_free(source);
+
+	/* Store downloaded tiles compressed */
+	elev->compress = viewer->prefs &&
+		grits_prefs_get_boolean(viewer->prefs, "elev/compress", NULL);
+
 	/* Load initial tiles */
-	g_thread_create((GThreadFunc)_threaded_init, elev, FALSE, NULL);
+	elev->worker = grits_worker_new(_update_tiles, elev);
+	grits_worker_request(elev->worker);
 
 	/* Connect signals */
 	elev->sigid = g_signal_connect(elev->viewer, "location-changed",
 			G_CALLBACK(_on_location_changed), elev);
+	if (LOAD_BIL)
+		grits_viewer_add_heights_func(viewer, _heights_func, elev);
+
+	/* Colour ramp for the overlay */
+	gchar *ramp = viewer->prefs ?
+		grits_prefs_get_string(viewer->prefs, "elev/ramp", NULL) : NULL;
+	if (ramp) {
+		guchar *lut = _ramp_new(ramp);
+		if (lut) {
+			g_free(elev->ramp);
+			elev->ramp = lut;
+		}
+		g_free(ramp);
+	}
 
 	/* Add renderers */
-	if (LOAD_OPENGL)
-		grits_viewer_add(viewer, GRITS_OBJECT(elev->tiles), GRITS_LEVEL_WORLD, 0);
+	grits_object_hide(GRITS_OBJECT(elev->tiles), TRUE);
+	grits_viewer_add(viewer, GRITS_OBJECT(elev->tiles), GRITS_LEVEL_WORLD+1, FALSE);
+	if (viewer->prefs &&
+	    grits_prefs_get_boolean(viewer->prefs, "elev/overlay", NULL))
+		grits_plugin_elev_set_overlay(elev, TRUE);
 
 	return elev;
 }
@@ -324,11 +1276,20 @@ static void grits_plugin_elev_init(GritsPluginElev *elev)
 {
 	g_debug("GritsPluginElev: init");
 	/* Set defaults */
-	elev->mutex = g_mutex_new();
+	g_static_private_init(&elev->sampler);
+	elev->index_lock = g_mutex_new();
+	elev->request_lock = g_mutex_new();
+	elev->ramp    = _ramp_new(RAMP_DEFAULT);
 	elev->tiles = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
-	elev->wms   = grits_wms_new(
+	g_object_ref(elev->tiles);
+	GritsWms *wms = grits_wms_new(
 		"http://www.nasa.network.com/elev", "mergedSrtm", "application/bil",
 		"srtm/", "bil", TILE_WIDTH, TILE_HEIGHT);
+	grits_wms_set_metatile(wms, TRUE);
+	grits_http_find_pack(wms->http);
+	elev->source = grits_tile_source_new_wms(wms);
+	elev->prefetch = grits_prefetch_new(elev->tiles, PREFETCH_AHEAD,
+			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH, _prefetch_tile, elev);
 }
 static void grits_plugin_elev_dispose(GObject *gobject)
 {
@@ -336,11 +1297,21 @@ static void grits_plugin_elev_dispose(GObject *gobject)
 	GritsPluginElev *elev = GRITS_PLUGIN_ELEV(gobject);
 	/* Drop references */
 	if (elev->viewer) {
-		if (LOAD_BIL)
-			grits_viewer_clear_height_func(elev->viewer);
-		if (LOAD_OPENGL)
-			grits_viewer_remove(elev->viewer, GRITS_OBJECT(elev->tiles));
 		g_signal_handler_disconnect(elev->viewer, elev->sigid);
+		grits_tile_source_abort(elev->source);
+		grits_worker_free(elev->worker);
+		grits_prefetch_free(elev->prefetch);
+		elev->prefetch = NULL;
+		/* Loaded and shaded tiles are finished from idle callbacks
+		 * which use the viewer */
+		while (gtk_events_pending())
+			gtk_main_iteration();
+		if (LOAD_BIL) {
+			grits_viewer_clear_height_func(elev->viewer);
+			grits_viewer_remove_heights_func(elev->viewer,
+					_heights_func, elev);
+		}
+		grits_viewer_remove(elev->viewer, GRITS_OBJECT(elev->tiles));
 		g_object_unref(elev->viewer);
 		elev->viewer = NULL;
 	}
@@ -351,11 +1322,17 @@ static void grits_plugin_elev_finalize(GObject *gobject)
 	g_debug("GritsPluginElev: finalize");
 	GritsPluginElev *elev = GRITS_PLUGIN_ELEV(gobject);
 	/* Free data */
-	grits_tile_free(elev->tiles, _free_tile, elev);
-	grits_wms_free(elev->wms);
-	g_mutex_lock(elev->mutex);
-	g_mutex_unlock(elev->mutex);
-	g_mutex_free(elev->mutex);
+	if (elev->prefetch)
+		grits_prefetch_free(elev->prefetch);
+	grits_tile_free(elev->tiles, _free_tile_now, elev);
+	grits_tile_source_free(elev->source);
+	g_static_private_free(&elev->sampler);
+	g_free(elev->index);
+	g_mutex_free(elev->index_lock);
+	g_mutex_free(elev->request_lock);
+	if (elev->requests)
+		g_array_free(elev->requests, TRUE);
+	g_free(elev->ramp);
 	G_OBJECT_CLASS(grits_plugin_elev_parent_class)->finalize(gobject);
 
 }
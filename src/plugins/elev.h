@@ -30,15 +30,31 @@
 typedef struct _GritsPluginElev      GritsPluginElev;
 typedef struct _GritsPluginElevClass GritsPluginElevClass;
 
+struct _ElevIndex;
+
 struct _GritsPluginElev {
 	GObject parent_instance;
 
 	/* instance members */
 	GritsViewer *viewer;
 	GritsTile   *tiles;
-	GritsWms    *wms;
-	GMutex      *mutex;
+	GritsTileSource *source;
+	GritsPrefetch *prefetch;
+	GritsWorker *worker;
+	gboolean     started;
+	gboolean     compress;
+	gboolean     overlay;
+	guchar      *ramp;
 	gulong       sigid;
+	GStaticPrivate sampler;
+	struct _ElevIndex *index;
+	GMutex      *index_lock;
+	gint         epoch;
+	gint         readers[2];
+	gint         version;
+	GMutex      *request_lock;
+	GArray      *requests;
+	gdouble      request_res;
 };
 
 struct _GritsPluginElevClass {
@@ -50,4 +66,13 @@ GType grits_plugin_elev_get_type();
 /* Methods */
 GritsPluginElev *grits_plugin_elev_new(GritsViewer *viewer);
 
+void grits_plugin_elev_set_overlay(GritsPluginElev *elev, gboolean enabled);
+
+guint grits_plugin_elev_get_heights(GritsPluginElev *elev,
+		const gdouble *lats, const gdouble *lons,
+		gdouble *heights, guint count, gdouble res);
+
+gboolean grits_plugin_elev_get_range(GritsPluginElev *elev,
+		GritsBounds *bounds, gdouble *min, gdouble *max);
+
 #endif
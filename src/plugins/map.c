@@ -33,6 +33,7 @@
 #define MAX_RESOLUTION 100
 #define TILE_WIDTH     1024
 #define TILE_HEIGHT    512
+#define PREFETCH_AHEAD 1.0 // seconds
 
 static const guchar colormap[][2][4] = {
 	{{0x73, 0x91, 0xad}, {0x73, 0x91, 0xad, 0x00}}, // Oceans
@@ -55,21 +56,11 @@ static gboolean _load_tile_cb(gpointer _data)
 	struct _LoadTileData *data = _data;
 	g_debug("GritsPluginMap: _load_tile_cb start");
 
-	guint *tex = g_new0(guint, 1);
-	glGenTextures(1, tex);
-	glBindTexture(GL_TEXTURE_2D, *tex);
+	GritsTextureSlot *slot = grits_texture_pool_upload(data->map->pool,
+			data->pixels, data->alpha, data->width, data->height);
+	if (slot)
+		grits_texture_pool_set_tile(slot, data->tile);
 
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, 4, data->width, data->height, 0,
-			(data->alpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, data->pixels);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glFlush();
-
-	data->tile->data = tex;
 	gtk_widget_queue_draw(GTK_WIDGET(data->map->viewer));
 	g_free(data->pixels);
 	g_free(data);
@@ -84,9 +75,11 @@ static void _load_tile(GritsTile *tile, gpointer _map)
 		g_debug("GritsPluginMap: _load_tile - aborted");
 		return;
 	}
+	grits_prefetch_claim(map->prefetch, tile);
 
 	/* Download tile */
-	gchar *path = grits_wms_fetch(map->wms, tile, GRITS_ONCE, NULL, NULL);
+	gchar *path = grits_tile_source_fetch(map->source, tile,
+			GRITS_ONCE, NULL, NULL);
 	if (!path) return; // Canceled/error
 
 	/* Load pixbuf */
@@ -99,42 +92,39 @@ static void _load_tile(GritsTile *tile, gpointer _map)
 	}
 	g_free(path);
 
-	/* Copy pixbuf data for callback */
+	/* Map texture colors into a copy of the pixbuf data for the callback */
 	struct _LoadTileData *data = g_new0(struct _LoadTileData, 1);
 	data->map    = map;
 	data->tile   = tile;
-	data->pixels = gdk_pixbuf_get_pixels(pixbuf);
-	data->alpha  = gdk_pixbuf_get_has_alpha(pixbuf);
+	data->alpha  = TRUE;
 	data->width  = gdk_pixbuf_get_width(pixbuf);
 	data->height = gdk_pixbuf_get_height(pixbuf);
-	data->pixels = g_memdup(data->pixels,
-			data->width * data->height * (data->alpha ? 4 : 3));
+	data->pixels = grits_colormap_apply(map->colormap,
+			gdk_pixbuf_get_pixels(pixbuf),
+			data->width, data->height,
+			gdk_pixbuf_get_rowstride(pixbuf),
+			gdk_pixbuf_get_n_channels(pixbuf));
 	g_object_unref(pixbuf);
 
-	/* Map texture colors, if needed */
-	for (int i = 0; i < data->width * data->height; i++) {
-		for (int j = 0; j < G_N_ELEMENTS(colormap); j++) {
-			if (data->pixels[i*4+0] == colormap[j][0][0] &&
-			    data->pixels[i*4+1] == colormap[j][0][1] &&
-			    data->pixels[i*4+2] == colormap[j][0][2]) {
-				data->pixels[i*4+0] = colormap[j][1][0];
-				data->pixels[i*4+1] = colormap[j][1][1];
-				data->pixels[i*4+2] = colormap[j][1][2];
-				data->pixels[i*4+3] = colormap[j][1][3];
-				break;
-			}
-		}
-	}
-
 	/* Load the GL texture from the main thread */
 	g_idle_add_full(G_PRIORITY_LOW, _load_tile_cb, data, NULL);
 	g_debug("GritsPluginMap: _load_tile end %p", g_thread_self());
 }
 
-static gboolean _free_tile_cb(gpointer data)
+static gboolean _prefetch_tile(GritsTile *tile, gpointer _map)
 {
-	glDeleteTextures(1, data);
-	g_free(data);
+	GritsPluginMap *map = _map;
+	if (map->aborted)
+		return FALSE;
+	gchar *path = grits_tile_source_fetch(map->source, tile,
+			GRITS_ONCE, NULL, NULL);
+	g_free(path);
+	return path != NULL;
+}
+
+static gboolean _free_tile_cb(gpointer slot)
+{
+	grits_texture_pool_release(slot);
 	return FALSE;
 }
 static void _free_tile(GritsTile *tile, gpointer _map)
@@ -144,7 +134,7 @@ static void _free_tile(GritsTile *tile, gpointer _map)
 		g_idle_add_full(G_PRIORITY_LOW, _free_tile_cb, tile->data, NULL);
 }
 
-static void _update_tiles(gpointer _, gpointer _map)
+static void _update_tiles(gpointer _map)
 {
 	g_debug("GritsPluginMap: _update_tiles");
 	GritsPluginMap *map = _map;
@@ -153,6 +143,10 @@ static void _update_tiles(gpointer _, gpointer _map)
 	grits_tile_update(map->tiles, &eye,
 			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH,
 			_load_tile, map);
+	GritsPoint future;
+	gboolean moving = grits_viewer_predict_location(map->viewer,
+			map->prefetch->ahead, &future.lat, &future.lon, &future.elev);
+	grits_prefetch_update(map->prefetch, &eye, moving ? &future : NULL);
 	grits_tile_gc(map->tiles, time(NULL)-10,
 			_free_tile, map);
 }
@@ -163,7 +157,7 @@ static void _update_tiles(gpointer _, gpointer _map)
 static void _on_location_changed(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elev, GritsPluginMap *map)
 {
-	g_thread_pool_push(map->threads, NULL+1, NULL);
+	grits_worker_request(map->worker);
 }
 
 /***********
@@ -183,9 +177,20 @@ GritsPluginMap *grits_plugin_map_new(GritsViewer *viewer)
 	GritsPluginMap *map = g_object_new(GRITS_TYPE_PLUGIN_MAP, NULL);
 	map->viewer = g_object_ref(viewer);
 
+	/* Use a slippy map server instead of WMS if one is configured */
+	gchar *xyz = viewer->prefs ?
+		grits_prefs_get_string(viewer->prefs, "map/xyz", NULL) : NULL;
+	if (xyz) {
+		gint zoom = grits_prefs_get_integer(viewer->prefs, "map/xyz_zoom", NULL);
+		grits_tile_source_free(map->source);
+		map->source = grits_tile_source_new_xyz(xyz, "osm-xyz/", "png",
+				TILE_WIDTH, TILE_HEIGHT, zoom > 0 ? zoom : 18);
+		g_free(xyz);
+	}
+
 	/* Load initial tiles */
 	_load_tile(map->tiles, map);
-	_update_tiles(NULL, map);
+	_update_tiles(map);
 
 	/* Connect signals */
 	map->sigid = g_signal_connect(map->viewer, "location-changed",
@@ -216,12 +221,18 @@ static void grits_plugin_map_init(GritsPluginMap *map)
 {
 	g_debug("GritsPluginMap: init");
 	/* Set defaults */
-	map->threads = g_thread_pool_new(_update_tiles, map, 1, FALSE, NULL);
+	map->worker  = grits_worker_new(_update_tiles, map);
 	map->tiles = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
-	map->wms   = grits_wms_new(
+	GritsWms *wms = grits_wms_new(
 		"http://vmap0.tiles.osgeo.org/wms/vmap0",
 		"basic,priroad,secroad,depthcontour,clabel,statelabel",
 		 "image/png", "osm/", "png", TILE_WIDTH, TILE_HEIGHT);
+	grits_wms_set_metatile(wms, TRUE);
+	map->source = grits_tile_source_new_wms(wms);
+	map->pool  = grits_texture_pool_new(TILE_WIDTH, TILE_HEIGHT);
+	map->colormap = grits_colormap_new(colormap, G_N_ELEMENTS(colormap));
+	map->prefetch = grits_prefetch_new(map->tiles, PREFETCH_AHEAD,
+			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH, _prefetch_tile, map);
 	g_object_ref(map->tiles);
 }
 static void grits_plugin_map_dispose(GObject *gobject)
@@ -233,8 +244,9 @@ static void grits_plugin_map_dispose(GObject *gobject)
 	if (map->viewer) {
 		g_signal_handler_disconnect(map->viewer, map->sigid);
 		grits_viewer_remove(map->viewer, GRITS_OBJECT(map->tiles));
-		soup_session_abort(map->wms->http->soup);
-		g_thread_pool_free(map->threads, TRUE, TRUE);
+		grits_tile_source_abort(map->source);
+		grits_worker_free(map->worker);
+		grits_prefetch_free(map->prefetch);
 		while (gtk_events_pending())
 			gtk_main_iteration();
 		g_object_unref(map->viewer);
@@ -247,8 +259,10 @@ static void grits_plugin_map_finalize(GObject *gobject)
 	g_debug("GritsPluginMap: finalize");
 	GritsPluginMap *map = GRITS_PLUGIN_MAP(gobject);
 	/* Free data */
-	grits_wms_free(map->wms);
+	grits_tile_source_free(map->source);
 	grits_tile_free(map->tiles, _free_tile, map);
+	grits_texture_pool_free(map->pool);
+	grits_colormap_free(map->colormap);
 	G_OBJECT_CLASS(grits_plugin_map_parent_class)->finalize(gobject);
 
 }
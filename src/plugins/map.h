@@ -36,8 +36,11 @@ struct _GritsPluginMap {
 	/* instance members */
 	GritsViewer *viewer;
 	GritsTile   *tiles;
-	GritsWms    *wms;
-	GThreadPool *threads;
+	GritsTileSource *source;
+	GritsPrefetch *prefetch;
+	GritsTexturePool *pool;
+	GritsColormap *colormap;
+	GritsWorker *worker;
 	gulong       sigid;
 	gboolean     aborted;
 };
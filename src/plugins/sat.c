@@ -33,6 +33,7 @@
 #define MAX_RESOLUTION 500
 #define TILE_WIDTH     1024
 #define TILE_HEIGHT    512
+#define PREFETCH_AHEAD 1.0 // seconds
 
 struct _LoadTileData {
 	GritsPluginSat *sat;
@@ -47,49 +48,72 @@ static gboolean _load_tile_cb(gpointer _data)
 	struct _LoadTileData *data = _data;
 	g_debug("GritsPluginSat: _load_tile_cb start");
 
-	guint *tex = g_new0(guint, 1);
-	glGenTextures(1, tex);
-	glBindTexture(GL_TEXTURE_2D, *tex);
-
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, 4, data->width, data->height, 0,
-			(data->alpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, data->pixels);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glFlush();
-
-	data->tile->data = tex;
+	GritsTextureSlot *slot = grits_texture_pool_upload(data->sat->pool,
+			data->pixels, data->alpha, data->width, data->height);
+	if (slot)
+		grits_texture_pool_set_tile(slot, data->tile);
+
 	gtk_widget_queue_draw(GTK_WIDGET(data->sat->viewer));
 	g_free(data->pixels);
 	g_free(data);
 	return FALSE;
 }
 
-static void _load_tile(GritsTile *tile, gpointer _sat)
+/* Decode a tile straight from the packed cache */
+static GdkPixbuf *_load_pixbuf_packed(GritsPluginSat *sat, GritsTile *tile)
 {
-	GritsPluginSat *sat = _sat;
-	g_debug("GritsPluginSat: _load_tile start %p", g_thread_self());
-	if (sat->aborted) {
-		g_debug("GritsPluginSat: _load_tile - aborted");
-		return;
+	gsize len = 0;
+	const guint8 *data = grits_tile_source_fetch_data(sat->source, tile,
+			GRITS_ONCE, NULL, NULL, &len);
+	if (!data) return NULL; // Canceled/error
+
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+	gboolean ok = gdk_pixbuf_loader_write(loader, data, len, NULL);
+	ok = gdk_pixbuf_loader_close(loader, NULL) && ok;
+	GdkPixbuf *pixbuf = ok ? gdk_pixbuf_loader_get_pixbuf(loader) : NULL;
+	if (pixbuf) {
+		g_object_ref(pixbuf);
+	} else {
+		gchar *tilep = grits_tile_get_path(tile);
+		g_warning("GritsPluginSat: _load_tile - "
+				"Error loading packed pixbuf %s", tilep);
+		g_free(tilep);
 	}
+	g_object_unref(loader);
+	grits_tile_source_release_data(sat->source, data);
+	return pixbuf;
+}
 
-	/* Download tile */
-	gchar *path = grits_wms_fetch(sat->wms, tile, GRITS_ONCE, NULL, NULL);
-	if (!path) return; // Canceled/error
+/* Decode a tile from the download cache */
+static GdkPixbuf *_load_pixbuf_file(GritsPluginSat *sat, GritsTile *tile)
+{
+	gchar *path = grits_tile_source_fetch(sat->source, tile,
+			GRITS_ONCE, NULL, NULL);
+	if (!path) return NULL; // Canceled/error
 
-	/* Load pixbuf */
 	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, NULL);
 	if (!pixbuf) {
 		g_warning("GritsPluginSat: _load_tile - Error loading pixbuf %s", path);
 		g_remove(path);
-		g_free(path);
-		return;
 	}
 	g_free(path);
+	return pixbuf;
+}
+
+static void _load_tile(GritsTile *tile, gpointer _sat)
+{
+	GritsPluginSat *sat = _sat;
+	g_debug("GritsPluginSat: _load_tile start %p", g_thread_self());
+	if (sat->aborted) {
+		g_debug("GritsPluginSat: _load_tile - aborted");
+		return;
+	}
+	grits_prefetch_claim(sat->prefetch, tile);
+
+	/* Download tile and load pixbuf */
+	GdkPixbuf *pixbuf = grits_tile_source_packed(sat->source) ?
+		_load_pixbuf_packed(sat, tile) : _load_pixbuf_file(sat, tile);
+	if (!pixbuf) return;
 
 	/* Copy pixbuf data for callback */
 	struct _LoadTileData *data = g_new0(struct _LoadTileData, 1);
@@ -120,10 +144,27 @@ static void _load_tile(GritsTile *tile, gpointer _sat)
 	g_debug("GritsPluginSat: _load_tile end %p", g_thread_self());
 }
 
-static gboolean _free_tile_cb(gpointer data)
+static gboolean _prefetch_tile(GritsTile *tile, gpointer _sat)
 {
-	glDeleteTextures(1, data);
-	g_free(data);
+	GritsPluginSat *sat = _sat;
+	if (sat->aborted)
+		return FALSE;
+	if (grits_tile_source_packed(sat->source)) {
+		gsize len;
+		const guint8 *data = grits_tile_source_fetch_data(sat->source,
+				tile, GRITS_ONCE, NULL, NULL, &len);
+		grits_tile_source_release_data(sat->source, data);
+		return data != NULL;
+	}
+	gchar *path = grits_tile_source_fetch(sat->source, tile,
+			GRITS_ONCE, NULL, NULL);
+	g_free(path);
+	return path != NULL;
+}
+
+static gboolean _free_tile_cb(gpointer slot)
+{
+	grits_texture_pool_release(slot);
 	return FALSE;
 }
 static void _free_tile(GritsTile *tile, gpointer _sat)
@@ -133,7 +174,7 @@ static void _free_tile(GritsTile *tile, gpointer _sat)
 		g_idle_add_full(G_PRIORITY_LOW, _free_tile_cb, tile->data, NULL);
 }
 
-static void _update_tiles(gpointer _, gpointer _sat)
+static void _update_tiles(gpointer _sat)
 {
 	g_debug("GritsPluginSat: _update_tiles");
 	GritsPluginSat *sat = _sat;
@@ -142,6 +183,10 @@ static void _update_tiles(gpointer _, gpointer _sat)
 	grits_tile_update(sat->tiles, &eye,
 			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH,
 			_load_tile, sat);
+	GritsPoint future;
+	gboolean moving = grits_viewer_predict_location(sat->viewer,
+			sat->prefetch->ahead, &future.lat, &future.lon, &future.elev);
+	grits_prefetch_update(sat->prefetch, &eye, moving ? &future : NULL);
 	grits_tile_gc(sat->tiles, time(NULL)-10,
 			_free_tile, sat);
 }
@@ -152,7 +197,7 @@ static void _update_tiles(gpointer _, gpointer _sat)
 static void _on_location_changed(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elev, GritsPluginSat *sat)
 {
-	g_thread_pool_push(sat->threads, NULL+1, NULL);
+	grits_worker_request(sat->worker);
 }
 
 /***********
@@ -172,9 +217,20 @@ GritsPluginSat *grits_plugin_sat_new(GritsViewer *viewer)
 	GritsPluginSat *sat = g_object_new(GRITS_TYPE_PLUGIN_SAT, NULL);
 	sat->viewer = g_object_ref(viewer);
 
+	/* Use a slippy map server instead of WMS if one is configured */
+	gchar *xyz = viewer->prefs ?
+		grits_prefs_get_string(viewer->prefs, "sat/xyz", NULL) : NULL;
+	if (xyz) {
+		gint zoom = grits_prefs_get_integer(viewer->prefs, "sat/xyz_zoom", NULL);
+		grits_tile_source_free(sat->source);
+		sat->source = grits_tile_source_new_xyz(xyz, "bmng-xyz/", "jpg",
+				TILE_WIDTH, TILE_HEIGHT, zoom > 0 ? zoom : 18);
+		g_free(xyz);
+	}
+
 	/* Load initial tiles */
 	_load_tile(sat->tiles, sat);
-	_update_tiles(NULL, sat);
+	_update_tiles(sat);
 
 	/* Connect signals */
 	sat->sigid = g_signal_connect(sat->viewer, "location-changed",
@@ -205,11 +261,17 @@ static void grits_plugin_sat_init(GritsPluginSat *sat)
 {
 	g_debug("GritsPluginSat: init");
 	/* Set defaults */
-	sat->threads = g_thread_pool_new(_update_tiles, sat, 1, FALSE, NULL);
+	sat->worker  = grits_worker_new(_update_tiles, sat);
 	sat->tiles = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
-	sat->wms   = grits_wms_new(
+	GritsWms *wms = grits_wms_new(
 		"http://www.nasa.network.com/wms", "bmng200406", "image/jpeg",
 		"bmng/", "jpg", TILE_WIDTH, TILE_HEIGHT);
+	grits_wms_set_metatile(wms, TRUE);
+	grits_http_find_pack(wms->http);
+	sat->source = grits_tile_source_new_wms(wms);
+	sat->pool  = grits_texture_pool_new(TILE_WIDTH, TILE_HEIGHT);
+	sat->prefetch = grits_prefetch_new(sat->tiles, PREFETCH_AHEAD,
+			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH, _prefetch_tile, sat);
 	g_object_ref(sat->tiles);
 }
 static void grits_plugin_sat_dispose(GObject *gobject)
@@ -221,8 +283,9 @@ static void grits_plugin_sat_dispose(GObject *gobject)
 	if (sat->viewer) {
 		g_signal_handler_disconnect(sat->viewer, sat->sigid);
 		grits_viewer_remove(sat->viewer, GRITS_OBJECT(sat->tiles));
-		soup_session_abort(sat->wms->http->soup);
-		g_thread_pool_free(sat->threads, TRUE, TRUE);
+		grits_tile_source_abort(sat->source);
+		grits_worker_free(sat->worker);
+		grits_prefetch_free(sat->prefetch);
 		while (gtk_events_pending())
 			gtk_main_iteration();
 		g_object_unref(sat->viewer);
@@ -235,8 +298,9 @@ static void grits_plugin_sat_finalize(GObject *gobject)
 	g_debug("GritsPluginSat: finalize");
 	GritsPluginSat *sat = GRITS_PLUGIN_SAT(gobject);
 	/* Free data */
-	grits_wms_free(sat->wms);
+	grits_tile_source_free(sat->source);
 	grits_tile_free(sat->tiles, _free_tile, sat);
+	grits_texture_pool_free(sat->pool);
 	G_OBJECT_CLASS(grits_plugin_sat_parent_class)->finalize(gobject);
 
 }
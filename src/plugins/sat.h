@@ -36,8 +36,10 @@ struct _GritsPluginSat {
 	/* instance members */
 	GritsViewer *viewer;
 	GritsTile   *tiles;
-	GritsWms    *wms;
-	GThreadPool *threads;
+	GritsTileSource *source;
+	GritsPrefetch *prefetch;
+	GritsTexturePool *pool;
+	GritsWorker *worker;
 	gulong       sigid;
 	gboolean     aborted;
 };
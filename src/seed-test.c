@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Test for `grits-cache seed` and `import` using a local stand-in for the WMS
+ * servers.
+ * Run from the build directory, or with the path to grits-cache. Each case
+ * uses its own cache directory which is removed afterwards */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <libsoup/soup.h>
+
+static gint       requests;
+static GMainLoop *loop;
+static gint       status;
+
+/* Answer GetMap requests with a blank image of the requested size */
+static void serve_wms(SoupServer *server, SoupMessage *msg, const char *path,
+		GHashTable *query, SoupClientContext *client, gpointer data)
+{
+	const gchar *format = query ? g_hash_table_lookup(query, "FORMAT") : NULL;
+	const gchar *width  = query ? g_hash_table_lookup(query, "WIDTH")  : NULL;
+	const gchar *height = query ? g_hash_table_lookup(query, "HEIGHT") : NULL;
+	if (!format || !width || !height) {
+		soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+	gint   w   = atoi(width);
+	gint   h   = atoi(height);
+	gchar *buf = NULL;
+	gsize  len = 0;
+	if (g_str_equal(format, "application/bil")) {
+		len = w * h * sizeof(gint16);
+		buf = g_malloc0(len);
+	} else {
+		GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+				FALSE, 8, w, h);
+		gdk_pixbuf_fill(pixbuf, 0x336699ff);
+		gdk_pixbuf_save_to_buffer(pixbuf, &buf, &len,
+				g_str_equal(format, "image/png") ? "png" : "jpeg",
+				NULL, NULL);
+		g_object_unref(pixbuf);
+	}
+	requests++;
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, format, SOUP_MEMORY_TAKE, buf, len);
+}
+
+static void seed_done(GPid pid, gint wait, gpointer data)
+{
+	status = WIFEXITED(wait) ? WEXITSTATUS(wait) : -1;
+	g_spawn_close_pid(pid);
+	g_main_loop_quit(loop);
+}
+
+/* Run grits-cache with its cache in dir while serving requests, returns the
+ * exit status */
+static gint run(const gchar *cmd, const gchar *dir, gchar **args)
+{
+	gchar *argv[16] = {(gchar*)cmd};
+	for (gint i = 0; args[i] && i < G_N_ELEMENTS(argv)-2; i++)
+		argv[i+1] = args[i];
+
+	GPid    pid;
+	GError *error = NULL;
+	g_setenv("XDG_CACHE_HOME", dir, TRUE);
+	requests = 0;
+	if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD |
+			G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL, &pid, &error)) {
+		g_printerr("%s: %s\n", cmd, error->message);
+		g_error_free(error);
+		return -1;
+	}
+	g_child_watch_add(pid, seed_done, NULL);
+	g_main_loop_run(loop);
+	return status;
+}
+
+/* Number of files below path ending with suffix */
+static gint count(const gchar *path, const gchar *suffix)
+{
+	gint n = 0;
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const gchar *name;
+	while (dir && (name = g_dir_read_name(dir))) {
+		gchar *child = g_build_filename(path, name, NULL);
+		if (g_file_test(child, G_FILE_TEST_IS_DIR))
+			n += count(child, suffix);
+		else if (g_str_has_suffix(name, suffix))
+			n++;
+		g_free(child);
+	}
+	if (dir)
+		g_dir_close(dir);
+	return n;
+}
+
+/* Rename the files below path ending with suffix by appending extra */
+static void rename_all(const gchar *path, const gchar *suffix,
+		const gchar *extra)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const gchar *name;
+	while (dir && (name = g_dir_read_name(dir))) {
+		gchar *child = g_build_filename(path, name, NULL);
+		if (g_file_test(child, G_FILE_TEST_IS_DIR)) {
+			rename_all(child, suffix, extra);
+		} else if (g_str_has_suffix(name, suffix)) {
+			gchar *to = g_strconcat(child, extra, NULL);
+			g_rename(child, to);
+			g_free(to);
+		}
+		g_free(child);
+	}
+	if (dir)
+		g_dir_close(dir);
+}
+
+static void remove_all(const gchar *path)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const gchar *name;
+	while (dir && (name = g_dir_read_name(dir))) {
+		gchar *child = g_build_filename(path, name, NULL);
+		remove_all(child);
+		g_free(child);
+	}
+	if (dir)
+		g_dir_close(dir);
+	g_remove(path);
+}
+
+static gboolean check(const gchar *what, gint got, gint want)
+{
+	if (got == want)
+		return TRUE;
+	g_printerr("%s: got %d, expected %d\n", what, got, want);
+	return FALSE;
+}
+
+int main(int argc, char **argv)
+{
+	g_thread_init(NULL);
+	g_type_init();
+
+	const gchar *cmd = argc > 1 ? argv[1] : "./grits-cache";
+	SoupServer  *server = soup_server_new(SOUP_SERVER_PORT, 0, NULL);
+	if (!server) {
+		g_printerr("unable to start the server\n");
+		return 1;
+	}
+	soup_server_add_handler(server, "/wms", serve_wms, NULL, NULL);
+	soup_server_run_async(server);
+	loop = g_main_loop_new(NULL, FALSE);
+
+	gchar *uri  = g_strdup_printf("http://127.0.0.1:%u/wms",
+			soup_server_get_port(server));
+	gchar *tmp  = g_strdup_printf("%s/grits-seed-test-%d",
+			g_get_tmp_dir(), (gint)getpid());
+	gchar *dir  = g_build_filename(tmp, "cache", NULL);
+	gchar *osm  = g_build_filename(dir, PACKAGE, "osm",  NULL);
+	gchar *srtm = g_build_filename(dir, PACKAGE, "srtm", NULL);
+	gboolean ok = TRUE;
+
+	/* Three levels of 2x2 tiles take one request for the root and one
+	 * metatile for each parent of the levels below it */
+	gchar *map[] = {"seed", "--server", uri, "--max-level", "2", "map", NULL};
+	ok &= check("map status",   run(cmd, dir, map), 0);
+	ok &= check("map requests", requests, 1 + 1 + 4);
+	ok &= check("map tiles",    count(osm, ".png"), 1 + 4 + 16);
+	ok &= check("map metatiles", count(osm, "metatile.png"), 0);
+
+	/* Seeding again uses the cache */
+	ok &= check("cached status",   run(cmd, dir, map), 0);
+	ok &= check("cached requests", requests, 0);
+	remove_all(tmp);
+
+	/* Without metatiles each tile is a request */
+	gchar *single[] = {"seed", "--server", uri, "--max-level", "1",
+		"--no-metatile", "map", NULL};
+	ok &= check("single status",   run(cmd, dir, single), 0);
+	ok &= check("single requests", requests, 1 + 4);
+	remove_all(tmp);
+
+	/* Compressed elevation tiles count as cached */
+	gchar *elev[] = {"seed", "--server", uri, "--max-level", "1", "elev", NULL};
+	ok &= check("elev status",   run(cmd, dir, elev), 0);
+	ok &= check("elev requests", requests, 1 + 1);
+	rename_all(srtm, ".bil", ".delta");
+	ok &= check("delta status",   run(cmd, dir, elev), 0);
+	ok &= check("delta requests", requests, 0);
+
+	/* Imported tiles are seeded from the pack */
+	gchar *import[] = {"import", "--remove", "srtm/", NULL};
+	ok &= check("import status", run(cmd, dir, import), 0);
+	ok &= check("import files",  count(srtm, ".delta"), 0);
+	ok &= check("packed status",   run(cmd, dir, elev), 0);
+	ok &= check("packed requests", requests, 0);
+
+	/* The map plugin does not read packs, its files must be kept */
+	gchar *import_map[] = {"import", "--remove", "osm/", NULL};
+	ok &= check("import map status", run(cmd, dir, import_map), 1);
+	remove_all(tmp);
+
+	/* The rate limit still lets the seed finish */
+	gchar *rate[] = {"seed", "--server", uri, "--max-level", "1", "--rate", "4096",
+		"elev", NULL};
+	ok &= check("rate status",   run(cmd, dir, rate), 0);
+	ok &= check("rate requests", requests, 1 + 1);
+	remove_all(tmp);
+
+	g_print("%s\n", ok ? "pass" : "FAIL");
+	g_free(osm);
+	g_free(srtm);
+	g_free(dir);
+	g_free(tmp);
+	g_free(uri);
+	g_main_loop_unref(loop);
+	soup_server_quit(server);
+	g_object_unref(server);
+	return ok ? 0 : 1;
+}
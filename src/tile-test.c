@@ -51,8 +51,8 @@ gpointer do_bmng_cache(gpointer _image)
 	GtkImage *image = _image;
 	g_message("Creating bmng tile");
 	GritsTile *tile = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
-	tile->children[0][1] = grits_tile_new(tile, NORTH, 0, 0, WEST);
-	tile = tile->children[0][1];
+	grits_tile_child(tile, 0, 0) = grits_tile_new(tile, NORTH, 0, 0, WEST);
+	tile = grits_tile_child(tile, 0, 0);
 
 	g_message("Fetching bmng image");
 	GritsWms *bmng_wms = grits_wms_new(
@@ -77,8 +77,8 @@ gpointer do_osm_cache(gpointer _image)
 	GtkImage *image = _image;
 	g_message("Creating osm tile");
 	GritsTile *tile = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
-	tile->children[0][1] = grits_tile_new(tile, NORTH, 0, 0, WEST);
-	tile = tile->children[0][1];
+	grits_tile_child(tile, 0, 0) = grits_tile_new(tile, NORTH, 0, 0, WEST);
+	tile = grits_tile_child(tile, 0, 0);
 
 	g_message("Fetching osm image");
 	GritsWms *osm_wms = grits_wms_new(